@@ -0,0 +1,859 @@
+/** \file
+  * dfym-bench: Benchmarks of the library on a synthetic corpus.
+  *
+  * A directory tree and its database are generated from a seed, so that runs
+  * of two builds with the same parameters time the same work. Every entry
+  * point of dfym_base.h is timed over a number of iterations, and the
+  * percentiles of its latency and its throughput are written as JSON. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+/* SQLite */
+#include <sqlite3.h>
+/* Glib */
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "dfym_base.h"
+#include "dfym_output.h"
+
+/** Parameters of the synthetic corpus */
+typedef struct
+{
+  unsigned long int files;      /**< Number of files */
+  unsigned int tags;            /**< Number of tags */
+  unsigned int tags_per_file;   /**< Tags drawn for each file */
+  unsigned int fanout;          /**< Subdirectories per directory, and files per leaf directory */
+  guint32 seed;                 /**< Seed of the generator */
+} corpus_t;
+
+/** State of a benchmark run */
+typedef struct
+{
+  dfym_ctx_t *ctx;              /**< Database of the corpus */
+  char *root;                   /**< Root of the directory tree */
+  corpus_t corpus;              /**< Parameters of the corpus */
+  unsigned long int leaves;     /**< Number of leaf directories */
+  unsigned int depth;           /**< Levels of directories above the files, enough for the largest corpus of a sweep */
+  GRand *rand;                  /**< Generator, seeded from the corpus */
+  unsigned int iterations;      /**< Iterations of each benchmark */
+  FILE *report;                 /**< Where the results go */
+  int reported;                 /**< Number of results written */
+  GArray *samples;              /**< Nanoseconds taken by each iteration */
+} bench_t;
+
+static gint64 now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * G_GINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+/**
+ * Write a result of the library, as the program does.
+ */
+static void output_result (dfym_field_t const *fields, unsigned int n_fields, void *data)
+{
+  for (unsigned int k = 0; k < n_fields; k++)
+    if (fields[k].value)
+      dfym_output_field (fields[k].name, fields[k].value, fields[k].length);
+    else
+      dfym_output_integer (fields[k].name, fields[k].number);
+  dfym_output_end ();
+}
+
+/**
+ * Record an iteration started at the given time. Output of the library is
+ * flushed first, so that its cost is part of the iteration.
+ */
+static void bench_sample (bench_t *bench, gint64 start)
+{
+  gint64 elapsed;
+
+  dfym_output_flush ();
+  elapsed = now_ns () - start;
+  g_array_append_val (bench->samples, elapsed);
+}
+
+static int compare_samples (gconstpointer a, gconstpointer b)
+{
+  gint64 x = *(gint64 const *)a, y = *(gint64 const *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Percentile of the sorted samples, in microseconds, by the nearest rank.
+ */
+static double bench_percentile (bench_t *bench, unsigned int percent)
+{
+  guint rank = (bench->samples->len * percent + 99) / 100;
+
+  return g_array_index (bench->samples, gint64, MAX (rank, 1) - 1) / 1000.0;
+}
+
+/**
+ * Write the result of a benchmark from its samples, and clear them.
+ * \param name Name of the benchmark.
+ * \param operations Operations done by each iteration, for the throughput.
+ */
+static void bench_report (bench_t *bench, char const *const name, unsigned long int operations)
+{
+  gint64 total = 0;
+
+  if (!bench->samples->len)
+    return;
+  for (guint k = 0; k < bench->samples->len; k++)
+    total += g_array_index (bench->samples, gint64, k);
+  g_array_sort (bench->samples, compare_samples);
+  fprintf (bench->report,
+           "%s\n    {\"name\": \"%s\", \"files\": %lu, \"iterations\": %u, \"operations\": %lu, "
+           "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f, "
+           "\"ops_per_s\": %.1f}",
+           bench->reported++ ? "," : "", name, bench->corpus.files, bench->samples->len, operations,
+           bench_percentile (bench, 50), bench_percentile (bench, 90),
+           bench_percentile (bench, 99), bench_percentile (bench, 100),
+           total ? bench->samples->len * operations * 1e9 / total : 0.0);
+  fflush (bench->report);
+  g_array_set_size (bench->samples, 0);
+}
+
+/**
+ * Path of a leaf directory of the corpus: its index written in base fanout,
+ * one digit per level.
+ */
+static char *corpus_dir (bench_t *bench, unsigned long int leaf)
+{
+  GString *path = g_string_new (bench->root);
+  unsigned int digits[64];
+
+  for (unsigned int level = 0; level < bench->depth; level++)
+    {
+      digits[level] = leaf % bench->corpus.fanout;
+      leaf /= bench->corpus.fanout;
+    }
+  for (unsigned int level = bench->depth; level > 0; level--)
+    g_string_append_printf (path, "/%u", digits[level-1]);
+  return g_string_free (path, FALSE);
+}
+
+/**
+ * Path of a file of the corpus, fanout files going to each leaf directory.
+ */
+static char *corpus_file (bench_t *bench, unsigned long int file)
+{
+  char *dir = corpus_dir (bench, file / bench->corpus.fanout);
+  char *path = g_strdup_printf ("%s/f%lu", dir, file);
+
+  g_free (dir);
+  return path;
+}
+
+static char *corpus_tag (bench_t *bench)
+{
+  return g_strdup_printf ("tag%d", g_rand_int_range (bench->rand, 0, bench->corpus.tags));
+}
+
+static unsigned long int random_file (bench_t *bench)
+{
+  return g_rand_double (bench->rand) * bench->corpus.files;
+}
+
+/**
+ * Create the directory tree and tag it in a single bulk session, timed as the
+ * bulk_tag benchmark. Every file gets tags_per_file tags drawn uniformly, and
+ * every leaf directory one, so that -f and -d both have something to filter.
+ * \param from First file to create: a sweep grows the corpus of the previous
+ * size.
+ */
+static void corpus_generate (bench_t *bench, unsigned long int from)
+{
+  dfym_bulk_t *bulk;
+  unsigned long int count;
+  gint64 start;
+
+  bench->leaves = (bench->corpus.files + bench->corpus.fanout - 1) / bench->corpus.fanout;
+  for (unsigned long int leaf = from / bench->corpus.fanout; leaf < bench->leaves; leaf++)
+    {
+      char *dir = corpus_dir (bench, leaf);
+      g_mkdir_with_parents (dir, 0755);
+      for (unsigned long int file = MAX (leaf * bench->corpus.fanout, from);
+           file < MIN ((leaf + 1) * bench->corpus.fanout, bench->corpus.files); file++)
+        {
+          char *path = corpus_file (bench, file);
+          int fd = open (path, O_WRONLY | O_CREAT, 0644);
+          if (fd < 0)
+            {
+              fprintf (stderr, "Can't create %s: %s\n", path, strerror (errno));
+              exit (EXIT_FAILURE);
+            }
+          close (fd);
+          g_free (path);
+        }
+      g_free (dir);
+    }
+
+  start = now_ns ();
+  bulk = dfym_bulk_tag_begin (bench->ctx, 0);
+  for (unsigned long int file = from; file < bench->corpus.files; file++)
+    {
+      char *path = corpus_file (bench, file);
+      for (unsigned int k = 0; k < bench->corpus.tags_per_file; k++)
+        {
+          char *tag = corpus_tag (bench);
+          dfym_bulk_tag_add (bulk, tag, path);
+          g_free (tag);
+        }
+      g_free (path);
+    }
+  for (unsigned long int leaf = (from + bench->corpus.fanout - 1) / bench->corpus.fanout;
+       leaf < bench->leaves; leaf++)
+    {
+      char *dir = corpus_dir (bench, leaf);
+      char *tag = corpus_tag (bench);
+      dfym_bulk_tag_add (bulk, tag, dir);
+      g_free (tag);
+      g_free (dir);
+    }
+  dfym_bulk_tag_end (bulk, &count);
+  bench_sample (bench, start);
+  bench_report (bench, "bulk_tag", count);
+}
+
+/**
+ * Time dfym_search_with_tag with every combination of the -f, -d, -r and -v
+ * flags, plus limited searches.
+ */
+static void bench_search (bench_t *bench)
+{
+  static char const letters[] = "fdrv";
+  static unsigned char const flags[] = { OPT_FILES, OPT_DIRECTORIES, OPT_RANDOM, OPT_VERIFY };
+
+  for (unsigned char options = 0; options < 16; options++)
+    {
+      GString *name = g_string_new ("search");
+      unsigned char query_options = 0;
+
+      for (unsigned int k = 0; k < 4; k++)
+        if (options & (1 << k))
+          {
+            if (name->len == strlen ("search"))
+              g_string_append_c (name, '-');
+            g_string_append_c (name, letters[k]);
+            query_options |= flags[k];
+          }
+      for (unsigned int k = 0; k < bench->iterations; k++)
+        {
+          char *tag = corpus_tag (bench);
+          gint64 start = now_ns ();
+          dfym_search_with_tag (bench->ctx, tag, NULL, 0, query_options);
+          bench_sample (bench, start);
+          g_free (tag);
+        }
+      bench_report (bench, name->str, 1);
+      g_string_free (name, TRUE);
+    }
+  for (unsigned int r = 0; r < 3; r++)
+    {
+      static char const *const names[] = { "search-n10", "search-r-n10", "search-r-n1" };
+
+      for (unsigned int k = 0; k < bench->iterations; k++)
+        {
+          char *tag = corpus_tag (bench);
+          gint64 start = now_ns ();
+          dfym_search_with_tag (bench->ctx, tag, NULL, r == 2 ? 1 : 10, r ? OPT_RANDOM : 0);
+          bench_sample (bench, start);
+          g_free (tag);
+        }
+      bench_report (bench, names[r], 1);
+    }
+  /* Pages at random depths, which should all cost the same */
+  for (unsigned int k = 0; k < bench->iterations; k++)
+    {
+      char *tag = corpus_tag (bench);
+      sqlite3_int64 next;
+      gint64 start = now_ns ();
+      dfym_search_page (bench->ctx, tag, random_file (bench), 10, 0, &next);
+      bench_sample (bench, start);
+      g_free (tag);
+    }
+  bench_report (bench, "search-page-n10", 1);
+}
+
+/**
+ * Time dfym_search_query with each operator, evaluated with posting lists
+ * and then, on the same queries, by SQLite as a compound SELECT.
+ */
+static void bench_query (bench_t *bench)
+{
+  static char const *const operators[] = { "AND", "OR", "AND NOT" };
+  static char const *const names[] = { "query-and", "query-or", "query-and-not" };
+
+  for (unsigned int op = 0; op < G_N_ELEMENTS (operators); op++)
+    {
+      GPtrArray *queries = g_ptr_array_new_with_free_func (g_free);
+
+      for (unsigned int k = 0; k < bench->iterations; k++)
+        {
+          char *left = corpus_tag (bench), *right = corpus_tag (bench);
+          g_ptr_array_add (queries, g_strdup_printf ("%s %s %s", left, operators[op], right));
+          g_free (left);
+          g_free (right);
+        }
+      for (unsigned int sql = 0; sql < 2; sql++)
+        {
+          char *name = g_strdup_printf ("%s%s", names[op], sql ? "-sql" : "");
+
+          for (unsigned int k = 0; k < queries->len; k++)
+            {
+              gint64 start = now_ns ();
+              dfym_search_query (bench->ctx, g_ptr_array_index (queries, k), NULL, 0, sql ? OPT_SQL : 0);
+              bench_sample (bench, start);
+            }
+          bench_report (bench, name, 1);
+          g_free (name);
+        }
+      g_ptr_array_free (queries, TRUE);
+    }
+}
+
+/**
+ * Time the tagging functions, and the ones reading the tags of a file.
+ */
+static void bench_tagging (bench_t *bench)
+{
+  GPtrArray *paths = g_ptr_array_new_with_free_func (g_free);
+
+  for (unsigned int k = 0; k < bench->iterations; k++)
+    g_ptr_array_add (paths, corpus_file (bench, random_file (bench)));
+  for (unsigned int k = 0; k < paths->len; k++)
+    {
+      gint64 start = now_ns ();
+      dfym_add_tag (bench->ctx, "bench", g_ptr_array_index (paths, k));
+      bench_sample (bench, start);
+    }
+  bench_report (bench, "add_tag", 1);
+  for (unsigned int k = 0; k < paths->len; k++)
+    {
+      gint64 start = now_ns ();
+      dfym_show_file_tags (bench->ctx, g_ptr_array_index (paths, k));
+      bench_sample (bench, start);
+    }
+  bench_report (bench, "show_file_tags", 1);
+  for (unsigned int k = 0; k < paths->len; k++)
+    {
+      gint64 start = now_ns ();
+      dfym_untag (bench->ctx, "bench", g_ptr_array_index (paths, k));
+      bench_sample (bench, start);
+    }
+  bench_report (bench, "untag", 1);
+  g_ptr_array_free (paths, TRUE);
+}
+
+/**
+ * Time the functions listing whole tables or trees. These take much longer
+ * than the others, so they get a tenth of the iterations.
+ */
+static void bench_listings (bench_t *bench)
+{
+  unsigned int iterations = MAX (bench->iterations / 10, 1);
+  sqlite3_int64 next;
+
+  for (unsigned int k = 0; k < iterations; k++)
+    {
+      gint64 start = now_ns ();
+      dfym_all_tags (bench->ctx);
+      bench_sample (bench, start);
+    }
+  bench_report (bench, "all_tags", 1);
+  for (unsigned int k = 0; k < iterations; k++)
+    {
+      gint64 start = now_ns ();
+      dfym_all_files (bench->ctx);
+      bench_sample (bench, start);
+    }
+  bench_report (bench, "all_files", 1);
+  dfym_output_format (OUTPUT_NUL);
+  for (unsigned int k = 0; k < iterations; k++)
+    {
+      gint64 start = now_ns ();
+      dfym_all_files (bench->ctx);
+      bench_sample (bench, start);
+    }
+  bench_report (bench, "all_files_nul", 1);
+  dfym_output_format (OUTPUT_JSON);
+  for (unsigned int k = 0; k < iterations; k++)
+    {
+      gint64 start = now_ns ();
+      dfym_all_files (bench->ctx);
+      bench_sample (bench, start);
+    }
+  bench_report (bench, "all_files_json", 1);
+  dfym_output_format (OUTPUT_LINES);
+  for (unsigned int k = 0; k < bench->iterations; k++)
+    {
+      gint64 start = now_ns ();
+      dfym_all_files_page (bench->ctx, random_file (bench), 100, &next);
+      bench_sample (bench, start);
+    }
+  bench_report (bench, "all_files_page-n100", 1);
+  for (unsigned int k = 0; k < bench->iterations; k++)
+    {
+      char *dir = corpus_dir (bench, g_rand_int_range (bench->rand, 0, bench->leaves));
+      gint64 start = now_ns ();
+      dfym_discover_untagged (bench->ctx, dir, 0, 0);
+      bench_sample (bench, start);
+      g_free (dir);
+    }
+  bench_report (bench, "discover", 1);
+  for (unsigned int k = 0; k < bench->iterations; k++)
+    {
+      char *dir = corpus_dir (bench, g_rand_int_range (bench->rand, 0, bench->leaves));
+      gint64 start = now_ns ();
+      dfym_discover_untagged (bench->ctx, dir, 0, OPT_FILES);
+      bench_sample (bench, start);
+      g_free (dir);
+    }
+  bench_report (bench, "discover-f", 1);
+  for (unsigned int k = 0; k < iterations; k++)
+    {
+      gint64 start = now_ns ();
+      dfym_discover_untagged_recursive (bench->ctx, bench->root, 0, 0, 0, 0);
+      bench_sample (bench, start);
+    }
+  bench_report (bench, "discover-R", 1);
+  for (unsigned int k = 0; k < iterations; k++)
+    {
+      gint64 start = now_ns ();
+      dfym_gc (bench->ctx, 0, G_MAXINT64, 0, 0, 0, 0, NULL);
+      bench_sample (bench, start);
+    }
+  bench_report (bench, "gc", bench->corpus.files + bench->leaves);
+}
+
+/**
+ * Time renames, each one being undone by the next iteration.
+ */
+static void bench_renames (bench_t *bench)
+{
+  char *top = g_strdup_printf ("%s/0", bench->root);
+  char *moved = g_strdup_printf ("%s/0.moved", bench->root);
+
+  for (unsigned int k = 0; k < bench->iterations; k++)
+    {
+      char *path = corpus_file (bench, random_file (bench));
+      char *renamed = g_strconcat (path, ".moved", NULL);
+      gint64 start = now_ns ();
+      dfym_rename_file (bench->ctx, path, renamed);
+      bench_sample (bench, start);
+      dfym_rename_file (bench->ctx, renamed, path);
+      g_free (renamed);
+      g_free (path);
+    }
+  bench_report (bench, "rename_file", 1);
+  for (unsigned int k = 0; k < bench->iterations; k++)
+    {
+      gint64 start = now_ns ();
+      dfym_rename_dir (bench->ctx, k % 2 ? moved : top, k % 2 ? top : moved, NULL);
+      bench_sample (bench, start);
+    }
+  if (bench->iterations % 2)
+    dfym_rename_dir (bench->ctx, moved, top, NULL);
+  bench_report (bench, "rename_dir", 1);
+  for (unsigned int k = 0; k < bench->iterations; k++)
+    {
+      gint64 start = now_ns ();
+      dfym_rename_tag (bench->ctx, k % 2 ? "tag0.renamed" : "tag0", k % 2 ? "tag0" : "tag0.renamed");
+      bench_sample (bench, start);
+    }
+  if (bench->iterations % 2)
+    dfym_rename_tag (bench->ctx, "tag0.renamed", "tag0");
+  bench_report (bench, "rename_tag", 1);
+  g_free (top);
+  g_free (moved);
+}
+
+/**
+ * Time deletions, last as they eat into the corpus.
+ */
+static void bench_deletions (bench_t *bench)
+{
+  for (unsigned int k = 0; k < bench->iterations; k++)
+    {
+      char *path = corpus_file (bench, random_file (bench));
+      gint64 start = now_ns ();
+      dfym_delete_file (bench->ctx, path);
+      bench_sample (bench, start);
+      g_free (path);
+    }
+  bench_report (bench, "delete_file", 1);
+  for (unsigned int k = 0; k < MIN (bench->iterations, bench->leaves); k++)
+    {
+      char *dir = corpus_dir (bench, k * (bench->leaves / MIN (bench->iterations, bench->leaves)));
+      gint64 start = now_ns ();
+      dfym_delete_dir (bench->ctx, dir, NULL);
+      bench_sample (bench, start);
+      g_free (dir);
+    }
+  bench_report (bench, "delete_dir", 1);
+  for (unsigned int k = 0; k < MIN (bench->iterations, bench->corpus.tags); k++)
+    {
+      char *tag = g_strdup_printf ("tag%u", k);
+      gint64 start = now_ns ();
+      dfym_delete_tag (bench->ctx, tag);
+      bench_sample (bench, start);
+      g_free (tag);
+    }
+  bench_report (bench, "delete_tag", 1);
+}
+
+/**
+ * Run a dfym command from a stress worker.
+ * \return Whether it failed: it exited with an error, or wrote that the
+ * database was busy or failed.
+ */
+static int stress_run (char **argv)
+{
+  char *errors = NULL;
+  int wait_status, failed;
+
+  if (!g_spawn_sync (NULL, argv, NULL, G_SPAWN_STDOUT_TO_DEV_NULL, NULL, NULL,
+                     NULL, &errors, &wait_status, NULL))
+    {
+      fprintf (stderr, "dfym-bench: can't run %s\n", argv[0]);
+      return 1;
+    }
+  failed = !WIFEXITED (wait_status) || WEXITSTATUS (wait_status)
+           || strstr (errors, "Database error") || strstr (errors, "SQLITE_BUSY")
+           || strstr (errors, "database is locked");
+  if (failed)
+    fprintf (stderr, "dfym-bench: dfym %s %s failed: %s", argv[1], argv[2],
+             *errors ? errors : "no message\n");
+  g_free (errors);
+  return failed;
+}
+
+/**
+ * Worker of the stress test, in a process of its own: tag, show, search and
+ * untag random files of the corpus by running dfym, iterations times.
+ * \return Number of commands that failed.
+ */
+static unsigned int stress_worker (bench_t *bench, char *dfym, unsigned int worker)
+{
+  char *tag = g_strdup_printf ("stress%u", worker);
+  unsigned int failures = 0;
+
+  /* Every worker draws its own files */
+  g_rand_set_seed (bench->rand, bench->corpus.seed + worker + 1);
+  for (unsigned int k = 0; k < bench->iterations; k++)
+    {
+      char *path = corpus_file (bench, random_file (bench));
+      char *query = corpus_tag (bench);
+      char *tag_argv[] = { dfym, "tag", tag, path, NULL };
+      char *show_argv[] = { dfym, "show", path, NULL };
+      char *search_argv[] = { dfym, "search", query, NULL };
+      char *untag_argv[] = { dfym, "untag", tag, path, NULL };
+
+      failures += stress_run (tag_argv);
+      failures += stress_run (show_argv);
+      failures += stress_run (search_argv);
+      failures += stress_run (untag_argv);
+      g_free (path);
+      g_free (query);
+    }
+  g_free (tag);
+  return failures;
+}
+
+/**
+ * Stress test: fork processes running dfym commands on the corpus, while a
+ * bulk tagging session keeps tagging it, and check that no command failed.
+ * Each worker runs 4 commands per iteration, and the bulk session tags all
+ * the files again with a new tag until every worker is done.
+ * \return Whether every command and the bulk session succeeded.
+ */
+static int bench_stress (bench_t *bench, char const *const db_path,
+                         char *dfym, unsigned int processes)
+{
+  dfym_bulk_t *bulk;
+  unsigned long int count = 0, round = 0;
+  unsigned int running = 0, failed = 0, bulk_failed = 0;
+  int wait_status;
+  pid_t pid;
+
+  g_setenv ("DFYM_DATABASE", db_path, TRUE);
+  g_setenv ("DFYM_NO_DAEMON", "1", TRUE);
+  /* Buffered results would be written by every worker too */
+  fflush (bench->report);
+  for (unsigned int worker = 0; worker < processes; worker++)
+    {
+      if ((pid = fork ()) < 0)
+        {
+          fprintf (stderr, "Can't fork: %s\n", strerror (errno));
+          failed++;
+          break;
+        }
+      if (!pid)
+        _exit (stress_worker (bench, dfym, worker) ? EXIT_FAILURE : EXIT_SUCCESS);
+      running++;
+    }
+
+  bulk = dfym_bulk_tag_begin (bench->ctx, 0);
+  while (running && !bulk_failed)
+    {
+      char *tag = g_strdup_printf ("bulk%lu", round++);
+      for (unsigned long int file = 0; file < bench->corpus.files && running; file++)
+        {
+          char *path = corpus_file (bench, file);
+          if (dfym_bulk_tag_add (bulk, tag, path) != DFYM_OK)
+            {
+              fprintf (stderr, "dfym-bench: bulk tagging failed: %s\n", dfym_errmsg (bench->ctx));
+              bulk_failed = 1;
+              g_free (path);
+              break;
+            }
+          g_free (path);
+          for (; running && (pid = waitpid (-1, &wait_status, WNOHANG)) > 0; running--)
+            failed += !WIFEXITED (wait_status) || WEXITSTATUS (wait_status);
+        }
+      g_free (tag);
+    }
+  if (dfym_bulk_tag_end (bulk, &count) != DFYM_OK && !bulk_failed)
+    {
+      fprintf (stderr, "dfym-bench: bulk tagging failed: %s\n", dfym_errmsg (bench->ctx));
+      bulk_failed = 1;
+    }
+  for (; running && waitpid (-1, &wait_status, 0) > 0; running--)
+    failed += !WIFEXITED (wait_status) || WEXITSTATUS (wait_status);
+
+  fprintf (bench->report,
+           "%s\n    {\"name\": \"stress\", \"processes\": %u, \"iterations\": %u, "
+           "\"commands\": %u, \"failed_processes\": %u, \"bulk_taggings\": %lu, "
+           "\"bulk_failed\": %u}",
+           bench->reported++ ? "," : "", processes, bench->iterations,
+           processes * bench->iterations * 4, failed, count, bulk_failed);
+  return !failed && !bulk_failed;
+}
+
+static int remove_entry (char const *path, struct stat const *st, int flag, struct FTW *ftw)
+{
+  return remove (path);
+}
+
+static void usage (void)
+{
+  printf ("Usage: dfym-bench [flags]\n"
+          "\n"
+          "Generates a directory tree and its database, times every library function\n"
+          "on it and writes the results as JSON.\n"
+          "\n"
+          "Flags:\n"
+          "  --files N            files of the corpus (default 10000)\n"
+          "  --tags N             tags of the corpus (default 100)\n"
+          "  --tags-per-file N    tags drawn for each file (default 3)\n"
+          "  --fanout N           subdirectories per directory, files per leaf (default 10)\n"
+          "  --seed N             seed of the corpus and of the benchmarks (default 1)\n"
+          "  --iterations N       iterations of each benchmark (default 100)\n"
+          "  --dir DIR            where to generate the corpus (default a temporary directory)\n"
+          "  --output FILE        write the results to FILE instead of standard output\n"
+          "  --keep               keep the corpus after the run\n"
+          "  --sweep N            instead of every benchmark, time tagging and untagging\n"
+          "                       on N corpus sizes, doubling --files every time\n"
+          "  --stress N           instead of timing, run N processes tagging, searching\n"
+          "                       and untagging with dfym next to a bulk tagging session,\n"
+          "                       and fail if any command does\n"
+          "  --dfym PATH          dfym program run by --stress (default the one next to\n"
+          "                       dfym-bench)\n"
+          "\n"
+          "DFYM_BUSY_TIMEOUT is applied to all the connections of --stress, 0 makes it\n"
+          "fail as soon as two writers meet.\n");
+}
+
+int main (int argc, char **argv)
+{
+  static struct option long_options[] =
+  {
+    {"files", required_argument, 0, 'f'},
+    {"tags", required_argument, 0, 't'},
+    {"tags-per-file", required_argument, 0, 'p'},
+    {"fanout", required_argument, 0, 'o'},
+    {"seed", required_argument, 0, 's'},
+    {"iterations", required_argument, 0, 'i'},
+    {"dir", required_argument, 0, 'D'},
+    {"output", required_argument, 0, 'O'},
+    {"keep", no_argument, 0, 'k'},
+    {"sweep", required_argument, 0, 'w'},
+    {"stress", required_argument, 0, 'S'},
+    {"dfym", required_argument, 0, 'd'},
+    {"help", no_argument, 0, 'h'},
+    {0, 0, 0, 0}
+  };
+  bench_t bench;
+  char *dir = NULL, *output = NULL, *db_path, *dfym = NULL;
+  int opt, keep = 0, status = EXIT_SUCCESS;
+  unsigned long int capacity, leaves, largest;
+  unsigned int stress = 0, sweep = 0;
+
+  memset (&bench, 0, sizeof (bench));
+  bench.corpus.files = 10000;
+  bench.corpus.tags = 100;
+  bench.corpus.tags_per_file = 3;
+  bench.corpus.fanout = 10;
+  bench.corpus.seed = 1;
+  bench.iterations = 100;
+  while ((opt = getopt_long (argc, argv, "", long_options, NULL)) != -1)
+    {
+      switch (opt)
+        {
+        case 'f':
+          bench.corpus.files = strtoul (optarg, NULL, 10);
+          break;
+        case 't':
+          bench.corpus.tags = atoi (optarg);
+          break;
+        case 'p':
+          bench.corpus.tags_per_file = atoi (optarg);
+          break;
+        case 'o':
+          bench.corpus.fanout = atoi (optarg);
+          break;
+        case 's':
+          bench.corpus.seed = strtoul (optarg, NULL, 10);
+          break;
+        case 'i':
+          bench.iterations = atoi (optarg);
+          break;
+        case 'D':
+          dir = optarg;
+          break;
+        case 'O':
+          output = optarg;
+          break;
+        case 'k':
+          keep = 1;
+          break;
+        case 'w':
+          sweep = atoi (optarg);
+          break;
+        case 'S':
+          stress = atoi (optarg);
+          break;
+        case 'd':
+          dfym = g_strdup (optarg);
+          break;
+        case 'h':
+          usage ();
+          exit (EXIT_SUCCESS);
+        default:
+          usage ();
+          exit (EXIT_FAILURE);
+        }
+    }
+  if (optind != argc || !bench.corpus.files || !bench.corpus.tags
+      || bench.corpus.fanout < 2 || !bench.iterations || sweep > 32)
+    {
+      usage ();
+      exit (EXIT_FAILURE);
+    }
+
+  if (dir)
+    {
+      g_mkdir_with_parents (dir, 0755);
+      bench.root = realpath (dir, NULL);
+    }
+  else
+    bench.root = g_dir_make_tmp ("dfym-bench-XXXXXX", NULL);
+  if (!bench.root)
+    {
+      fprintf (stderr, "Can't create the corpus directory\n");
+      exit (EXIT_FAILURE);
+    }
+  /* The results go to the report, the output of the library to /dev/null */
+  bench.report = output ? fopen (output, "w") : fdopen (dup (STDOUT_FILENO), "w");
+  if (!bench.report || !freopen ("/dev/null", "w", stdout))
+    {
+      fprintf (stderr, "Can't open the output: %s\n", strerror (errno));
+      exit (EXIT_FAILURE);
+    }
+
+  /* Paths don't change as a sweep grows the corpus */
+  largest = sweep ? bench.corpus.files << (sweep - 1) : bench.corpus.files;
+  leaves = (largest + bench.corpus.fanout - 1) / bench.corpus.fanout;
+  for (bench.depth = 1, capacity = bench.corpus.fanout; capacity < leaves; bench.depth++)
+    capacity *= bench.corpus.fanout;
+  bench.rand = g_rand_new_with_seed (bench.corpus.seed);
+  bench.samples = g_array_new (FALSE, FALSE, sizeof (gint64));
+  db_path = g_build_filename (bench.root, "bench.db", NULL);
+  bench.ctx = dfym_open_or_create_database (db_path);
+  if (dfym_errmsg (bench.ctx))
+    {
+      fprintf (stderr, "Can't open %s: %s\n", db_path, dfym_errmsg (bench.ctx));
+      exit (EXIT_FAILURE);
+    }
+  dfym_set_seed (bench.ctx, bench.corpus.seed);
+  if (getenv ("DFYM_BUSY_TIMEOUT"))
+    dfym_set_busy_timeout (bench.ctx, strtoul (getenv ("DFYM_BUSY_TIMEOUT"), NULL, 10));
+  dfym_set_result_handler (bench.ctx, output_result, NULL);
+
+  fprintf (bench.report,
+           "{\n  \"corpus\": {\"files\": %lu, \"tags\": %u, \"tags_per_file\": %u, "
+           "\"fanout\": %u, \"seed\": %u},\n"
+           "  \"sweep\": %u,\n  \"iterations\": %u,\n  \"sqlite\": \"%s\",\n  \"results\": [",
+           bench.corpus.files, bench.corpus.tags, bench.corpus.tags_per_file,
+           bench.corpus.fanout, bench.corpus.seed, sweep, bench.iterations, sqlite3_libversion ());
+  corpus_generate (&bench, 0);
+  if (sweep)
+    {
+      /* Untagging, like tagging, should take as long on every size */
+      bench_tagging (&bench);
+      for (unsigned int step = 1; step < sweep; step++)
+        {
+          unsigned long int from = bench.corpus.files;
+          bench.corpus.files *= 2;
+          corpus_generate (&bench, from);
+          bench_tagging (&bench);
+        }
+    }
+  else if (stress)
+    {
+      if (!dfym)
+        {
+          char *bin_dir = g_path_get_dirname (argv[0]);
+          dfym = g_build_filename (bin_dir, "dfym", NULL);
+          g_free (bin_dir);
+        }
+      if (!bench_stress (&bench, db_path, dfym, stress))
+        status = EXIT_FAILURE;
+    }
+  else
+    {
+      bench_tagging (&bench);
+      bench_search (&bench);
+      bench_query (&bench);
+      bench_listings (&bench);
+      bench_renames (&bench);
+      bench_deletions (&bench);
+    }
+  fprintf (bench.report, "\n  ]\n}\n");
+  fclose (bench.report);
+
+  dfym_close_database (bench.ctx);
+  if (!keep)
+    nftw (bench.root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  g_free (db_path);
+  g_free (dfym);
+  g_array_free (bench.samples, TRUE);
+  g_rand_free (bench.rand);
+  free (bench.root);
+  return status;
+}
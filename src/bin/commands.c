@@ -0,0 +1,1234 @@
+/** \file
+  * dfym: Commands. Parses the arguments of a command and runs it, both for
+  * the program and for the daemon serving it. */
+
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <signal.h>
+/* SQLite */
+#include <sqlite3.h>
+/* Glib */
+#include <glib.h>
+
+#include "dfym_base.h"
+#include "dfym_output.h"
+#include "dfym_watch.h"
+#include "commands.h"
+
+/**
+ * Get the path of a file in the home directory of the user.
+ */
+gchar *home_file (char const *const name)
+{
+  struct passwd *pw = getpwuid (getuid ());
+
+  return g_strconcat (pw->pw_dir, G_DIR_SEPARATOR_S, name, NULL);
+}
+
+/**
+ * Path of the database: DFYM_DATABASE, or ~/.dfym.db by default.
+ */
+gchar *database_file (void)
+{
+  if (getenv ("DFYM_DATABASE"))
+    return g_strdup (getenv ("DFYM_DATABASE"));
+  return home_file (".dfym.db");
+}
+
+/**
+ * Report a database error, with what failed.
+ */
+static void database_error (dfym_ctx_t *ctx)
+{
+  if (dfym_errmsg (ctx))
+    fprintf (stderr, "Database error: %s\n", dfym_errmsg (ctx));
+  else
+    fprintf (stderr, "Database error\n");
+}
+
+/**
+ * Write a result of the library, see \ref dfym_set_result_handler.
+ */
+static void output_result (dfym_field_t const *fields, unsigned int n_fields, void *data)
+{
+  for (unsigned int k = 0; k < n_fields; k++)
+    if (fields[k].value)
+      dfym_output_field (fields[k].name, fields[k].value, fields[k].length);
+    else
+      dfym_output_integer (fields[k].name, fields[k].number);
+  dfym_output_end ();
+}
+
+/**
+ * Log a migration of the schema, see \ref dfym_migrations.
+ */
+static void log_migration (dfym_field_t const *fields, unsigned int n_fields, void *data)
+{
+  fprintf (stderr, "dfym: database migrated to version %lld (%s) in %.1f ms\n",
+           (long long)fields[0].number, fields[1].value, fields[2].number / 1000.0);
+}
+
+/**
+ * Log the progress of a watch, see \ref dfym_watch.
+ */
+static void log_watch (dfym_field_t const *fields, unsigned int n_fields, void *data)
+{
+  double burst;
+
+  if (!strcmp (fields[0].name, "warning"))
+    fprintf (stderr, "dfym: %s\n", fields[0].value);
+  else if (!strcmp (fields[0].name, "watched"))
+    fprintf (stderr, "dfym: watching %lld directories\n", (long long)fields[0].number);
+  else
+    {
+      burst = MAX (fields[1].number, 1000) / (double)G_USEC_PER_SEC;
+      fprintf (stderr, "dfym: %lld events (%.0f events/s), %lld files updated in %.1f ms\n",
+               (long long)fields[0].number, fields[0].number / burst,
+               (long long)fields[2].number, fields[3].number / 1000.0);
+    }
+}
+
+/**
+ * Tell whether an argument following the tag command starts bulk tagging.
+ * Other arguments starting with '-' are tags.
+ */
+int is_bulk_flag (char const *const arg)
+{
+  return !strcmp (arg, "-0") || !strcmp (arg, "--null") || !strcmp (arg, "--stdin")
+         || !strcmp (arg, "--from") || !strncmp (arg, "--from=", 7);
+}
+
+/**
+ * Log the migrations of the schema done when the database was opened.
+ */
+void report_migrations (dfym_ctx_t *ctx)
+{
+  dfym_set_result_handler (ctx, log_migration, NULL);
+  dfym_migrations (ctx);
+  dfym_set_result_handler (ctx, NULL, NULL);
+}
+
+/**
+ * Tag the files read from a stream, using a bulk tagging session.
+ * Records are separated by the given delimiter. If tags are given, every
+ * record is a path to tag with all of them. Otherwise every record is a tag
+ * and a path separated by a tab.
+ */
+static int tag_from_stream (dfym_ctx_t *ctx, FILE *input, int delimiter, int tagc, char **tags)
+{
+  dfym_bulk_t *bulk = dfym_bulk_tag_begin (ctx, 0);
+  char *record = NULL;
+  size_t record_size = 0;
+  ssize_t length;
+  unsigned long int count = 0, skipped = 0;
+  gint64 start = g_get_monotonic_time ();
+  double elapsed;
+
+  while ((length = getdelim (&record, &record_size, delimiter, input)) != -1)
+    {
+      char *argument_path = record;
+      char *tag = NULL;
+      char path[PATH_MAX];
+      int status = DFYM_OK;
+
+      if (length && record[length-1] == delimiter)
+        record[--length] = '\0';
+      if (!length)
+        continue;
+      if (!tagc)
+        {
+          char *separator = strchr (record, '\t');
+          if (!separator)
+            {
+              fprintf (stderr, "Missing tab between tag and path: %s\n", record);
+              skipped++;
+              continue;
+            }
+          *separator = '\0';
+          tag = record;
+          argument_path = separator + 1;
+        }
+      if (!realpath (argument_path, path))
+        {
+          fprintf (stderr, "Skipping %s: %s\n", argument_path, strerror (errno));
+          skipped++;
+          continue;
+        }
+      if (tag)
+        status = dfym_bulk_tag_add (bulk, tag, path);
+      else
+        for (int i=0; i<tagc && status == DFYM_OK; i++)
+          status = dfym_bulk_tag_add (bulk, tags[i], path);
+      if (status != DFYM_OK)
+        {
+          database_error (ctx);
+          free (record);
+          dfym_bulk_tag_end (bulk, NULL);
+          return EXIT_FAILURE;
+        }
+    }
+  free (record);
+  if (dfym_bulk_tag_end (bulk, &count) != DFYM_OK)
+    {
+      database_error (ctx);
+      return EXIT_FAILURE;
+    }
+
+  elapsed = (g_get_monotonic_time () - start) / (double)G_USEC_PER_SEC;
+  fprintf (stderr, "Tagged %lu pairs in %.2f s (%.0f pairs/s), %lu records skipped\n",
+           count, elapsed, elapsed > 0 ? count / elapsed : 0.0, skipped);
+  return EXIT_SUCCESS;
+}
+
+/** Set by SIGINT and SIGTERM to end the watch command */
+static volatile sig_atomic_t watch_stop = 0;
+
+static void stop_watching (int signum)
+{
+  watch_stop = 1;
+}
+
+/**
+ * Run a command, without the global flags.
+ */
+static int dispatch_command (dfym_ctx_t *ctx, int argc, char **argv)
+{
+  /* Arguments may be parsed more than once in the same process */
+  optind = 0;
+
+  /* help command */
+  if (!strcmp ("help", argv[1]))
+    {
+      printf ("Usage: dfym [global flags] [command] [flags] [arguments...]\n"
+              "\n"
+              "Global flags:\n"
+              "-0, --null                separate results by NUL instead of newline\n"
+              "--json                    write results as JSON lines\n"
+              "--trace[=FILE]            write every SQL statement run, with its time and rows,\n"
+              "                          as JSON lines to stderr or FILE\n"
+              "--stats[=FILE]            write statistics of the command as JSON to stderr or\n"
+              "                          FILE: time, caches, filesystem calls and statements\n"
+              "\n"
+              "Commands:\n"
+              "tag [tags...] [file]          add tag to file or directory\n"
+              "tag [flags] [tags...]     add tags to the files read from a list\n"
+              "                            flags:\n"
+              "                              --stdin read the list from standard input\n"
+              "                              --from FILE read the list from FILE\n"
+              "                              -0 records are separated by NUL instead of newline\n"
+              "                            without tags, every record is: tag TAB file\n"
+              "                          tags that look like these flags follow --\n"
+              "untag [tags...] [file]        remove tag from file or directory\n"
+              "show [file]               show the tags of a file directory\n"
+              "tags                      show all defined tags\n"
+              "                            flags:\n"
+              "                              --prefix TEXT show only the tags starting with TEXT\n"
+              "                              --fuzzy TEXT show the tags starting like TEXT, closest\n"
+              "                                 first, allowing for typos\n"
+              "                              -eX with --fuzzy, allow at most X typos (up to 3)\n"
+              "                              --count show the number of files of each tag,\n"
+              "                                 the most used first\n"
+              "                              --empty show only the tags without files\n"
+              "                              -nX show only the first X tags\n"
+              "tagged                    show tagged files\n"
+              "                            flags:\n"
+              "                              --after C -nX show a page of X files, after the\n"
+              "                                 cursor C, 0 for the first page\n"
+              "search [query]            search for files or directories that match a tag, or an\n"
+              "                          expression of tags with AND, OR, NOT and parentheses\n"
+              "                            flags:\n"
+              "                              -f show only files\n"
+              "                              -d show only directories\n"
+              "                              -nX show only the first X occurences of the query\n"
+              "                              -r randomize order of results\n"
+              "                              -v check results against the filesystem, skipping\n"
+              "                                 missing files and updating changed ones\n"
+              "                              --seed X with -r, draw the same results every\n"
+              "                                 time for the same X\n"
+              "                              --match TEXT show only the files with a path\n"
+              "                                 matching TEXT, as find does\n"
+              "                              --after C show a page of the files of a tag, as\n"
+              "                                 tagged does, with -f -d -nX\n"
+              "find [text]               search for files or directories whose name, or the\n"
+              "                          name of a directory above them, matches the text;\n"
+              "                          words match whole words, word* matches a prefix\n"
+              "                            flags:\n"
+              "                              -f -d -nX -r -v --seed as for search\n"
+              "discover [directory]      list untagged files within a given directory\n"
+              "                            flags:\n"
+              "                              -f show only files\n"
+              "                              -d show only directories\n"
+              "                              -nX show only the first X occurences of the query\n"
+              "                              -r randomize order of results\n"
+              "                              -R look into subdirectories too\n"
+              "                              -mX with -R, look at most X levels deep\n"
+              "                              -jX with -R, read directories with X threads\n"
+              "rename [file] [file]      rename files or directories\n"
+              "                            flags:\n"
+              "                              -R move everything tagged below a directory\n"
+              "rename-tag [tag] [tag]    rename a tag\n"
+              "delete [file] [file]      delete files or directories\n"
+              "                            flags:\n"
+              "                              -R delete everything tagged below a directory\n"
+              "delete-tag [tag] [tag]    delete a tag\n"
+              "gc                        list tagged files that are missing or changed type\n"
+              "                          and the ones that can't be checked, with the error\n"
+              "                            flags:\n"
+              "                              --prune delete them from the database\n"
+              "                              --from ID start with the file of this id\n"
+              "                              --to ID end with the file of this id\n"
+              "                              -nX check at most X files\n"
+              "                              -tX stop loading files after X seconds\n"
+              "                              -jX check X files at once\n"
+              "stats                     show the number of tags, files and taggings\n"
+              "                            flags:\n"
+              "                              --check count the files of each tag again and\n"
+              "                                 fix the stored counts that are wrong\n"
+              "watch [directories...]    apply the moves and deletions done in the directories,\n"
+              "                          by default the ones holding tagged files, until stopped\n"
+              "                            flags:\n"
+              "                              -wX watch at most X directories\n"
+             );
+      return EXIT_SUCCESS;
+    }
+  /* TAG command, bulk mode */
+  else if (!strcmp ("tag", argv[1]) && argc > 2 && is_bulk_flag (argv[2]))
+    {
+      static struct option long_options[] =
+      {
+        {"stdin", no_argument, 0, 's'},
+        {"from", required_argument, 0, 'F'},
+        {"null", no_argument, 0, '0'},
+        {0, 0, 0, 0}
+      };
+      int opt;
+      int delimiter = '\n';
+      int from_stdin = 0;
+      char *from_file = NULL;
+      FILE *input;
+      int status;
+      /* Command flags */
+      while ((opt = getopt_long (argc-1, argv+1, "+0", long_options, NULL)) != -1)
+        {
+          switch (opt)
+            {
+            case 's':
+              from_stdin = 1;
+              break;
+            case 'F':
+              from_file = optarg;
+              break;
+            case '0':
+              delimiter = '\0';
+              break;
+            case '?':
+              return EXIT_FAILURE;
+              break;
+            default:
+              abort ();
+            }
+        }
+      optind++; /* we are looking into the command, not the executable */
+      if (from_stdin == !!from_file)
+        {
+          fprintf (stderr, "Bulk tagging needs either --stdin or --from. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      if (from_file)
+        {
+          if (!(input = fopen (from_file, "r")))
+            {
+              fprintf (stderr, "Can't open %s: %s\n", from_file, strerror (errno));
+              return EXIT_FAILURE;
+            }
+        }
+      else
+        input = stdin;
+      status = tag_from_stream (ctx, input, delimiter, argc - optind, argv + optind);
+      if (from_file)
+        fclose (input);
+      return status;
+    }
+  /* TAG command */
+  else if (!strcmp ("tag", argv[1]))
+    {
+      /* Tags that look like flags follow -- */
+      int first = argc > 2 && !strcmp (argv[2], "--") ? 3 : 2;
+      if (argc < first + 2)
+        {
+          fprintf (stderr, "Wrong number of arguments. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      else
+        {
+          int i;
+          for (i=first; i< (argc-1); i++)
+            {
+              const char *tag = argv[i];
+              const char *argument_path = argv[argc-1];
+              char path[PATH_MAX];
+              if (realpath (argument_path, path))
+                switch (dfym_add_tag (ctx, tag, path))
+                  {
+                  case DFYM_OK:
+                    break;
+                  default:
+                    database_error (ctx);
+                    return EXIT_FAILURE;
+                  }
+              else
+                switch (errno)
+                  {
+                  case ENOENT:
+                    fprintf (stderr, "File doesn't exist\n");
+                    return EXIT_FAILURE;
+                  default:
+                    fprintf (stderr, "Unknown error\n");
+                    return EXIT_FAILURE;
+                  }
+            }
+        }
+    }
+  /* UNTAG command */
+  else if (!strcmp ("untag", argv[1]))
+    {
+      /* Tags that look like flags follow -- */
+      int first = argc > 2 && !strcmp (argv[2], "--") ? 3 : 2;
+      if (argc < first + 2)
+        {
+          fprintf (stderr, "Wrong number of arguments. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      else
+        {
+          int i;
+          for (i=first; i< (argc-1); i++)
+            {
+              const char *tag = argv[i];
+              const char *argument_path = argv[argc-1];
+              char path[PATH_MAX];
+              if (realpath (argument_path, path))
+                switch (dfym_untag (ctx, tag, path))
+                  {
+                  case DFYM_OK:
+                    break;
+                  case DFYM_NOT_EXISTS:
+                    fprintf (stderr, "File not found in the database\n");
+                    return EXIT_FAILURE;
+                  default:
+                    database_error (ctx);
+                    return EXIT_FAILURE;
+                  }
+              else
+                switch (errno)
+                  {
+                  case ENOENT:
+                    fprintf (stderr, "File doesn't exist\n");
+                    return EXIT_FAILURE;
+                  default:
+                    fprintf (stderr, "Unknown error\n");
+                    return EXIT_FAILURE;
+                  }
+            }
+        }
+    }
+  /* SHOW command */
+  else if (!strcmp ("show", argv[1]))
+    {
+      if (argc != 3)
+        {
+          fprintf (stderr, "Wrong number of arguments. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      else
+        {
+          const char *argument_path = argv[2];
+          char path[PATH_MAX];
+          if (realpath (argument_path, path))
+            switch ( dfym_show_file_tags (ctx, path))
+              {
+              case DFYM_OK:
+                break;
+              case DFYM_NOT_EXISTS:
+                fprintf (stderr, "File not found in the database\n");
+                return EXIT_FAILURE;
+              default:
+                database_error (ctx);
+                return EXIT_FAILURE;
+              }
+          else
+            switch (errno)
+              {
+              case ENOENT:
+                fprintf (stderr, "File doesn't exist\n");
+                return EXIT_FAILURE;
+              default:
+                fprintf (stderr, "Unknown error\n");
+                return EXIT_FAILURE;
+              }
+        }
+    }
+  /* TAGS command */
+  else if (!strcmp ("tags", argv[1]))
+    {
+      static struct option long_options[] =
+      {
+        {"prefix", required_argument, 0, 'p'},
+        {"fuzzy", required_argument, 0, 'z'},
+        {"count", no_argument, 0, 'c'},
+        {"empty", no_argument, 0, 'E'},
+        {0, 0, 0, 0}
+      };
+      int opt;
+      char *prefix = NULL;
+      char *fuzzy = NULL;
+      int count = 0, empty = 0;
+      int max_distance = -1;
+      unsigned long int number_flag = 0;
+      int status;
+      /* Command flags */
+      while ((opt = getopt_long (argc-1, argv+1, "e:n:", long_options, NULL)) != -1)
+        {
+          switch (opt)
+            {
+            case 'p':
+              prefix = optarg;
+              break;
+            case 'z':
+              fuzzy = optarg;
+              break;
+            case 'c':
+              count = 1;
+              break;
+            case 'E':
+              empty = 1;
+              break;
+            case 'e':
+              max_distance = atoi (optarg);
+              break;
+            case 'n':
+              number_flag = atoi (optarg);
+              break;
+            case '?':
+              return EXIT_FAILURE;
+              break;
+            default:
+              abort ();
+            }
+        }
+      optind++; /* we are looking into the command, not the executable */
+      if (argc != optind || (!!prefix + !!fuzzy + count + empty) > 1)
+        {
+          fprintf (stderr, "Wrong number of arguments. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      if (count)
+        status = dfym_tag_counts (ctx, number_flag);
+      else if (empty)
+        status = dfym_empty_tags (ctx);
+      else if (prefix)
+        status = dfym_tags_with_prefix (ctx, prefix, number_flag);
+      else if (fuzzy)
+        status = dfym_tags_fuzzy (ctx, fuzzy, max_distance, number_flag);
+      else if (number_flag)
+        status = dfym_tags_with_prefix (ctx, "", number_flag);
+      else
+        status = dfym_all_tags (ctx);
+      switch (status)
+        {
+        case DFYM_OK:
+          break;
+        default:
+          database_error (ctx);
+          return EXIT_FAILURE;
+        }
+    }
+  /* TAGGED command */
+  else if (!strcmp ("tagged", argv[1]))
+    {
+      static struct option long_options[] =
+      {
+        {"after", required_argument, 0, 'A'},
+        {0, 0, 0, 0}
+      };
+      int opt;
+      char *number_value_flag = NULL;
+      char *after = NULL;
+      sqlite3_int64 next = 0;
+      int status;
+      /* Command flags */
+      while ((opt = getopt_long (argc-1, argv+1, "n:", long_options, NULL)) != -1)
+        {
+          switch (opt)
+            {
+            case 'A':
+              after = optarg;
+              break;
+            case 'n':
+              number_value_flag = optarg;
+              break;
+            case '?':
+              if (optopt == 'n')
+                fprintf (stderr, "Option -n requires an argument.\n");
+              else if (isprint (optopt))
+                fprintf (stderr, "Unknown option `-%c'.\n", optopt);
+              else
+                fprintf (stderr,
+                         "Unknown option character `\\x%x'.\n",
+                         optopt);
+              return EXIT_FAILURE;
+              break;
+            default:
+              abort ();
+            }
+        }
+      optind++; /* we are looking into the command, not the executable */
+      if (optind != argc || (number_value_flag && !after))
+        {
+          fprintf (stderr, "Wrong number of arguments. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      if (after)
+        status = dfym_all_files_page (ctx, g_ascii_strtoll (after, NULL, 10),
+                                      number_value_flag ? atoi (number_value_flag) : 0, &next);
+      else
+        status = dfym_all_files (ctx);
+      switch (status)
+        {
+        case DFYM_OK:
+          if (next)
+            fprintf (stderr, "dfym: more results, next page with --after %lld\n",
+                     (long long)next);
+          break;
+        default:
+          database_error (ctx);
+          return EXIT_FAILURE;
+        }
+    }
+  /* SEARCH and FIND commands */
+  else if (!strcmp ("search", argv[1]) || !strcmp ("find", argv[1]))
+    {
+      static struct option long_options[] =
+      {
+        {"seed", required_argument, 0, 'S'},
+        {"match", required_argument, 0, 'M'},
+        {"after", required_argument, 0, 'A'},
+        {0, 0, 0, 0}
+      };
+      /* find takes all but --match and --after */
+      static struct option find_options[] =
+      {
+        {"seed", required_argument, 0, 'S'},
+        {0, 0, 0, 0}
+      };
+      int find = !strcmp ("find", argv[1]);
+      int opt;
+      unsigned char flags = 0;
+      char *number_value_flag = NULL;
+      char *match = NULL;
+      char *after = NULL;
+      sqlite3_int64 seed = -1, next = 0;
+      int status;
+      /* Command flags */
+      while ((opt = getopt_long (argc-1, argv+1, "rn:fdv", find ? find_options : long_options, NULL)) != -1)
+        {
+          switch (opt)
+            {
+            case 'M':
+              match = optarg;
+              break;
+            case 'A':
+              after = optarg;
+              break;
+            case 'S':
+              seed = g_ascii_strtoull (optarg, NULL, 10) & G_MAXUINT32;
+              break;
+            case 'r':
+              flags |= OPT_RANDOM;
+              break;
+            case 'v':
+              flags |= OPT_VERIFY;
+              break;
+            case 'n':
+              number_value_flag = optarg;
+              break;
+            case 'f':
+              flags |= OPT_FILES;
+              break;
+            case 'd':
+              flags |= OPT_DIRECTORIES;
+              break;
+            case '?':
+              if (optopt == 'n')
+                fprintf (stderr, "Option -n requires an argument.\n");
+              else if (isprint (optopt))
+                fprintf (stderr, "Unknown option `-%c'.\n", optopt);
+              else
+                fprintf (stderr,
+                         "Unknown option character `\\x%x'.\n",
+                         optopt);
+              return EXIT_FAILURE;
+              break;
+            default:
+              abort ();
+            }
+        }
+      optind++; /* we are looking into the command, not the executable */
+      if ((argc - optind) != 1)
+        {
+          fprintf (stderr, "Wrong number of arguments. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      else if (after && (match || seed >= 0 || (flags & (OPT_RANDOM | OPT_VERIFY))))
+        {
+          fprintf (stderr, "Pages can't be random, verified or matched. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      else
+        {
+          unsigned long int number_flag = 0;
+          if (number_value_flag) number_flag = atoi (number_value_flag);
+          if (seed >= 0)
+            dfym_set_seed (ctx, seed);
+          if (find)
+            status = dfym_find (ctx, argv[optind], number_flag, flags);
+          else if (after)
+            status = dfym_search_page (ctx, argv[optind], g_ascii_strtoll (after, NULL, 10),
+                                       number_flag, flags, &next);
+          else
+            status = dfym_search_query (ctx, argv[optind], match, number_flag, flags);
+          /* The daemon goes on with the next command */
+          if (seed >= 0)
+            dfym_set_seed (ctx, -1);
+          switch (status)
+            {
+            case DFYM_OK:
+              if (next)
+                fprintf (stderr, "dfym: more results, next page with --after %lld\n",
+                         (long long)next);
+              break;
+            case DFYM_QUERY_ERROR:
+              fprintf (stderr, "Malformed query. Please refer to help using: \"dfym help\"\n");
+              return EXIT_FAILURE;
+            default:
+              database_error (ctx);
+              return EXIT_FAILURE;
+            }
+        }
+    }
+  /* DISCOVER command */
+  else if (!strcmp ("discover", argv[1]))
+    {
+      int opt;
+      unsigned char flags = 0;
+      char *number_value_flag = NULL;
+      int recursive = 0;
+      int max_depth = 0;
+      unsigned int threads = 0;
+      /* Command flags */
+      while ((opt = getopt (argc-1, argv+1, "rn:fdRm:j:")) != -1)
+        {
+          switch (opt)
+            {
+            case 'r':
+              flags |= OPT_RANDOM;
+              break;
+            case 'n':
+              number_value_flag = optarg;
+              break;
+            case 'f':
+              flags |= OPT_FILES;
+              break;
+            case 'd':
+              flags |= OPT_DIRECTORIES;
+              break;
+            case 'R':
+              recursive = 1;
+              break;
+            case 'm':
+              max_depth = atoi (optarg);
+              break;
+            case 'j':
+              threads = atoi (optarg);
+              break;
+            case '?':
+              if (optopt == 'n' || optopt == 'm' || optopt == 'j')
+                fprintf (stderr, "Option -%c requires an argument.\n", optopt);
+              else if (isprint (optopt))
+                fprintf (stderr, "Unknown option `-%c'.\n", optopt);
+              else
+                fprintf (stderr,
+                         "Unknown option character `\\x%x'.\n",
+                         optopt);
+              return EXIT_FAILURE;
+              break;
+            default:
+              abort ();
+            }
+        }
+      optind++; /* we are looking into the command, not the executable */
+      if ((argc - optind) != 1)
+        {
+          fprintf (stderr, "Wrong number of arguments. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      else
+        {
+          char target_dir[PATH_MAX];
+          unsigned long int number_flag = 0;
+          if (number_value_flag) number_flag = atoi (number_value_flag);
+          /* Stored paths are absolute, as tag makes them */
+          if (realpath (argv[optind], target_dir) && g_file_test (target_dir, G_FILE_TEST_IS_DIR))
+            {
+              switch (recursive
+                      ? dfym_discover_untagged_recursive (ctx, target_dir, number_flag, flags, max_depth, threads)
+                      : dfym_discover_untagged (ctx, target_dir, number_flag, flags))
+                {
+                case DFYM_OK:
+                  break;
+                case DFYM_NOT_EXISTS:
+                  fprintf (stderr, "Can't read %s: %s\n", target_dir, strerror (errno));
+                  return EXIT_FAILURE;
+                default:
+                  database_error (ctx);
+                  return EXIT_FAILURE;
+                }
+            }
+          else
+            {
+              fprintf (stderr, "Argument is not a directory\n");
+              return EXIT_FAILURE;
+            }
+        }
+    }
+  /* rename command */
+  else if (!strcmp ("rename", argv[1]))
+    {
+      int recursive = argc > 2 && !strcmp ("-R", argv[2]);
+      if (argc != 4 + recursive)
+        {
+          fprintf (stderr, "Wrong number of arguments. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      else
+        {
+          const char *path_from_arg = argv[2 + recursive];
+          const char *path_to_arg = argv[3 + recursive];
+          char path_to[PATH_MAX];
+          unsigned long int count = 0;
+          gint64 start = g_get_monotonic_time ();
+          /* Path from doesn't get checked for existence, path_to does */
+          if (realpath (path_to_arg, path_to))
+            switch (recursive
+                    ? dfym_rename_dir (ctx, path_from_arg, path_to, &count)
+                    : dfym_rename_file (ctx, path_from_arg, path_to))
+              {
+              case DFYM_OK:
+                if (recursive)
+                  fprintf (stderr, "Renamed %lu files in %.3f s\n", count,
+                           (g_get_monotonic_time () - start) / (double)G_USEC_PER_SEC);
+                break;
+              case DFYM_NOT_EXISTS:
+                fprintf (stderr, "File not found in the database\n");
+                return EXIT_FAILURE;
+              case DFYM_CONFLICT:
+                fprintf (stderr, "Files were already tagged within the target directory\n");
+                return EXIT_FAILURE;
+              default:
+                database_error (ctx);
+                return EXIT_FAILURE;
+              }
+          else
+            switch (errno)
+              {
+              case ENOENT:
+                fprintf (stderr, "File you are trying to rename to doesn't exist\n");
+                return EXIT_FAILURE;
+              default:
+                fprintf (stderr, "Unknown error\n");
+                return EXIT_FAILURE;
+              }
+        }
+    }
+  /* rename-tag command */
+  else if (!strcmp ("rename-tag", argv[1]))
+    {
+      if (argc != 4)
+        {
+          fprintf (stderr, "Wrong number of arguments. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      else
+        switch (dfym_rename_tag (ctx, argv[2], argv[3]))
+          {
+          case DFYM_OK:
+            break;
+          case DFYM_NOT_EXISTS:
+            fprintf (stderr, "Tag not found in the database\n");
+            return EXIT_FAILURE;
+          default:
+            database_error (ctx);
+            return EXIT_FAILURE;
+          }
+    }
+  /* delete command */
+  else if (!strcmp ("delete", argv[1]))
+    {
+      int recursive = argc > 2 && !strcmp ("-R", argv[2]);
+      if (argc != 3 + recursive)
+        {
+          fprintf (stderr, "Wrong number of arguments. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      else
+        {
+          const char *argument_path = argv[2 + recursive];
+          char try_full_path[PATH_MAX];
+          char *path;
+          unsigned long int count = 0;
+          gint64 start = g_get_monotonic_time ();
+          if (realpath (argument_path, try_full_path))
+            path = try_full_path;
+          else
+            path = (char*)argument_path;
+
+          switch (recursive
+                  ? dfym_delete_dir (ctx, path, &count)
+                  : dfym_delete_file (ctx, path))
+            {
+            case DFYM_OK:
+              if (recursive)
+                fprintf (stderr, "Deleted %lu files in %.3f s\n", count,
+                         (g_get_monotonic_time () - start) / (double)G_USEC_PER_SEC);
+              break;
+            case DFYM_NOT_EXISTS:
+              fprintf (stderr, "File not found in the database\n");
+              return EXIT_FAILURE;
+            default:
+              database_error (ctx);
+              return EXIT_FAILURE;
+            }
+        }
+    }
+  /* delete-tag command */
+  else if (!strcmp ("delete-tag", argv[1]))
+    {
+      if (argc != 3)
+        {
+          fprintf (stderr, "Wrong number of arguments. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      else
+        switch (dfym_delete_tag (ctx, argv[2]))
+          {
+          case DFYM_OK:
+            break;
+          case DFYM_NOT_EXISTS:
+            fprintf (stderr, "Tag not found in the database\n");
+            return EXIT_FAILURE;
+          default:
+            database_error (ctx);
+            return EXIT_FAILURE;
+          }
+    }
+  /* gc command */
+  else if (!strcmp ("gc", argv[1]))
+    {
+      static struct option long_options[] =
+      {
+        {"prune", no_argument, 0, 'p'},
+        {"from", required_argument, 0, 'F'},
+        {"to", required_argument, 0, 'T'},
+        {0, 0, 0, 0}
+      };
+      int opt;
+      unsigned char flags = 0;
+      sqlite3_int64 from = 0, to = G_MAXINT64;
+      dfym_gc_report_t report;
+      gint64 start = g_get_monotonic_time ();
+      double elapsed;
+      unsigned long int max_files = 0;
+      unsigned int max_seconds = 0;
+      unsigned int threads = 0;
+      /* Command flags */
+      while ((opt = getopt_long (argc-1, argv+1, "n:t:j:", long_options, NULL)) != -1)
+        {
+          switch (opt)
+            {
+            case 'p':
+              flags |= OPT_PRUNE;
+              break;
+            case 'F':
+              from = g_ascii_strtoll (optarg, NULL, 10);
+              break;
+            case 'T':
+              to = g_ascii_strtoll (optarg, NULL, 10);
+              break;
+            case 'n':
+              max_files = strtoul (optarg, NULL, 10);
+              break;
+            case 't':
+              max_seconds = atoi (optarg);
+              break;
+            case 'j':
+              threads = atoi (optarg);
+              break;
+            case '?':
+              return EXIT_FAILURE;
+              break;
+            default:
+              abort ();
+            }
+        }
+      optind++; /* we are looking into the command, not the executable */
+      if (optind != argc)
+        {
+          fprintf (stderr, "Wrong number of arguments. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      switch (dfym_gc (ctx, from, to, max_files, max_seconds, flags, threads, &report))
+        {
+        case DFYM_OK:
+          elapsed = (g_get_monotonic_time () - start) / (double)G_USEC_PER_SEC;
+          fprintf (stderr, "dfym: checked %lu files in %.2f s (%.0f files/s), %lu missing, %lu changed%s\n",
+                   report.checked, elapsed, elapsed > 0 ? report.checked / elapsed : 0.0,
+                   report.missing, report.changed, report.pruned ? ", all pruned" : "");
+          if (report.unchecked)
+            fprintf (stderr, "dfym: %lu files couldn't be checked\n", report.unchecked);
+          if (report.next && to != G_MAXINT64)
+            fprintf (stderr, "dfym: stopped before the end, resume with --from %lld --to %lld\n",
+                     (long long)report.next, (long long)to);
+          else if (report.next)
+            fprintf (stderr, "dfym: stopped before the end, resume with --from %lld\n",
+                     (long long)report.next);
+          break;
+        default:
+          database_error (ctx);
+          return EXIT_FAILURE;
+        }
+    }
+  /* stats command */
+  else if (!strcmp ("stats", argv[1]))
+    {
+      int check = argc == 3 && !strcmp ("--check", argv[2]);
+      unsigned long int fixed;
+      int status;
+      if (argc != 2 + check)
+        {
+          fprintf (stderr, "Wrong number of arguments. Please refer to help using: \"dfym help\"\n");
+          return EXIT_FAILURE;
+        }
+      status = check ? dfym_check_tag_stats (ctx, &fixed) : dfym_summary (ctx);
+      switch (status)
+        {
+        case DFYM_OK:
+          if (check && fixed)
+            fprintf (stderr, "dfym: fixed the counts of %lu tags\n", fixed);
+          break;
+        default:
+          database_error (ctx);
+          return EXIT_FAILURE;
+        }
+    }
+  /* watch command */
+  else if (!strcmp ("watch", argv[1]))
+    {
+      int opt;
+      unsigned int max_watches = 0;
+      char **roots = NULL;
+      int status;
+      dfym_watch_report_t report;
+      struct sigaction action = { .sa_handler = stop_watching };
+      /* Command flags */
+      while ((opt = getopt (argc-1, argv+1, "w:")) != -1)
+        {
+          switch (opt)
+            {
+            case 'w':
+              max_watches = atoi (optarg);
+              break;
+            case '?':
+              if (optopt == 'w')
+                fprintf (stderr, "Option -w requires an argument.\n");
+              else if (isprint (optopt))
+                fprintf (stderr, "Unknown option `-%c'.\n", optopt);
+              else
+                fprintf (stderr,
+                         "Unknown option character `\\x%x'.\n",
+                         optopt);
+              return EXIT_FAILURE;
+              break;
+            default:
+              abort ();
+            }
+        }
+      optind++; /* we are looking into the command, not the executable */
+      /* No SA_RESTART, so that a signal interrupts the wait for events */
+      sigaction (SIGINT, &action, NULL);
+      sigaction (SIGTERM, &action, NULL);
+      if (optind < argc)
+        {
+          roots = g_new0 (char *, argc - optind + 1);
+          for (int i = optind; i < argc; i++)
+            if (!(roots[i - optind] = realpath (argv[i], NULL)))
+              {
+                fprintf (stderr, "Can't watch %s: %s\n", argv[i], strerror (errno));
+                g_strfreev (roots);
+                return EXIT_FAILURE;
+              }
+        }
+      dfym_set_result_handler (ctx, log_watch, NULL);
+      status = dfym_watch (ctx, roots, max_watches, &watch_stop, &report);
+      g_strfreev (roots);
+      switch (status)
+        {
+        case DFYM_OK:
+          fprintf (stderr, "dfym: %lu events, %lu files updated in %lu writes, "
+                   "%.1f ms average and %.1f ms longest write\n",
+                   report.events, report.files, report.writes,
+                   report.writes ? report.write_time_us / 1000.0 / report.writes : 0.0,
+                   report.max_write_us / 1000.0);
+          if (report.lost)
+            fprintf (stderr, "dfym: %lu events lost\n", report.lost);
+          break;
+        case DFYM_SYSTEM_ERROR:
+          fprintf (stderr, "Can't watch the filesystem: %s\n", dfym_errmsg (ctx));
+          return EXIT_FAILURE;
+        default:
+          database_error (ctx);
+          return EXIT_FAILURE;
+        }
+    }
+  else
+    {
+      fprintf (stderr, "Wrong command. Please try \"dfym help\"\n");
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Write a statement run while tracing, as a line of JSON, see
+ * \ref dfym_trace_handler_t.
+ */
+static void trace_statement (char const *sql, sqlite3_int64 ns, sqlite3_int64 rows, void *data)
+{
+  FILE *output = data;
+
+  fprintf (output, "{\"sql\": ");
+  dfym_output_json_string (output, sql);
+  fprintf (output, ", \"time_us\": %.1f, \"rows\": %lld}\n", ns / 1000.0, (long long)rows);
+}
+
+/**
+ * Write the statistics of a traced command as JSON, see
+ * \ref dfym_trace_report.
+ */
+static void write_trace_report (FILE *output, char const *command, dfym_trace_report_t const *report)
+{
+  fprintf (output, "{\"command\": ");
+  dfym_output_json_string (output, command);
+  fprintf (output, ", \"time_ms\": %.3f", report->time_us / 1000.0);
+  fprintf (output, ", \"page_cache\": {\"hits\": %d, \"misses\": %d}",
+           report->page_hits, report->page_misses);
+  fprintf (output, ", \"statement_cache\": {\"hits\": %lu, \"misses\": %lu}",
+           report->statement_hits, report->statement_misses);
+  fprintf (output, ", \"filesystem\": {\"stats\": %lu, \"readdirs\": %lu}",
+           report->fs_stats, report->fs_readdirs);
+  fprintf (output, ", \"statements\": [");
+  for (unsigned int k = 0; k < report->n_statements; k++)
+    {
+      dfym_trace_statement_t const *statement = &report->statements[k];
+      fprintf (output, "%s\n  {\"sql\": ", k ? "," : "");
+      dfym_output_json_string (output, statement->sql);
+      fprintf (output, ", \"runs\": %lu, \"time_ms\": %.3f, \"rows\": %lld"
+               ", \"fullscan_steps\": %lld, \"sorts\": %lld}",
+               statement->runs, statement->ns / 1e6, (long long)statement->rows,
+               (long long)statement->fullscan_steps, (long long)statement->sorts);
+    }
+  fprintf (output, "]}\n");
+  fflush (output);
+}
+
+/**
+ * Run a command, given with the same arguments as the program.
+ * Results of the context go to the standard output of the process, and
+ * errors to its standard error. The context is not used by the help command,
+ * and can be NULL for it.
+ *
+ * Global flags before the command choose the format of its results, see
+ * \ref output_format_t, and turn tracing on for the command alone, see
+ * \ref dfym_trace. Traces and statistics go to stderr, or to the last file
+ * named by the flags.
+ * \return The exit status of the command.
+ */
+int run_command (dfym_ctx_t *ctx, int argc, char **argv)
+{
+  unsigned int trace = 0;
+  char const *trace_file = NULL;
+  FILE *output = stderr;
+  output_format_t format = OUTPUT_LINES;
+  int status;
+
+  while (argc > 2 && (!strncmp (argv[1], "--", 2) || !strcmp (argv[1], "-0")))
+    {
+      char const *value = strchr (argv[1], '=');
+      size_t length = value ? (size_t)(value - argv[1]) : strlen (argv[1]);
+
+      if (!strcmp (argv[1], "-0") || !strcmp (argv[1], "--null"))
+        format = OUTPUT_NUL;
+      else if (!strcmp (argv[1], "--json"))
+        format = OUTPUT_JSON;
+      else if (length == strlen ("--trace") && !strncmp (argv[1], "--trace", length))
+        trace |= TRACE_STATEMENTS;
+      else if (length == strlen ("--stats") && !strncmp (argv[1], "--stats", length))
+        trace |= TRACE_STATS;
+      else
+        {
+          fprintf (stderr, "Unknown flag %s. Please refer to help using: \"dfym help\"\n", argv[1]);
+          return EXIT_FAILURE;
+        }
+      if (value)
+        trace_file = value + 1;
+      /* The flag takes the place of the program name */
+      argc--;
+      argv++;
+    }
+  dfym_output_format (format);
+  if (ctx)
+    dfym_set_result_handler (ctx, output_result, NULL);
+  if (!trace || !ctx)
+    {
+      status = dispatch_command (ctx, argc, argv);
+      /* The next command may be run by the same process, in the daemon */
+      dfym_output_format (OUTPUT_LINES);
+      return status;
+    }
+
+  if (trace_file && !(output = fopen (trace_file, "a")))
+    {
+      fprintf (stderr, "Can't open %s: %s\n", trace_file, strerror (errno));
+      return EXIT_FAILURE;
+    }
+  dfym_trace (ctx, trace, trace_statement, output);
+  status = dispatch_command (ctx, argc, argv);
+  /* Results are flushed first, so that they are part of the time reported */
+  dfym_output_format (OUTPUT_LINES);
+  if (trace & TRACE_STATS)
+    {
+      dfym_trace_report_t *report = dfym_trace_report (ctx);
+      write_trace_report (output, argv[1], report);
+      dfym_trace_report_free (report);
+    }
+  dfym_trace (ctx, 0, NULL, NULL);
+  if (output != stderr)
+    fclose (output);
+  return status;
+}
@@ -0,0 +1,12 @@
+/** \file
+  * dfym: Commands, shared by the program and the daemon */
+
+gchar *home_file(char const *const);
+
+gchar *database_file(void);
+
+int is_bulk_flag(char const *const);
+
+void report_migrations(dfym_ctx_t *);
+
+int run_command(dfym_ctx_t *, int, char **);
@@ -0,0 +1,233 @@
+/** \file
+  * dfym: Buffered output of results, as lines, NUL-separated records or JSON */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+/* Glib */
+#include <glib.h>
+
+#include "dfym_output.h"
+
+/** Size of the output buffer */
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+
+/** Output state, results are only written from the main thread */
+static struct
+{
+  output_format_t format;       /**< Format of the results */
+  unsigned int fields;          /**< Fields written in the current record */
+  int quoted;                   /**< Whether the last field is a JSON string */
+  size_t length;                /**< Bytes waiting in the buffer */
+  int registered;               /**< Whether the buffer is flushed at exit */
+  char buffer[OUTPUT_BUFFER_SIZE];
+} output;
+
+/**
+ * Write the buffer to the standard output.
+ */
+static void output_drain (void)
+{
+  if (output.length)
+    fwrite_unlocked (output.buffer, 1, output.length, stdout);
+  output.length = 0;
+}
+
+/**
+ * Append bytes to the buffer, writing it out when full. Blocks larger than the
+ * buffer go straight to the standard output.
+ */
+static inline void output_bytes (char const *bytes, size_t length)
+{
+  if (output.length + length > OUTPUT_BUFFER_SIZE)
+    {
+      output_drain ();
+      if (length > OUTPUT_BUFFER_SIZE)
+        {
+          fwrite_unlocked (bytes, 1, length, stdout);
+          return;
+        }
+    }
+  memcpy (output.buffer + output.length, bytes, length);
+  output.length += length;
+}
+
+/** Writer of the pieces of an escaped string */
+typedef void (*json_writer_t) (char const *, size_t, void *);
+
+/**
+ * Escape a string for JSON. Runs of bytes needing no escape are handed to
+ * the writer at once, and each escape after them.
+ */
+static inline void json_escape (char const *value, size_t length, json_writer_t write, void *data)
+{
+  static char const hex[] = "0123456789abcdef";
+  size_t start = 0;
+
+  for (size_t k = 0; k < length; k++)
+    {
+      unsigned char c = value[k];
+      char escape[6] = { '\\', 0, '0', '0', 0, 0 };
+      size_t escape_length = 2;
+
+      if (c >= 0x20 && c != '"' && c != '\\')
+        continue;
+      write (value + start, k - start, data);
+      start = k + 1;
+      switch (c)
+        {
+        case '"': escape[1] = '"'; break;
+        case '\\': escape[1] = '\\'; break;
+        case '\n': escape[1] = 'n'; break;
+        case '\t': escape[1] = 't'; break;
+        case '\r': escape[1] = 'r'; break;
+        default:
+          escape[1] = 'u';
+          escape[4] = hex[c >> 4];
+          escape[5] = hex[c & 0xf];
+          escape_length = 6;
+        }
+      write (escape, escape_length, data);
+    }
+  write (value + start, length - start, data);
+}
+
+static void output_writer (char const *bytes, size_t length, void *data)
+{
+  output_bytes (bytes, length);
+}
+
+static void file_writer (char const *bytes, size_t length, void *data)
+{
+  fwrite (bytes, 1, length, data);
+}
+
+/**
+ * Append a string to the buffer, escaped for JSON.
+ */
+static void output_json (char const *value, size_t length)
+{
+  json_escape (value, length, output_writer, NULL);
+}
+
+/** Write a string to a file as a JSON string literal, outside of the results.
+ *
+ * \param file The file.
+ * \param value The string.
+ */
+void dfym_output_json_string (FILE *file, char const *value)
+{
+  fputc ('"', file);
+  json_escape (value, strlen (value), file_writer, file);
+  fputc ('"', file);
+}
+
+/** Choose the format of the results.
+ *
+ * Results waiting in the buffer are written first.
+ * \param format The format of the next results, see \ref output_format_t.
+ */
+void dfym_output_format (output_format_t format)
+{
+  dfym_output_flush ();
+  output.format = format;
+}
+
+/**
+ * Start a field of the current result, as a string or not.
+ */
+static void output_field_start (char const *name, int quoted)
+{
+  if (!output.registered)
+    {
+      /* Nothing is lost if the program exits on an error */
+      atexit (dfym_output_flush);
+      output.registered = 1;
+    }
+  if (output.format == OUTPUT_JSON)
+    {
+      if (output.fields)
+        output_bytes (output.quoted ? "\", \"" : ", \"", output.quoted ? 4 : 3);
+      else
+        output_bytes ("{\"", 2);
+      output_bytes (name, strlen (name));
+      output_bytes (quoted ? "\": \"" : "\": ", quoted ? 4 : 3);
+    }
+  else if (output.fields)
+    output_bytes ("\t", 1);
+  output.fields++;
+  output.quoted = quoted;
+}
+
+/** Write a field of the current result.
+ *
+ * Fields are separated by tabs in lines and NUL-separated records, only JSON
+ * writes their names.
+ * \param name The name of the field.
+ * \param value The value of the field, written as it is.
+ * \param length The length of the value, or -1 if it ends with a NUL.
+ */
+void dfym_output_field (char const *name, char const *value, int length)
+{
+  output_field_start (name, 1);
+  dfym_output_append (value, length);
+}
+
+/** Write a field of the current result holding a number.
+ *
+ * \param name The name of the field.
+ * \param value The number, a JSON number rather than a string.
+ */
+void dfym_output_integer (char const *name, gint64 value)
+{
+  char digits[24];
+
+  output_field_start (name, 0);
+  output_bytes (digits, g_snprintf (digits, sizeof (digits), "%" G_GINT64_FORMAT, value));
+}
+
+/** Append to the value of the last field written.
+ *
+ * \param value The text to append.
+ * \param length The length of the text, or -1 if it ends with a NUL.
+ */
+void dfym_output_append (char const *value, int length)
+{
+  size_t size = length < 0 ? strlen (value) : (size_t)length;
+
+  if (output.format == OUTPUT_JSON)
+    output_json (value, size);
+  else
+    output_bytes (value, size);
+}
+
+/** End the current result.
+ */
+void dfym_output_end (void)
+{
+  switch (output.format)
+    {
+    case OUTPUT_LINES:
+      output_bytes ("\n", 1);
+      break;
+    case OUTPUT_NUL:
+      output_bytes ("", 1);
+      break;
+    case OUTPUT_JSON:
+      if (!output.fields)
+        output_bytes ("{}\n", 3);
+      else
+        output_bytes (output.quoted ? "\"}\n" : "}\n", output.quoted ? 3 : 2);
+      break;
+    }
+  output.fields = 0;
+}
+
+/** Write the waiting results to the standard output, and flush it.
+ */
+void dfym_output_flush (void)
+{
+  output_drain ();
+  fflush (stdout);
+}
@@ -0,0 +1,31 @@
+/** \file
+  * dfym: Buffered output of results
+  *
+  * Listing commands may print millions of paths. Results are gathered in a
+  * large buffer and written out in big blocks, instead of a formatted write
+  * per path, and they can be separated by NUL for paths holding newlines, or
+  * written as JSON Lines for other programs. A result is a record of named
+  * fields, written by \ref dfym_output_field and ended by
+  * \ref dfym_output_end. */
+
+/** Formats of the results */
+typedef enum
+{
+  OUTPUT_LINES,                 /**< Fields separated by tabs, records by newlines */
+  OUTPUT_NUL,                   /**< Fields separated by tabs, records by NUL */
+  OUTPUT_JSON                   /**< One JSON object per line */
+} output_format_t;
+
+void dfym_output_format(output_format_t);
+
+void dfym_output_field(char const *, char const *, int);
+
+void dfym_output_integer(char const *, gint64);
+
+void dfym_output_append(char const *, int);
+
+void dfym_output_end(void);
+
+void dfym_output_flush(void);
+
+void dfym_output_json_string(FILE *, char const *);
@@ -0,0 +1,205 @@
+/** \file
+  * dfymd: Daemon keeping the database open, warm and ready for dfym.
+  *
+  * Commands are served one at a time, on the descriptors and in the working
+  * directory of the client that sent them, so their output is the same as
+  * when dfym runs them directly. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+/* SQLite */
+#include <sqlite3.h>
+/* Glib */
+#include <glib.h>
+
+#include "dfym_base.h"
+#include "commands.h"
+#include "protocol.h"
+
+/* Global variables */
+gchar *db_path = NULL;
+gchar *sock_path = NULL;
+dfym_ctx_t *ctx = NULL;
+/** Microseconds between refreshes of the planner statistics */
+#define OPTIMIZE_INTERVAL (G_GINT64_CONSTANT (3600) * G_USEC_PER_SEC)
+
+/** Set by SIGINT and SIGTERM to stop serving */
+volatile sig_atomic_t stopping = 0;
+
+void cleanup ()
+{
+  if (sock_path)
+    {
+      unlink (sock_path);
+      g_free (sock_path);
+    }
+  if (db_path)
+    g_free (db_path);
+  if (ctx)
+    dfym_close_database (ctx);
+}
+
+void stop (int signum)
+{
+  stopping = 1;
+}
+
+/**
+ * Create the listening socket, replacing the socket of a dead daemon.
+ * \return The socket, or -1 if another daemon is running or on error.
+ */
+static int listen_socket (char const *const path)
+{
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  int sock;
+
+  if (strlen (path) >= sizeof (address.sun_path))
+    {
+      fprintf (stderr, "Socket path too long: %s\n", path);
+      return -1;
+    }
+  strcpy (address.sun_path, path);
+  if ((sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+      perror ("socket");
+      return -1;
+    }
+  if (!connect (sock, (struct sockaddr *)&address, sizeof (address)))
+    {
+      fprintf (stderr, "dfymd is already running on %s\n", path);
+      close (sock);
+      return -1;
+    }
+  unlink (path);
+  /* Only the user can send commands */
+  umask (077);
+  if (bind (sock, (struct sockaddr *)&address, sizeof (address))
+      || listen (sock, SOMAXCONN))
+    {
+      fprintf (stderr, "Can't listen on %s: %s\n", path, strerror (errno));
+      close (sock);
+      return -1;
+    }
+  return sock;
+}
+
+/**
+ * Serve the request of a connected client.
+ */
+static void serve (int client, int *saved_fds)
+{
+  int fds[3], status = EXIT_FAILURE, argc, refreshed;
+  char **request = receive_request (client, fds);
+  char **argv;
+
+  if (!request)
+    return;
+  argc = g_strv_length (request);
+  /* The working directory takes the place of the program name */
+  argv = g_new (char *, argc + 1);
+  memcpy (argv, request, (argc + 1) * sizeof (char *));
+  argv[0] = "dfym";
+
+  refreshed = dfym_refresh_caches (ctx);
+  for (int k = 0; k < 3; k++)
+    {
+      dup2 (fds[k], k);
+      close (fds[k]);
+    }
+  if (refreshed != DFYM_OK)
+    fprintf (stderr, "Database error: %s\n", dfym_errmsg (ctx));
+  else if (chdir (request[0]))
+    fprintf (stderr, "Can't enter %s: %s\n", request[0], strerror (errno));
+  else if (argc < 2)
+    fprintf (stderr, "Needs a command argument. Please refer to help using: \"dfym help\"\n");
+  else
+    status = run_command (ctx, argc, argv);
+
+  /* Leave nothing of this client in the standard streams */
+  fflush (stdout);
+  fflush (stderr);
+  __fpurge (stdin);
+  clearerr (stdin);
+  for (int k = 0; k < 3; k++)
+    dup2 (saved_fds[k], k);
+  if (chdir ("/"))
+    perror ("chdir");
+
+  send_status (client, status);
+  g_free (argv);
+  g_strfreev (request);
+}
+
+int main (int argc, char **argv)
+{
+  struct sigaction action = { .sa_handler = stop };
+  int sock, saved_fds[3];
+  gint64 optimized = g_get_monotonic_time ();
+
+  atexit (cleanup);
+  if (argc > 1)
+    {
+      printf ("Usage: dfymd\n"
+              "\n"
+              "Keeps the dfym database open and serves the commands of dfym, which uses\n"
+              "the daemon whenever it is running. Stop it with SIGINT or SIGTERM.\n");
+      exit (strcmp ("help", argv[1]) ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+  if ((sock = listen_socket (sock_path = socket_path ())) < 0)
+    {
+      g_free (sock_path);
+      sock_path = NULL;
+      exit (EXIT_FAILURE);
+    }
+
+  db_path = database_file ();
+  ctx = dfym_open_or_create_database (db_path);
+  if (dfym_errmsg (ctx))
+    {
+      fprintf (stderr, "Can't open %s: %s\n", db_path, dfym_errmsg (ctx));
+      exit (EXIT_FAILURE);
+    }
+  report_migrations (ctx);
+  if (getenv ("DFYM_BUSY_TIMEOUT"))
+    dfym_set_busy_timeout (ctx, strtoul (getenv ("DFYM_BUSY_TIMEOUT"), NULL, 10));
+
+  /* No SA_RESTART, so that a signal interrupts accept */
+  sigaction (SIGINT, &action, NULL);
+  sigaction (SIGTERM, &action, NULL);
+  signal (SIGPIPE, SIG_IGN);
+  for (int k = 0; k < 3; k++)
+    saved_fds[k] = fcntl (k, F_DUPFD_CLOEXEC, 3);
+  if (chdir ("/"))
+    perror ("chdir");
+
+  while (!stopping)
+    {
+      int client = accept4 (sock, NULL, NULL, SOCK_CLOEXEC);
+      if (client < 0)
+        {
+          if (errno != EINTR)
+            perror ("accept");
+          continue;
+        }
+      serve (client, saved_fds);
+      close (client);
+      if (g_get_monotonic_time () - optimized > OPTIMIZE_INTERVAL)
+        {
+          dfym_optimize (ctx);
+          optimized = g_get_monotonic_time ();
+        }
+    }
+  close (sock);
+  return EXIT_SUCCESS;
+}
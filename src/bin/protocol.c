@@ -0,0 +1,273 @@
+/** \file
+  * dfym: Protocol between the program and the daemon */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+/* SQLite */
+#include <sqlite3.h>
+/* Glib */
+#include <glib.h>
+
+#include "dfym_base.h"
+#include "commands.h"
+#include "protocol.h"
+
+/** Descriptors passed along with every request: stdin, stdout and stderr */
+#define PASSED_FDS 3
+
+/**
+ * Get the path of the daemon's socket, ~/.dfym.sock unless the DFYM_SOCKET
+ * environment variable names another one.
+ */
+gchar *socket_path (void)
+{
+  if (getenv ("DFYM_SOCKET"))
+    return g_strdup (getenv ("DFYM_SOCKET"));
+  return home_file (".dfym.sock");
+}
+
+/**
+ * Send a whole buffer on a socket, resuming after partial writes and
+ * interruptions. A peer that went away is an error, not a signal.
+ * \return 0 on success, -1 on error.
+ */
+static int write_all (int fd, void const *buffer, size_t length)
+{
+  char const *data = buffer;
+
+  while (length)
+    {
+      ssize_t written = send (fd, data, length, MSG_NOSIGNAL);
+      if (written < 0 && errno == EINTR)
+        continue;
+      if (written <= 0)
+        return -1;
+      data += written;
+      length -= written;
+    }
+  return 0;
+}
+
+/**
+ * Read a whole buffer, resuming after partial reads and interruptions.
+ * \return 0 on success, -1 on error or if the peer hung up.
+ */
+static int read_all (int fd, void *buffer, size_t length)
+{
+  char *data = buffer;
+
+  while (length)
+    {
+      ssize_t got = read (fd, data, length);
+      if (got < 0 && errno == EINTR)
+        continue;
+      if (got <= 0)
+        return -1;
+      data += got;
+      length -= got;
+    }
+  return 0;
+}
+
+/**
+ * Make the reads of a socket fail after some time without data.
+ * \param sock The socket.
+ * \param timeout Milliseconds to wait for data, 0 to wait forever.
+ * \return 0 on success, -1 on error.
+ */
+static int set_receive_timeout (int sock, unsigned int timeout)
+{
+  struct timeval tv = { .tv_sec = timeout / 1000, .tv_usec = timeout % 1000 * 1000 };
+
+  return setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+}
+
+/**
+ * Connect to the daemon's socket.
+ * \return The connected socket, or -1 if no daemon is listening.
+ */
+static int connect_daemon (void)
+{
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  gchar *path = socket_path ();
+  int sock = -1;
+
+  if (strlen (path) < sizeof (address.sun_path)
+      && (sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0)
+    {
+      strcpy (address.sun_path, path);
+      if (connect (sock, (struct sockaddr *)&address, sizeof (address)))
+        {
+          close (sock);
+          sock = -1;
+        }
+    }
+  g_free (path);
+  return sock;
+}
+
+/** Run a command through the daemon.
+ *
+ * Bulk tagging and watching are always run directly, as they may take a long
+ * time and would hold the daemon meanwhile. So is a command the daemon
+ * doesn't take in time, as it is busy with another client. Setting the
+ * DFYM_NO_DAEMON environment variable disables the daemon altogether.
+ *
+ * \param argc The number of arguments of the program.
+ * \param argv The arguments of the program.
+ * \param status Where to store the exit status of the command.
+ * \return 1 if the daemon ran the command, 0 if it has to be run directly.
+ */
+int forward_command (int argc, char **argv, int *status)
+{
+  GString *payload;
+  gchar *cwd;
+  guint32 length;
+  gint32 answer;
+  char taken, confirm = 1;
+  int sock;
+  struct iovec iov;
+  char control[CMSG_SPACE (PASSED_FDS * sizeof (int))] = { 0 };
+  struct msghdr message = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof (control)
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&message);
+  int fds[PASSED_FDS] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  int command = 1;
+
+  /* The global flags come before the command */
+  while (command < argc - 1
+         && (!strncmp (argv[command], "--", 2) || !strcmp (argv[command], "-0")))
+    command++;
+  if (getenv ("DFYM_NO_DAEMON")
+      || !strcmp ("watch", argv[command])
+      || (!strcmp ("tag", argv[command]) && argc > command + 1 && is_bulk_flag (argv[command+1])))
+    return 0;
+  if ((sock = connect_daemon ()) < 0)
+    return 0;
+
+  cwd = g_get_current_dir ();
+  payload = g_string_new (NULL);
+  g_string_append_len (payload, cwd, strlen (cwd) + 1);
+  for (int k = 1; k < argc; k++)
+    g_string_append_len (payload, argv[k], strlen (argv[k]) + 1);
+  g_free (cwd);
+  if (payload->len > DFYM_REQUEST_MAX)
+    {
+      g_string_free (payload, TRUE);
+      close (sock);
+      return 0;
+    }
+
+  /* The descriptors travel with the length, the arguments follow */
+  length = payload->len;
+  iov.iov_base = &length;
+  iov.iov_len = sizeof (length);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+  memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+  if (set_receive_timeout (sock, DFYM_REQUEST_TIMEOUT)
+      || sendmsg (sock, &message, MSG_NOSIGNAL) != sizeof (length)
+      || write_all (sock, payload->str, payload->len)
+      || read_all (sock, &taken, sizeof (taken))
+      || write_all (sock, &confirm, sizeof (confirm))
+      || set_receive_timeout (sock, 0))
+    {
+      /* Nothing was run yet, the command can still be run directly */
+      g_string_free (payload, TRUE);
+      close (sock);
+      return 0;
+    }
+  g_string_free (payload, TRUE);
+
+  if (read_all (sock, &answer, sizeof (answer)))
+    {
+      fprintf (stderr, "dfym: lost connection to the daemon\n");
+      answer = EXIT_FAILURE;
+    }
+  close (sock);
+  *status = answer;
+  return 1;
+}
+
+/** Receive a request from a client, and take it once the client confirms.
+ *
+ * A client that doesn't send its request, or doesn't confirm it, within
+ * DFYM_REQUEST_TIMEOUT is dropped.
+ *
+ * \param sock The socket connected to the client.
+ * \param fds Where to store the standard descriptors of the client.
+ * \return The working directory followed by the arguments of the command,
+ * as a NULL-terminated vector to free with g_strfreev, or NULL on error.
+ */
+char **receive_request (int sock, int *fds)
+{
+  guint32 length;
+  char *payload, *end;
+  GPtrArray *strings;
+  struct iovec iov = { .iov_base = &length, .iov_len = sizeof (length) };
+  char control[CMSG_SPACE (PASSED_FDS * sizeof (int))];
+  struct msghdr message = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof (control)
+  };
+  struct cmsghdr *cmsg;
+  char taken = 1, confirm;
+
+  if (set_receive_timeout (sock, DFYM_REQUEST_TIMEOUT)
+      || recvmsg (sock, &message, MSG_CMSG_CLOEXEC) != sizeof (length)
+      || !(cmsg = CMSG_FIRSTHDR (&message))
+      || cmsg->cmsg_level != SOL_SOCKET
+      || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN (PASSED_FDS * sizeof (int)))
+    return NULL;
+  memcpy (fds, CMSG_DATA (cmsg), PASSED_FDS * sizeof (int));
+
+  payload = length && length <= DFYM_REQUEST_MAX ? g_malloc (length) : NULL;
+  /* A client that gave up meanwhile runs the command itself */
+  if (!payload || read_all (sock, payload, length) || payload[length-1] != '\0'
+      || write_all (sock, &taken, sizeof (taken))
+      || read_all (sock, &confirm, sizeof (confirm)))
+    {
+      g_free (payload);
+      for (int k = 0; k < PASSED_FDS; k++)
+        close (fds[k]);
+      return NULL;
+    }
+
+  strings = g_ptr_array_new ();
+  for (char *s = payload; s < payload + length; s = end + 1)
+    {
+      end = s + strlen (s);
+      g_ptr_array_add (strings, g_strdup (s));
+    }
+  g_ptr_array_add (strings, NULL);
+  g_free (payload);
+  return (char **)g_ptr_array_free (strings, FALSE);
+}
+
+/** Send the exit status of a command back to the client.
+ *
+ * \param sock The socket connected to the client.
+ * \param status The exit status.
+ * \return 0 on success, -1 if the client went away.
+ */
+int send_status (int sock, int status)
+{
+  gint32 answer = status;
+
+  return write_all (sock, &answer, sizeof (answer));
+}
@@ -0,0 +1,27 @@
+/** \file
+  * dfym: Protocol between the program and the daemon
+  *
+  * A client connects to the daemon's Unix socket and sends one request: the
+  * length of its payload as a 32-bit integer, along with its standard input,
+  * output and error descriptors, followed by the payload itself: the working
+  * directory and the command arguments, each ended by a NUL byte. The daemon
+  * takes the request with a byte, which the client confirms with a byte
+  * before the command is run: a client that got no answer in time runs the
+  * command itself instead. The daemon then runs the command on the client's
+  * descriptors and answers with its exit status as a 32-bit integer. */
+
+/** Largest request payload accepted by the daemon */
+#define DFYM_REQUEST_MAX (1 << 20)
+
+/** Milliseconds each side waits for the other until the command is run:
+    a client stalled halfway doesn't hold the daemon, and a busy daemon
+    doesn't hold its clients */
+#define DFYM_REQUEST_TIMEOUT 1000
+
+gchar *socket_path(void);
+
+int forward_command(int, char **, int *);
+
+char **receive_request(int, int *);
+
+int send_status(int, int);
@@ -1,9 +1,14 @@
 /** \file
   * dfym: Library functions using a SQLite3 backend */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 //SQLite
 #include <sqlite3.h>
 // Glib
@@ -11,618 +16,4209 @@
 #include <glib/gstdio.h>
 
 #include "dfym_base.h"
+#include "dfym_postings.h"
+#include "dfym_probe.h"
+#include "dfym_trie.h"
 
-void g_array_shuffle (GPtrArray *array)
+/* A failed call fails the context, see dfym_fail; ctx must be in scope */
+#define CALL_SQLITE(f)                                          \
+    {                                                           \
+        int i;                                                  \
+        i = sqlite3_ ## f;                                      \
+        if (i != SQLITE_OK)                                     \
+            dfym_fail (ctx, #f, i);                             \
+    }                                                           \
+
+#define CALL_SQLITE_EXPECT(f,x)                                 \
+    {                                                           \
+        int i;                                                  \
+        i = sqlite3_ ## f;                                      \
+        if (i != SQLITE_ ## x)                                  \
+            dfym_fail (ctx, #f, i);                             \
+    }                                                           \
+
+
+/** Identifiers of the statements kept in the per-connection cache */
+typedef enum
+{
+  STMT_TAG_UPSERT,
+  STMT_TAG_ID,
+  STMT_FILE_UPSERT,
+  STMT_FILE_ID,
+  STMT_FILES_IN_DIR,
+  STMT_FILES_IN_SUBTREE,
+  STMT_DIR_LOOKUP,
+  STMT_DIR_INSERT,
+  STMT_DIR_NODE,
+  STMT_DIR_MOVE,
+  STMT_SUBTREE_COUNT_FILES,
+  STMT_SUBTREE_DELETE_TAGGINGS,
+  STMT_SUBTREE_DELETE_DIRS,
+  STMT_TAGGING_INSERT,
+  STMT_UNTAG,
+  STMT_FILE_TAGS,
+  STMT_ALL_TAGS,
+  STMT_TAGS_PREFIX,
+  STMT_DATA_VERSION,
+  STMT_ALL_FILES,
+  STMT_ALL_FILES_PAGE,
+  STMT_SEARCH,
+  STMT_SEARCH_RANDOM,
+  STMT_SEARCH_MATCH,
+  STMT_SEARCH_MATCH_RANDOM,
+  STMT_SEARCH_PAGE,
+  STMT_FIND,
+  STMT_FIND_RANDOM,
+  STMT_MATCH_POSTINGS,
+  STMT_TAG_POSTINGS,
+  STMT_ALL_FILE_IDS,
+  STMT_MAX_FILE_ID,
+  STMT_FILE_NAME,
+  STMT_FILE_STAT,
+  STMT_TAGGED_DIRS,
+  STMT_FILE_RENAME,
+  STMT_TAG_RENAME,
+  STMT_FILE_DELETE_TAGGINGS,
+  STMT_FILE_DELETE,
+  STMT_TAG_DELETE_TAGGINGS,
+  STMT_TAG_DELETE,
+  STMT_GC_RANGE,
+  STMT_TAG_COUNTS,
+  STMT_EMPTY_TAGS,
+  STMT_SUMMARY,
+  STMT_TAG_STATS_DRIFTED,
+  STMT_TAG_STATS_SET,
+  STMT_TAG_STATS_ORPHANS,
+  STMT_TAG_RENUMBER,
+  STMT_TAG_SIZE,
+  STMT_TAGGING_AT,
+  STMT_COUNT
+} dfym_statement_id_t;
+
+/** Directory node ?1 and all the nodes below it, walked through the parent index */
+#define SUBTREE_CTE                                                     \
+  "WITH RECURSIVE subtree(id) AS ("                                     \
+  "  SELECT ?1 "                                                        \
+  "  UNION ALL "                                                        \
+  "  SELECT dirs.id FROM dirs JOIN subtree ON (dirs.parent_id = subtree.id)) "
+
+/** Condition on the type of f for the OPT_FILES and OPT_DIRECTORIES bits of ?3 */
+#define SEARCH_TYPE_FILTER                                              \
+  "AND (?3 & 3 = 0 "                                                    \
+  "     OR (?3 & 1 AND f.type = 'f') "                                  \
+  "     OR (?3 & 2 AND f.type = 'd')) "
+
+/** Files with a path matching the full-text query ?4: the files whose name
+    matches, and the files below the directory nodes whose name matches */
+#define MATCH_CTE                                                       \
+  "WITH RECURSIVE hits(id) AS ("                                        \
+  "  SELECT rowid FROM dir_names WHERE dir_names MATCH ?4 "             \
+  "  UNION "                                                            \
+  "  SELECT dirs.id FROM dirs JOIN hits ON (dirs.parent_id = hits.id)), " \
+  "matched(id) AS ("                                                    \
+  "  SELECT id FROM files WHERE dir_id IN hits "                        \
+  "  UNION "                                                            \
+  "  SELECT rowid FROM file_names WHERE file_names MATCH ?4) "
+
+/** SQL text of every cached statement, indexed by \ref dfym_statement_id_t */
+static const char *const statement_sql[STMT_COUNT] =
+{
+  /* The no-op update makes RETURNING yield the id of an existing row too */
+  [STMT_TAG_UPSERT] =
+  "INSERT INTO tags ( name ) VALUES ( ? ) "
+  "ON CONFLICT ( name ) DO UPDATE SET name = excluded.name "
+  "RETURNING id",
+  [STMT_TAG_ID] =
+  "SELECT id FROM tags WHERE name = ?",
+  [STMT_FILE_UPSERT] =
+  "INSERT INTO files ( dir_id, name, type, size, mtime, dev, ino ) "
+  "VALUES ( ?1, ?2, ?3, ?4, ?5, ?6, ?7 ) "
+  "ON CONFLICT ( dir_id, name ) DO UPDATE SET "
+  "type = excluded.type, size = excluded.size, mtime = excluded.mtime, "
+  "dev = excluded.dev, ino = excluded.ino "
+  "RETURNING id",
+  [STMT_FILE_ID] =
+  "SELECT id FROM files WHERE dir_id = ?1 AND name = ?2",
+  [STMT_FILES_IN_DIR] =
+  "SELECT name FROM files WHERE dir_id = ?",
+  [STMT_FILES_IN_SUBTREE] =
+  SUBTREE_CTE
+  "SELECT dfym_path(f.dir_id, f.name) "
+  "FROM files f "
+  "JOIN subtree ON (f.dir_id = subtree.id)",
+  [STMT_DIR_LOOKUP] =
+  "SELECT id FROM dirs WHERE parent_id = ?1 AND name = ?2",
+  [STMT_DIR_INSERT] =
+  "INSERT INTO dirs ( parent_id, name ) VALUES ( ?1, ?2 ) RETURNING id",
+  [STMT_DIR_NODE] =
+  "SELECT parent_id, name FROM dirs WHERE id = ?",
+  [STMT_DIR_MOVE] =
+  "UPDATE dirs SET parent_id = ?1, name = ?2 WHERE id = ?3",
+  [STMT_SUBTREE_COUNT_FILES] =
+  SUBTREE_CTE
+  "SELECT count(*) FROM files WHERE dir_id IN subtree",
+  [STMT_SUBTREE_DELETE_TAGGINGS] =
+  SUBTREE_CTE
+  "DELETE FROM taggings "
+  "WHERE file_id IN (SELECT id FROM files WHERE dir_id IN subtree)",
+  /* The root node stays, even if the whole tree is deleted */
+  [STMT_SUBTREE_DELETE_DIRS] =
+  SUBTREE_CTE
+  "DELETE FROM dirs WHERE id IN subtree AND parent_id IS NOT NULL",
+  /* A new tagging comes last in the numbering of its tag */
+  [STMT_TAGGING_INSERT] =
+  "INSERT OR IGNORE INTO taggings ( tag_id, file_id, seq ) "
+  "VALUES ( ?1, ?2, (SELECT files + 1 FROM tag_stats WHERE tag_id = ?1) )",
+  [STMT_UNTAG] =
+  "DELETE "
+  "FROM taggings "
+  "WHERE file_id = ?1 "
+  "AND tag_id IN (SELECT tags.id FROM tags WHERE tags.name = ?2)",
+  [STMT_FILE_TAGS] =
+  "SELECT t.name "
+  "FROM taggings tgs "
+  "JOIN tags t ON (tgs.tag_id = t.id) "
+  "WHERE tgs.file_id = ?",
+  [STMT_ALL_TAGS] =
+  "SELECT name FROM tags",
+  /* A range of the index of tag names: ?2 is the first name past the prefix,
+     or a blob, which sorts after every name, if there is none */
+  [STMT_TAGS_PREFIX] =
+  "SELECT name FROM tags WHERE name >= ?1 AND name < ?2 ORDER BY name LIMIT ?3",
+  [STMT_DATA_VERSION] =
+  "PRAGMA data_version",
+  [STMT_ALL_FILES] =
+  "SELECT dfym_path(dir_id, name) FROM files",
+  /* Pages are ranges of ids, after the last id of the previous page ?1 */
+  [STMT_ALL_FILES_PAGE] =
+  "SELECT dfym_path(dir_id, name), id FROM files "
+  "WHERE id > ?1 "
+  "ORDER BY id "
+  "LIMIT ?2",
+  /* A negative LIMIT means no limit, so one statement serves both cases.
+     The -f/-d filters come as ?3, so that the LIMIT counts matching rows */
+  [STMT_SEARCH] =
+  "SELECT dfym_path(f.dir_id, f.name), f.id "
+  "FROM files f "
+  "JOIN taggings tgs ON (tgs.file_id = f.id) "
+  "JOIN tags t ON (tgs.tag_id = t.id) "
+  "WHERE t.name = ?1 "
+  SEARCH_TYPE_FILTER
+  "LIMIT ?2",
+  [STMT_SEARCH_RANDOM] =
+  "SELECT dfym_path(f.dir_id, f.name), f.id "
+  "FROM files f "
+  "JOIN taggings tgs ON (tgs.file_id = f.id) "
+  "JOIN tags t ON (tgs.tag_id = t.id) "
+  "WHERE t.name = ?1 "
+  SEARCH_TYPE_FILTER
+  "ORDER BY dfym_random() "
+  "LIMIT ?2",
+  [STMT_SEARCH_MATCH] =
+  MATCH_CTE
+  "SELECT dfym_path(f.dir_id, f.name), f.id "
+  "FROM matched "
+  "JOIN files f ON (f.id = matched.id) "
+  "JOIN taggings tgs ON (tgs.file_id = f.id) "
+  "JOIN tags t ON (tgs.tag_id = t.id) "
+  "WHERE t.name = ?1 "
+  SEARCH_TYPE_FILTER
+  "LIMIT ?2",
+  [STMT_SEARCH_MATCH_RANDOM] =
+  MATCH_CTE
+  "SELECT dfym_path(f.dir_id, f.name), f.id "
+  "FROM matched "
+  "JOIN files f ON (f.id = matched.id) "
+  "JOIN taggings tgs ON (tgs.file_id = f.id) "
+  "JOIN tags t ON (tgs.tag_id = t.id) "
+  "WHERE t.name = ?1 "
+  SEARCH_TYPE_FILTER
+  "ORDER BY dfym_random() "
+  "LIMIT ?2",
+  /* A range of the UniqueTagging index, which is already in file id order */
+  [STMT_SEARCH_PAGE] =
+  "SELECT dfym_path(f.dir_id, f.name), f.id "
+  "FROM tags t "
+  "JOIN taggings tgs ON (tgs.tag_id = t.id) "
+  "JOIN files f ON (f.id = tgs.file_id) "
+  "WHERE t.name = ?1 AND tgs.file_id > ?4 "
+  SEARCH_TYPE_FILTER
+  "ORDER BY tgs.file_id "
+  "LIMIT ?2",
+  [STMT_FIND] =
+  MATCH_CTE
+  "SELECT dfym_path(f.dir_id, f.name), f.id "
+  "FROM matched "
+  "JOIN files f ON (f.id = matched.id) "
+  "WHERE 1 "
+  SEARCH_TYPE_FILTER
+  "LIMIT ?2",
+  [STMT_FIND_RANDOM] =
+  MATCH_CTE
+  "SELECT dfym_path(f.dir_id, f.name), f.id "
+  "FROM matched "
+  "JOIN files f ON (f.id = matched.id) "
+  "WHERE 1 "
+  SEARCH_TYPE_FILTER
+  "ORDER BY dfym_random() "
+  "LIMIT ?2",
+  [STMT_MATCH_POSTINGS] =
+  MATCH_CTE
+  "SELECT id FROM matched ORDER BY id",
+  [STMT_TAG_POSTINGS] =
+  "SELECT tgs.file_id "
+  "FROM taggings tgs "
+  "JOIN tags t ON (tgs.tag_id = t.id) "
+  "WHERE t.name = ? "
+  "ORDER BY tgs.file_id",
+  [STMT_ALL_FILE_IDS] =
+  "SELECT id FROM files ORDER BY id",
+  [STMT_MAX_FILE_ID] =
+  "SELECT max(id) FROM files",
+  [STMT_FILE_NAME] =
+  "SELECT dfym_path(dir_id, name), type FROM files WHERE id = ?",
+  [STMT_TAGGED_DIRS] =
+  "SELECT DISTINCT dir_id FROM files",
+  [STMT_FILE_STAT] =
+  "UPDATE files "
+  "SET type = ?2, size = ?3, mtime = ?4, dev = ?5, ino = ?6 "
+  "WHERE id = ?1 AND (type, size, mtime, dev, ino) IS NOT (?2, ?3, ?4, ?5, ?6)",
+  [STMT_FILE_RENAME] =
+  "UPDATE files "
+  "SET dir_id = ?1, name = ?2 "
+  "WHERE id = ?3",
+  [STMT_TAG_RENAME] =
+  "UPDATE tags "
+  "SET name = ?1 "
+  "WHERE name = ?2",
+  [STMT_FILE_DELETE_TAGGINGS] =
+  "DELETE FROM taggings WHERE file_id = ?1",
+  [STMT_FILE_DELETE] =
+  "DELETE FROM files WHERE id = ?1",
+  [STMT_TAG_DELETE_TAGGINGS] =
+  "DELETE "
+  "FROM taggings "
+  "WHERE tag_id IN (SELECT tags.id FROM tags WHERE tags.name = ?1) ",
+  [STMT_TAG_DELETE] =
+  "DELETE FROM tags WHERE name = ?1",
+  [STMT_GC_RANGE] =
+  "SELECT id, dfym_path(dir_id, name), type "
+  "FROM files "
+  "WHERE id >= ?1 AND id <= ?2 "
+  "ORDER BY id "
+  "LIMIT ?3",
+  [STMT_TAG_COUNTS] =
+  "SELECT t.name, s.files "
+  "FROM tag_stats s "
+  "JOIN tags t ON (t.id = s.tag_id) "
+  "ORDER BY s.files DESC, t.name "
+  "LIMIT ?1",
+  [STMT_EMPTY_TAGS] =
+  "SELECT t.name "
+  "FROM tag_stats s "
+  "JOIN tags t ON (t.id = s.tag_id) "
+  "WHERE s.files = 0 "
+  "ORDER BY t.name",
+  /* The taggings are summed from the counts rather than counted */
+  [STMT_SUMMARY] =
+  "SELECT (SELECT count(*) FROM tags), "
+  "       (SELECT count(*) FROM tag_stats WHERE files = 0), "
+  "       (SELECT total(files) FROM tag_stats), "
+  "       (SELECT count(*) FROM files), "
+  "       (SELECT count(*) FROM files WHERE type = 'd'), "
+  "       (SELECT count(*) FROM dirs WHERE parent_id IS NOT NULL)",
+  /* A tag drifted if its count is wrong, or if its taggings aren't numbered
+     from 1 to their count */
+  [STMT_TAG_STATS_DRIFTED] =
+  "SELECT t.id, t.name, s.files, coalesce(g.n, 0) AS actual "
+  "FROM tags t "
+  "LEFT JOIN tag_stats s ON (s.tag_id = t.id) "
+  "LEFT JOIN (SELECT tag_id, count(*) AS n, count(DISTINCT seq) AS numbered, "
+  "                  min(seq) AS first, max(seq) AS last "
+  "           FROM taggings GROUP BY tag_id) g ON (g.tag_id = t.id) "
+  "WHERE s.files IS NOT actual "
+  "OR (g.n AND (g.numbered != g.n OR g.first != 1 OR g.last != g.n))",
+  [STMT_TAG_STATS_SET] =
+  "INSERT OR REPLACE INTO tag_stats ( tag_id, files ) VALUES ( ?1, ?2 )",
+  [STMT_TAG_STATS_ORPHANS] =
+  "DELETE FROM tag_stats WHERE tag_id NOT IN (SELECT id FROM tags)",
+  [STMT_TAG_RENUMBER] =
+  "UPDATE taggings SET seq = r.n "
+  "FROM (SELECT id, row_number() OVER (ORDER BY id) AS n "
+  "      FROM taggings WHERE tag_id = ?1) AS r "
+  "WHERE taggings.id = r.id",
+  [STMT_TAG_SIZE] =
+  "SELECT s.tag_id, s.files "
+  "FROM tags t "
+  "JOIN tag_stats s ON (s.tag_id = t.id) "
+  "WHERE t.name = ?1",
+  [STMT_TAGGING_AT] =
+  "SELECT dfym_path(f.dir_id, f.name), f.id, f.type "
+  "FROM taggings tgs "
+  "JOIN files f ON (f.id = tgs.file_id) "
+  "WHERE tgs.tag_id = ?1 AND tgs.seq = ?2 "
+  "LIMIT 1"
+};
+
+/** Id of the root directory node, whose path is the empty string */
+#define ROOT_DIR_ID 1
+
+/** State of a context, owning its connection */
+struct dfym_ctx
+{
+  sqlite3 *db;                          /**< The SQLite3 database */
+  int failed;                           /**< Whether a call to SQLite failed since the API was called */
+  char *errmsg;                         /**< What failed last, see \ref dfym_errmsg */
+  dfym_result_handler_t handler;        /**< Receiver of the results, NULL to drop them */
+  void *handler_data;                   /**< Data passed to the handler */
+  dfym_field_t fields[DFYM_MAX_FIELDS]; /**< Fields of the result being built */
+  unsigned int n_fields;                /**< Number of fields of the result being built */
+  GString *scratch;                     /**< Text of the fields that are built */
+  sqlite3_stmt *statements[STMT_COUNT]; /**< Prepared statements, NULL until first use */
+  unsigned long int hits;               /**< Statements served from the cache */
+  unsigned long int misses;             /**< Statements that had to be prepared */
+  GHashTable *dir_ids;                  /**< Directory path -> node id, of the nodes seen */
+  GHashTable *dir_paths;                /**< Node id -> directory path, of the nodes seen */
+  unsigned int busy_timeout;            /**< Milliseconds to wait for a lock, see \ref dfym_set_busy_timeout */
+  unsigned int busy_waited;             /**< Milliseconds waited for the current lock */
+  int data_version;                     /**< PRAGMA data_version when the caches were checked */
+  dfym_trie_t *tags;                    /**< Names of the tags, NULL until a fuzzy lookup */
+  int tags_version;                     /**< PRAGMA data_version when the tags were loaded */
+  int tags_changes;                     /**< Changes made by the connection when the tags were loaded */
+  GRand *rand;                          /**< Random number generator, NULL until first used */
+  GArray *migrated;                     /**< dfym_migrated_t of the migrations applied when opening */
+  unsigned long int fs_stats;           /**< Files stat'ed by the context, see \ref dfym_trace */
+  unsigned long int fs_readdirs;        /**< Directory entries read by the context */
+  unsigned int trace;                   /**< Flags of \ref dfym_trace, 0 when not tracing */
+  dfym_trace_handler_t trace_handler;   /**< Receiver of the statements run, with TRACE_STATEMENTS */
+  void *trace_data;                     /**< Data passed to the trace handler */
+  gint64 trace_start;                   /**< When tracing started */
+  unsigned long int trace_hits;         /**< Statement cache hits when tracing started */
+  unsigned long int trace_misses;       /**< Statement cache misses when tracing started */
+  unsigned long int trace_stats;        /**< Files stat'ed when tracing started */
+  unsigned long int trace_readdirs;     /**< Directory entries read when tracing started */
+  GHashTable *trace_sql;                /**< SQL text -> trace_stats_t */
+  GHashTable *trace_statements;         /**< Statement -> trace_stats_t */
+};
+
+/** Statistics of the runs of a statement, while tracing */
+typedef struct
+{
+  char *sql;                    /**< SQL text of the statement */
+  unsigned long int runs;       /**< Times it was run */
+  guint64 ns;                   /**< Nanoseconds spent running it */
+  guint64 rows;                 /**< Rows it returned */
+  guint64 run_rows;             /**< Rows it returned in the current run */
+  guint64 fullscan_steps;       /**< Steps of full table scans */
+  guint64 sorts;                /**< Sorts done */
+} trace_stats_t;
+
+/**
+ * Record that a call to SQLite failed. The context then stops running
+ * statements, which makes the functions under way wind down without changing
+ * anything more, until \ref dfym_return makes the API call fail.
+ */
+static void dfym_fail (dfym_ctx_t *ctx, char const *const call, int status)
+{
+  if (ctx->failed)
+    return;
+  ctx->failed = 1;
+  g_free (ctx->errmsg);
+  ctx->errmsg = g_strdup_printf ("%s failed with status %d: %s",
+                                 call, status, sqlite3_errmsg (ctx->db));
+}
+
+/**
+ * Check the last step of a statement read until it had no more rows.
+ */
+static void dfym_check_done (dfym_ctx_t *ctx, int step)
+{
+  if (step != SQLITE_DONE)
+    dfym_fail (ctx, "step", step);
+}
+
+static void dfym_dir_cache_flush (dfym_ctx_t *ctx);
+
+/**
+ * End a call to the API with the given status, unless a call to SQLite
+ * failed meanwhile: the open transaction, of the call or of the batch it is
+ * part of, is then rolled back, and the call fails with DFYM_DATABASE_ERROR.
+ */
+static int dfym_return (dfym_ctx_t *ctx, int status)
+{
+  if (!ctx->failed)
+    {
+      /* The message only tells about the call that just failed */
+      if (status != DFYM_DATABASE_ERROR)
+        {
+          g_free (ctx->errmsg);
+          ctx->errmsg = NULL;
+        }
+      return status;
+    }
+  for (int k = 0; k < STMT_COUNT; k++)
+    if (ctx->statements[k])
+      sqlite3_reset (ctx->statements[k]);
+  if (!sqlite3_get_autocommit (ctx->db))
+    sqlite3_exec (ctx->db, "ROLLBACK", NULL, NULL, NULL);
+  /* The caches may hold rows that were rolled back */
+  dfym_dir_cache_flush (ctx);
+  if (ctx->tags)
+    {
+      dfym_trie_free (ctx->tags);
+      ctx->tags = NULL;
+    }
+  ctx->failed = 0;
+  return DFYM_DATABASE_ERROR;
+}
+
+/**
+ * Add a text field to the result being built.
+ */
+static void dfym_result_text (dfym_ctx_t *ctx, char const *name, char const *value, int length)
+{
+  dfym_field_t *field = &ctx->fields[ctx->n_fields++];
+
+  field->name = name;
+  field->value = value ? value : "";
+  field->length = length < 0 ? strlen (field->value) : length;
+  field->number = 0;
+}
+
+/**
+ * Add a number field to the result being built.
+ */
+static void dfym_result_number (dfym_ctx_t *ctx, char const *name, sqlite3_int64 value)
+{
+  dfym_field_t *field = &ctx->fields[ctx->n_fields++];
+
+  field->name = name;
+  field->value = NULL;
+  field->length = 0;
+  field->number = value;
+}
+
+/**
+ * Add a path field to the result being built, from a directory prefix and a
+ * name. The path is built in the scratch buffer of the context.
+ */
+static void dfym_result_path (dfym_ctx_t *ctx, char const *prefix, char const *name)
+{
+  g_string_assign (ctx->scratch, prefix);
+  g_string_append (ctx->scratch, name);
+  dfym_result_text (ctx, "path", ctx->scratch->str, ctx->scratch->len);
+}
+
+/**
+ * Hand the result built to the handler of the context.
+ */
+static void dfym_result_end (dfym_ctx_t *ctx)
+{
+  if (ctx->handler)
+    ctx->handler (ctx->fields, ctx->n_fields, ctx->handler_data);
+  ctx->n_fields = 0;
+}
+
+/**
+ * Busy handler: wait for the lock with an exponential backoff, from 1 ms up
+ * to 128 ms between retries, until the connection's busy timeout is spent.
+ * The delays are jittered, so that waiting writers don't retry in lockstep.
+ */
+static int dfym_busy_handler (void *data, int count)
+{
+  dfym_ctx_t *ctx = data;
+  unsigned int delay = 1 << MIN (count, 7);
+
+  if (!count)
+    ctx->busy_waited = 0;
+  if (ctx->busy_waited >= ctx->busy_timeout)
+    return 0;
+  delay = MIN (delay / 2 + g_random_int_range (0, delay / 2 + 1),
+               ctx->busy_timeout - ctx->busy_waited);
+  g_usleep (MAX (delay, 1) * 1000);
+  ctx->busy_waited += MAX (delay, 1);
+  return 1;
+}
+
+/**
+ * Get a cached statement, ready to be bound and stepped.
+ * The statement is prepared on first use and reset on every later one, and
+ * there is none once the context failed.
+ */
+static sqlite3_stmt *dfym_statement (dfym_ctx_t *ctx, dfym_statement_id_t id)
+{
+  sqlite3_stmt *stmt = ctx->statements[id];
+
+  /* Steps of no statement fail, ending the loops over their rows */
+  if (ctx->failed)
+    return NULL;
+  if (stmt)
+    {
+      ctx->hits++;
+      sqlite3_reset (stmt);
+      sqlite3_clear_bindings (stmt);
+    }
+  else
+    {
+      ctx->misses++;
+      CALL_SQLITE (prepare_v3 (ctx->db, statement_sql[id], -1,
+                               SQLITE_PREPARE_PERSISTENT, &stmt, NULL));
+      ctx->statements[id] = stmt;
+    }
+  return stmt;
+}
+
+/**
+ * Step a lookup statement once and tell whether it produced a row. Only
+ * SQLITE_DONE means there is none: anything else is a failure, recorded.
+ */
+static int dfym_step_row (dfym_ctx_t *ctx, sqlite3_stmt *stmt)
+{
+  int step = sqlite3_step (stmt);
+
+  if (step == SQLITE_ROW)
+    return 1;
+  dfym_check_done (ctx, step);
+  return 0;
+}
+
+/**
+ * Step a lookup statement once and tell whether it produced a row, see
+ * \ref dfym_step_row. The statement is reset so it doesn't keep a read
+ * transaction open.
+ */
+static int dfym_statement_has_row (dfym_ctx_t *ctx, sqlite3_stmt *stmt)
+{
+  int row = dfym_step_row (ctx, stmt);
+
+  sqlite3_reset (stmt);
+  return row;
+}
+
+/**
+ * Insert a tag if it doesn't exist, and return its id.
+ */
+static sqlite3_int64 dfym_upsert_tag (dfym_ctx_t *ctx, char const *const tag)
+{
+  sqlite3_stmt *stmt = dfym_statement (ctx, STMT_TAG_UPSERT);
+  sqlite3_int64 row_id = 0;
+
+  CALL_SQLITE (bind_text (stmt, 1, tag, strlen (tag), 0));
+  CALL_SQLITE_EXPECT (step (stmt), ROW);
+  row_id = sqlite3_column_int64 (stmt, 0);
+  CALL_SQLITE_EXPECT (step (stmt), DONE);
+  return row_id;
+}
+
+/**
+ * Split a path into its directory, given as a length, and its base name.
+ * The directory of a top-level entry is the root, of length 0.
+ */
+static char const *path_split (char const *const path, size_t length, size_t *dir_length)
+{
+  size_t i = length;
+
+  while (i && path[i-1] != G_DIR_SEPARATOR)
+    i--;
+  *dir_length = i ? i - 1 : 0;
+  return path + i;
+}
+
+/**
+ * Remember both ways the path of a directory node.
+ */
+static void dfym_dir_cache (dfym_ctx_t *ctx,
+                            char const *const path,
+                            size_t length,
+                            sqlite3_int64 dir_id)
+{
+  sqlite3_int64 *id = g_new (sqlite3_int64, 1);
+
+  *id = dir_id;
+  g_hash_table_replace (ctx->dir_ids, g_strndup (path, length), id);
+  id = g_new (sqlite3_int64, 1);
+  *id = dir_id;
+  g_hash_table_replace (ctx->dir_paths, id, g_strndup (path, length));
+}
+
+/**
+ * Forget every node of the node map, after moving or deleting directories.
+ */
+static void dfym_dir_cache_flush (dfym_ctx_t *ctx)
+{
+  g_hash_table_remove_all (ctx->dir_ids);
+  g_hash_table_remove_all (ctx->dir_paths);
+}
+
+/**
+ * Length of a directory path without its trailing separators.
+ */
+static size_t path_trimmed_length (char const *const path)
+{
+  size_t length = strlen (path);
+
+  while (length && path[length-1] == G_DIR_SEPARATOR)
+    length--;
+  return length;
+}
+
+/**
+ * Get the node id of the directory made by the first length bytes of a path,
+ * looking it up in the node map first. If create is set, missing nodes are
+ * inserted. Returns 0 if the directory has no node.
+ */
+static sqlite3_int64 dfym_dir_id (dfym_ctx_t *ctx,
+                                  char const *const path,
+                                  size_t length,
+                                  int create)
+{
+  sqlite3_stmt *stmt;
+  sqlite3_int64 *cached, parent_id, dir_id = 0;
+  char *key;
+  char const *name;
+  size_t parent_length;
+
+  if (!length)
+    return ROOT_DIR_ID;
+  key = g_strndup (path, length);
+  cached = g_hash_table_lookup (ctx->dir_ids, key);
+  g_free (key);
+  if (cached)
+    return *cached;
+
+  name = path_split (path, length, &parent_length);
+  if (!(parent_id = dfym_dir_id (ctx, path, parent_length, create)))
+    return 0;
+  stmt = dfym_statement (ctx, STMT_DIR_LOOKUP);
+  CALL_SQLITE (bind_int64 (stmt, 1, parent_id));
+  CALL_SQLITE (bind_text (stmt, 2, name, path + length - name, 0));
+  if (dfym_step_row (ctx, stmt))
+    dir_id = sqlite3_column_int64 (stmt, 0);
+  sqlite3_reset (stmt);
+  if (!dir_id && create && !ctx->failed)
+    {
+      stmt = dfym_statement (ctx, STMT_DIR_INSERT);
+      CALL_SQLITE (bind_int64 (stmt, 1, parent_id));
+      CALL_SQLITE (bind_text (stmt, 2, name, path + length - name, 0));
+      CALL_SQLITE_EXPECT (step (stmt), ROW);
+      dir_id = sqlite3_column_int64 (stmt, 0);
+      sqlite3_reset (stmt);
+    }
+  if (dir_id)
+    dfym_dir_cache (ctx, path, length, dir_id);
+  return dir_id;
+}
+
+/**
+ * Get the path of a directory node, rebuilding it from its ancestors if it
+ * isn't in the node map yet. Returns NULL if there is no such node.
+ */
+static char const *dfym_dir_path (dfym_ctx_t *ctx, sqlite3_int64 dir_id)
+{
+  sqlite3_stmt *stmt;
+  sqlite3_int64 parent_id;
+  char const *path, *parent_path;
+  char *name;
+
+  if (dir_id == ROOT_DIR_ID)
+    return "";
+  if ((path = g_hash_table_lookup (ctx->dir_paths, &dir_id)))
+    return path;
+  stmt = dfym_statement (ctx, STMT_DIR_NODE);
+  CALL_SQLITE (bind_int64 (stmt, 1, dir_id));
+  if (!dfym_step_row (ctx, stmt))
+    {
+      sqlite3_reset (stmt);
+      return NULL;
+    }
+  parent_id = sqlite3_column_int64 (stmt, 0);
+  name = g_strdup ((char const *)sqlite3_column_text (stmt, 1));
+  sqlite3_reset (stmt);
+  if ((parent_path = dfym_dir_path (ctx, parent_id)))
+    {
+      char *full_path = g_strconcat (parent_path, G_DIR_SEPARATOR_S, name, NULL);
+      dfym_dir_cache (ctx, full_path, strlen (full_path), dir_id);
+      g_free (full_path);
+      path = g_hash_table_lookup (ctx->dir_paths, &dir_id);
+    }
+  g_free (name);
+  return path;
+}
+
+/**
+ * Bind the metadata of a file to five consecutive parameters of a statement,
+ * from first on: type, size, mtime, device and inode. The type is 'f' for
+ * files, 'd' for directories and 'o' for anything else, following symbolic
+ * links like g_file_test does. Nothing is bound for a file that can't be
+ * stat'ed, which leaves NULLs.
+ * \return The type of the file, or 0 if it can't be stat'ed.
+ */
+static char dfym_bind_stat (dfym_ctx_t *ctx,
+                            sqlite3_stmt *stmt,
+                            int first,
+                            char const *const path)
+{
+  struct stat st;
+  char type;
+
+  ctx->fs_stats++;
+  if (stat (path, &st))
+    return 0;
+  type = S_ISREG (st.st_mode) ? 'f' : S_ISDIR (st.st_mode) ? 'd' : 'o';
+  CALL_SQLITE (bind_text (stmt, first, &type, 1, SQLITE_TRANSIENT));
+  CALL_SQLITE (bind_int64 (stmt, first + 1, st.st_size));
+  CALL_SQLITE (bind_int64 (stmt, first + 2, st.st_mtime));
+  CALL_SQLITE (bind_int64 (stmt, first + 3, st.st_dev));
+  CALL_SQLITE (bind_int64 (stmt, first + 4, st.st_ino));
+  return type;
+}
+
+/**
+ * Stat a batch of entries with a probe, counting them for \ref dfym_trace.
+ */
+static void probe_batch (dfym_ctx_t *ctx, dfym_probe_t *probe, dfym_probe_entry_t *entries, unsigned int n)
+{
+  ctx->fs_stats += n;
+  dfym_probe_run (probe, entries, n);
+}
+
+/**
+ * Bind the metadata found by a probe, like \ref dfym_bind_stat does: nothing
+ * is bound for a file that couldn't be stat'ed.
+ * \return The type of the file, or 0 if it can't be stat'ed.
+ */
+static char dfym_bind_probe (dfym_ctx_t *ctx,
+                             sqlite3_stmt *stmt,
+                             int first,
+                             dfym_probe_entry_t const *entry)
+{
+  if (!entry->type)
+    return 0;
+  CALL_SQLITE (bind_text (stmt, first, &entry->type, 1, SQLITE_TRANSIENT));
+  CALL_SQLITE (bind_int64 (stmt, first + 1, entry->size));
+  CALL_SQLITE (bind_int64 (stmt, first + 2, entry->mtime));
+  CALL_SQLITE (bind_int64 (stmt, first + 3, entry->dev));
+  CALL_SQLITE (bind_int64 (stmt, first + 4, entry->ino));
+  return entry->type;
+}
+
+/**
+ * Get the id of a file from its full path. If create is set, the file and its
+ * directory nodes are inserted if missing, and its metadata is stored from a
+ * fresh stat. Returns 0 if the file isn't there.
+ */
+static sqlite3_int64 dfym_file_id (dfym_ctx_t *ctx, char const *const file, int create)
+{
+  size_t dir_length;
+  char const *name = path_split (file, strlen (file), &dir_length);
+  sqlite3_int64 dir_id, file_id = 0;
+  sqlite3_stmt *stmt;
+
+  if (!(dir_id = dfym_dir_id (ctx, file, dir_length, create)))
+    return 0;
+  stmt = dfym_statement (ctx, create ? STMT_FILE_UPSERT : STMT_FILE_ID);
+  CALL_SQLITE (bind_int64 (stmt, 1, dir_id));
+  CALL_SQLITE (bind_text (stmt, 2, name, strlen (name), 0));
+  if (create)
+    dfym_bind_stat (ctx, stmt, 3, file);
+  if (dfym_step_row (ctx, stmt))
+    file_id = sqlite3_column_int64 (stmt, 0);
+  sqlite3_reset (stmt);
+  return file_id;
+}
+
+/**
+ * Get the random number generator of a connection. It is seeded from the
+ * system's entropy source, so separate runs get separate results, unless
+ * \ref dfym_set_seed was given a seed.
+ */
+static GRand *dfym_rand (dfym_ctx_t *ctx)
+{
+  if (!ctx->rand)
+    ctx->rand = g_rand_new ();
+  return ctx->rand;
+}
+
+/**
+ * SQL function dfym_random(), a random integer from the generator of the
+ * connection, so that a seed makes ORDER BY dfym_random() reproducible.
+ */
+static void dfym_random_function (sqlite3_context *context,
+                                  int argc,
+                                  sqlite3_value **argv)
+{
+  GRand *rand = dfym_rand (sqlite3_user_data (context));
+
+  sqlite3_result_int64 (context, ((gint64)g_rand_int (rand) << 32) | g_rand_int (rand));
+}
+
+/**
+ * SQL function dfym_path(dir_id, name), giving the full path of a file.
+ */
+static void dfym_path_function (sqlite3_context *context,
+                                int argc,
+                                sqlite3_value **argv)
+{
+  char const *dir = dfym_dir_path (sqlite3_user_data (context), sqlite3_value_int64 (argv[0]));
+  char const *name = (char const *)sqlite3_value_text (argv[1]);
+  size_t dir_length, name_length;
+  char *path;
+
+  if (!dir || !name)
+    {
+      sqlite3_result_null (context);
+      return;
+    }
+  dir_length = strlen (dir);
+  name_length = sqlite3_value_bytes (argv[1]);
+  path = sqlite3_malloc (dir_length + name_length + 2);
+  memcpy (path, dir, dir_length);
+  path[dir_length] = G_DIR_SEPARATOR;
+  memcpy (path + dir_length + 1, name, name_length + 1);
+  sqlite3_result_text (context, path, dir_length + name_length + 1, sqlite3_free);
+}
+
+/**
+ * Execute a statement that takes no parameters and returns no rows.
+ */
+static void dfym_exec (dfym_ctx_t *ctx, char const *const sql)
+{
+  char *exec_error_msg = NULL;
+
+  if (ctx->failed)
+    return;
+  CALL_SQLITE_EXPECT (exec (ctx->db, sql, NULL, 0, &exec_error_msg), OK);
+  if (exec_error_msg)
+    sqlite3_free (exec_error_msg);
+}
+
+/**
+ * Start a write transaction, or a savepoint if the caller already started
+ * one, so that functions making several changes can be batched.
+ * \return Whether a transaction was started, for \ref dfym_commit and
+ * \ref dfym_rollback.
+ */
+static int dfym_begin (dfym_ctx_t *ctx)
+{
+  if (!sqlite3_get_autocommit (ctx->db))
+    {
+      dfym_exec (ctx, "SAVEPOINT dfym");
+      return 0;
+    }
+  dfym_exec (ctx, "BEGIN IMMEDIATE");
+  return 1;
+}
+
+static void dfym_commit (dfym_ctx_t *ctx, int started)
+{
+  dfym_exec (ctx, started ? "COMMIT" : "RELEASE dfym");
+}
+
+static void dfym_rollback (dfym_ctx_t *ctx, int started)
+{
+  dfym_exec (ctx, started ? "ROLLBACK" : "ROLLBACK TO dfym; RELEASE dfym");
+}
+
+/** Uniform random sample of a stream of strings, of a bounded size */
+typedef struct
+{
+  GPtrArray *items;             /**< The sample, owning its strings */
+  unsigned long int capacity;   /**< Size of the sample, 0 to keep everything */
+  guint64 seen;                 /**< Items offered so far */
+  GRand *rand;                  /**< Random number generator, not owned */
+} reservoir_t;
+
+/**
+ * Get a uniformly distributed random number in [0, bound).
+ */
+static guint64 random_below (GRand *rand, guint64 bound)
+{
+  guint64 limit, value;
+
+  if (bound <= G_MAXINT32)
+    return g_rand_int_range (rand, 0, bound);
+  /* Reject the top values that would make the modulo biased */
+  limit = G_MAXUINT64 - G_MAXUINT64 % bound;
+  do
+    value = ((guint64)g_rand_int (rand) << 32) | g_rand_int (rand);
+  while (value >= limit);
+  return value % bound;
+}
+
+/**
+ * Start a sample of the given capacity, drawn with the given generator.
+ */
+static void reservoir_init (reservoir_t *reservoir, unsigned long int capacity, GRand *rand)
+{
+  reservoir->items = g_ptr_array_new_with_free_func (g_free);
+  reservoir->capacity = capacity;
+  reservoir->seen = 0;
+  reservoir->rand = rand;
+}
+
+/**
+ * Offer an item to the sample. The string is only copied if it is kept, so
+ * the memory used depends on the capacity, not on the number of items.
+ */
+static void reservoir_offer (reservoir_t *reservoir, char const *const item)
+{
+  guint64 slot;
+
+  reservoir->seen++;
+  if (!reservoir->capacity || reservoir->items->len < reservoir->capacity)
+    g_ptr_array_add (reservoir->items, g_strdup (item));
+  else if ((slot = random_below (reservoir->rand, reservoir->seen)) < reservoir->capacity)
+    {
+      g_free (reservoir->items->pdata[slot]);
+      reservoir->items->pdata[slot] = g_strdup (item);
+    }
+}
+
+/**
+ * Shuffle the sample, since the order in which items are kept isn't random.
+ */
+static void reservoir_shuffle (reservoir_t *reservoir)
+{
+  gpointer *items = reservoir->items->pdata;
+
+  for (guint i = reservoir->items->len; i > 1; i--)
+    {
+      guint j = random_below (reservoir->rand, i);
+      gpointer t = items[j];
+      items[j] = items[i-1];
+      items[i-1] = t;
+    }
+}
+
+static void reservoir_clear (reservoir_t *reservoir)
+{
+  g_ptr_array_free (reservoir->items, TRUE);
+}
+
+/** A schema upgrade, applied once to every database */
+typedef struct
+{
+  const char *description;      /**< What the migration does, for the log */
+  const char *sql;              /**< Statements to run (can be NULL) */
+  void (*apply) (dfym_ctx_t *); /**< Function to run after them (can be NULL) */
+} dfym_migration_t;
+
+/**
+ * Move the files from full path names to a name within a directory node,
+ * keeping their ids. Foreign keys are not enforced yet while migrating, so
+ * the old table can be replaced under the taggings.
+ */
+static void dfym_migrate_dirs (dfym_ctx_t *ctx)
+{
+  sqlite3_stmt *select = NULL, *insert = NULL;
+
+  CALL_SQLITE (prepare_v2 (ctx->db, "SELECT id, name FROM files", -1, &select, NULL));
+  CALL_SQLITE (prepare_v2 (ctx->db,
+                           "INSERT INTO files_by_dir ( id, dir_id, name ) "
+                           "VALUES ( ?1, ?2, ?3 )",
+                           -1, &insert, NULL));
+  while (sqlite3_step (select) == SQLITE_ROW)
+    {
+      const char *path = (const char *)sqlite3_column_text (select, 1);
+      size_t dir_length;
+      const char *name = path_split (path, strlen (path), &dir_length);
+
+      CALL_SQLITE (bind_int64 (insert, 1, sqlite3_column_int64 (select, 0)));
+      CALL_SQLITE (bind_int64 (insert, 2, dfym_dir_id (ctx, path, dir_length, 1)));
+      CALL_SQLITE (bind_text (insert, 3, name, strlen (name), SQLITE_TRANSIENT));
+      CALL_SQLITE_EXPECT (step (insert), DONE);
+      CALL_SQLITE (reset (insert));
+    }
+  CALL_SQLITE (finalize (select));
+  CALL_SQLITE (finalize (insert));
+  dfym_exec (ctx, "DROP TABLE files");
+  dfym_exec (ctx, "ALTER TABLE files_by_dir RENAME TO files");
+}
+
+/**
+ * Fill the metadata of the files tagged before it was stored.
+ */
+static void dfym_migrate_stat (dfym_ctx_t *ctx)
+{
+  sqlite3_stmt *select = NULL;
+
+  CALL_SQLITE (prepare_v2 (ctx->db, "SELECT id, dfym_path(dir_id, name) FROM files",
+                           -1, &select, NULL));
+  while (sqlite3_step (select) == SQLITE_ROW)
+    {
+      sqlite3_stmt *stmt = dfym_statement (ctx, STMT_FILE_STAT);
+      CALL_SQLITE (bind_int64 (stmt, 1, sqlite3_column_int64 (select, 0)));
+      dfym_bind_stat (ctx, stmt, 2, (const char *)sqlite3_column_text (select, 1));
+      CALL_SQLITE_EXPECT (step (stmt), DONE);
+    }
+  CALL_SQLITE (finalize (select));
+}
+
+/**
+ * Gather statistics for the query planner, if there is data to gather them
+ * from: statistics of empty tables would mislead it once they fill up.
+ * Databases created empty get them from PRAGMA optimize, see
+ * \ref dfym_optimize.
+ */
+static void dfym_migrate_analyze (dfym_ctx_t *ctx)
+{
+  sqlite3_stmt *select = NULL;
+  int tagged;
+
+  CALL_SQLITE (prepare_v2 (ctx->db, "SELECT 1 FROM taggings LIMIT 1", -1, &select, NULL));
+  tagged = sqlite3_step (select) == SQLITE_ROW;
+  CALL_SQLITE (finalize (select));
+  if (tagged)
+    dfym_exec (ctx, "ANALYZE");
+}
+
+/**
+ * Schema migrations. The database's user_version is the number of migrations
+ * applied to it, so new migrations must always be appended.
+ */
+static const dfym_migration_t migrations[] =
+{
+  {
+    "create tables",
+    "CREATE TABLE IF NOT EXISTS tags("
+    "id          INTEGER PRIMARY KEY, "
+    "name        TEXT UNIQUE NOT NULL"
+    ");"
+    "CREATE TABLE IF NOT EXISTS files("
+    "id          INTEGER PRIMARY KEY, "
+    "name        TEXT UNIQUE NOT NULL"
+    ");"
+    "CREATE TABLE IF NOT EXISTS taggings("
+    "id          INTEGER PRIMARY KEY, "
+    "tag_id      INTEGER NOT NULL, "
+    "file_id     INTEGER NOT NULL, "
+    "CONSTRAINT UniqueTagging UNIQUE(tag_id, file_id), "
+    "FOREIGN KEY(tag_id) REFERENCES tags(id), "
+    "FOREIGN KEY(file_id) REFERENCES files(id)"
+    ")"
+  },
+  {
+    /* Lookups of the tags of a file, and of the taggings to delete with it */
+    "index taggings by file",
+    "CREATE INDEX IF NOT EXISTS TaggingsByFile ON taggings(file_id, tag_id)"
+  },
+  {
+    "gather statistics for the query planner",
+    NULL,
+    dfym_migrate_analyze
+  },
+  {
+    /* Paths share their directories, stored once as a tree of nodes */
+    "store files in a directory tree",
+    "CREATE TABLE dirs("
+    "id          INTEGER PRIMARY KEY, "
+    "parent_id   INTEGER REFERENCES dirs(id), "
+    "name        TEXT NOT NULL, "
+    "CONSTRAINT UniqueDir UNIQUE(parent_id, name)"
+    ");"
+    "INSERT INTO dirs ( id, parent_id, name ) VALUES ( 1, NULL, '' );"
+    "CREATE TABLE files_by_dir("
+    "id          INTEGER PRIMARY KEY, "
+    "dir_id      INTEGER NOT NULL REFERENCES dirs(id), "
+    "name        TEXT NOT NULL, "
+    "CONSTRAINT UniqueFile UNIQUE(dir_id, name)"
+    ")",
+    dfym_migrate_dirs
+  },
+  {
+    /* Only the file of a deleted tagging can be left without tags */
+    "delete orphan files incrementally",
+    "CREATE TRIGGER DeleteOrphanFile AFTER DELETE ON taggings "
+    "WHEN NOT EXISTS (SELECT 1 FROM taggings WHERE file_id = OLD.file_id) "
+    "BEGIN "
+    "  DELETE FROM files WHERE id = OLD.file_id; "
+    "END;"
+    "DELETE FROM files "
+    "WHERE NOT EXISTS (SELECT 1 FROM taggings WHERE file_id = files.id)"
+  },
+  {
+    /* Type filters and change checks don't need to stat the files again */
+    "store the metadata of files",
+    "ALTER TABLE files ADD COLUMN type TEXT;"
+    "ALTER TABLE files ADD COLUMN size INTEGER;"
+    "ALTER TABLE files ADD COLUMN mtime INTEGER;"
+    "ALTER TABLE files ADD COLUMN dev INTEGER;"
+    "ALTER TABLE files ADD COLUMN ino INTEGER",
+    dfym_migrate_stat
+  },
+  {
+    /* The names of files and directories are indexed apart, so that moving
+       a directory doesn't change the index of the files below it */
+    "index the names of files and directories for full-text search",
+    "CREATE VIRTUAL TABLE file_names USING fts5(name, content='files', content_rowid='id');"
+    "CREATE VIRTUAL TABLE dir_names USING fts5(name, content='dirs', content_rowid='id');"
+    "CREATE TRIGGER IndexFileName AFTER INSERT ON files BEGIN "
+    "  INSERT INTO file_names ( rowid, name ) VALUES ( NEW.id, NEW.name ); "
+    "END;"
+    "CREATE TRIGGER UnindexFileName AFTER DELETE ON files BEGIN "
+    "  INSERT INTO file_names ( file_names, rowid, name ) VALUES ( 'delete', OLD.id, OLD.name ); "
+    "END;"
+    "CREATE TRIGGER ReindexFileName AFTER UPDATE OF name ON files BEGIN "
+    "  INSERT INTO file_names ( file_names, rowid, name ) VALUES ( 'delete', OLD.id, OLD.name ); "
+    "  INSERT INTO file_names ( rowid, name ) VALUES ( NEW.id, NEW.name ); "
+    "END;"
+    "CREATE TRIGGER IndexDirName AFTER INSERT ON dirs BEGIN "
+    "  INSERT INTO dir_names ( rowid, name ) VALUES ( NEW.id, NEW.name ); "
+    "END;"
+    "CREATE TRIGGER UnindexDirName AFTER DELETE ON dirs BEGIN "
+    "  INSERT INTO dir_names ( dir_names, rowid, name ) VALUES ( 'delete', OLD.id, OLD.name ); "
+    "END;"
+    "CREATE TRIGGER ReindexDirName AFTER UPDATE OF name ON dirs BEGIN "
+    "  INSERT INTO dir_names ( dir_names, rowid, name ) VALUES ( 'delete', OLD.id, OLD.name ); "
+    "  INSERT INTO dir_names ( rowid, name ) VALUES ( NEW.id, NEW.name ); "
+    "END;"
+    "INSERT INTO file_names ( file_names ) VALUES ( 'rebuild' );"
+    "INSERT INTO dir_names ( dir_names ) VALUES ( 'rebuild' )"
+  },
+  {
+    /* Every tagging added or removed, whatever removes it, goes through the
+       triggers, so the counts never have to be taken again */
+    "count the files of each tag",
+    "CREATE TABLE tag_stats("
+    "tag_id      INTEGER PRIMARY KEY REFERENCES tags(id), "
+    "files       INTEGER NOT NULL DEFAULT 0"
+    ");"
+    "CREATE TRIGGER CountNewTag AFTER INSERT ON tags BEGIN "
+    "  INSERT INTO tag_stats ( tag_id ) VALUES ( NEW.id ); "
+    "END;"
+    "CREATE TRIGGER UncountTag AFTER DELETE ON tags BEGIN "
+    "  DELETE FROM tag_stats WHERE tag_id = OLD.id; "
+    "END;"
+    "CREATE TRIGGER CountTagging AFTER INSERT ON taggings BEGIN "
+    "  UPDATE tag_stats SET files = files + 1 WHERE tag_id = NEW.tag_id; "
+    "END;"
+    "CREATE TRIGGER UncountTagging AFTER DELETE ON taggings BEGIN "
+    "  UPDATE tag_stats SET files = files - 1 WHERE tag_id = OLD.tag_id; "
+    "END;"
+    "CREATE TRIGGER RecountTagging AFTER UPDATE OF tag_id ON taggings BEGIN "
+    "  UPDATE tag_stats SET files = files - 1 WHERE tag_id = OLD.tag_id; "
+    "  UPDATE tag_stats SET files = files + 1 WHERE tag_id = NEW.tag_id; "
+    "END;"
+    "INSERT INTO tag_stats ( tag_id, files ) "
+    "SELECT id, (SELECT count(*) FROM taggings WHERE tag_id = tags.id) FROM tags"
+  },
+  {
+    /* The taggings of a tag are numbered from 1 to its count, a deleted one
+       giving its number to the last one, so that a random file of a tag is
+       a random number away */
+    "number the taggings of each tag",
+    "ALTER TABLE taggings ADD COLUMN seq INTEGER;"
+    "UPDATE taggings SET seq = r.n "
+    "FROM (SELECT id, row_number() OVER (PARTITION BY tag_id ORDER BY id) AS n "
+    "      FROM taggings) AS r "
+    "WHERE taggings.id = r.id;"
+    "CREATE INDEX TaggingsBySeq ON taggings(tag_id, seq);"
+    "DROP TRIGGER CountTagging;"
+    "DROP TRIGGER UncountTagging;"
+    "DROP TRIGGER RecountTagging;"
+    /* Taggings inserted by dfym already come with their number */
+    "CREATE TRIGGER CountTagging AFTER INSERT ON taggings BEGIN "
+    "  UPDATE tag_stats SET files = files + 1 WHERE tag_id = NEW.tag_id; "
+    "  UPDATE taggings SET seq = (SELECT files FROM tag_stats WHERE tag_id = NEW.tag_id) "
+    "  WHERE id = NEW.id AND NEW.seq IS NULL; "
+    "END;"
+    "CREATE TRIGGER UncountTagging AFTER DELETE ON taggings BEGIN "
+    "  UPDATE taggings SET seq = OLD.seq "
+    "  WHERE tag_id = OLD.tag_id AND seq = (SELECT files FROM tag_stats WHERE tag_id = OLD.tag_id); "
+    "  UPDATE tag_stats SET files = files - 1 WHERE tag_id = OLD.tag_id; "
+    "END;"
+    "CREATE TRIGGER RecountTagging AFTER UPDATE OF tag_id ON taggings BEGIN "
+    "  UPDATE taggings SET seq = OLD.seq "
+    "  WHERE tag_id = OLD.tag_id AND seq = (SELECT files FROM tag_stats WHERE tag_id = OLD.tag_id); "
+    "  UPDATE tag_stats SET files = files - 1 WHERE tag_id = OLD.tag_id; "
+    "  UPDATE tag_stats SET files = files + 1 WHERE tag_id = NEW.tag_id; "
+    "  UPDATE taggings SET seq = (SELECT files FROM tag_stats WHERE tag_id = NEW.tag_id) "
+    "  WHERE id = NEW.id; "
+    "END"
+  }
+};
+
+/**
+ * Get the version of the schema of a database, the number of migrations
+ * applied to it.
+ */
+static int dfym_schema_version (dfym_ctx_t *ctx)
+{
+  sqlite3_stmt *stmt = NULL;
+  int version;
+
+  CALL_SQLITE (prepare_v2 (ctx->db, "PRAGMA user_version", -1, &stmt, NULL));
+  CALL_SQLITE_EXPECT (step (stmt), ROW);
+  version = sqlite3_column_int (stmt, 0);
+  CALL_SQLITE (finalize (stmt));
+  return version;
+}
+
+/** A migration applied when opening a database, see \ref dfym_migrations */
+typedef struct
+{
+  int version;                  /**< Version of the schema it led to */
+  gint64 time_us;               /**< Microseconds it took */
+} dfym_migrated_t;
+
+/**
+ * Bring the schema of a database up to date, applying each pending migration
+ * in its own transaction. Every migration is timed and recorded for
+ * \ref dfym_migrations.
+ */
+static void dfym_migrate (dfym_ctx_t *ctx)
+{
+  int version = dfym_schema_version (ctx);
+
+  while (version < G_N_ELEMENTS (migrations) && !ctx->failed)
+    {
+      gint64 start = g_get_monotonic_time ();
+      dfym_migrated_t migrated;
+      char *pragma;
+
+      /* Another process may have migrated while we waited for the lock */
+      dfym_exec (ctx, "BEGIN IMMEDIATE");
+      if ((version = dfym_schema_version (ctx)) >= G_N_ELEMENTS (migrations))
+        {
+          dfym_exec (ctx, "COMMIT");
+          break;
+        }
+      pragma = g_strdup_printf ("PRAGMA user_version = %d", version + 1);
+      if (migrations[version].sql)
+        dfym_exec (ctx, migrations[version].sql);
+      if (migrations[version].apply)
+        migrations[version].apply (ctx);
+      dfym_exec (ctx, pragma);
+      dfym_exec (ctx, "COMMIT");
+      g_free (pragma);
+      if (ctx->failed)
+        break;
+      migrated.version = ++version;
+      migrated.time_us = g_get_monotonic_time () - start;
+      g_array_append_val (ctx->migrated, migrated);
+    }
+}
+
+/**
+ * \addtogroup database Database query functions
+ */
+/**@{*/
+
+/** Open the database if it exists, create it otherwise.
+ *
+ * The database will be placed in ~/.dfum.db by default. Currently, no means of
+ * changing this default are provided. The schema is upgraded to the latest
+ * version if needed, and foreign keys are enforced. The context owns the
+ * connection, with its statement cache, until \ref dfym_close_database.
+ *
+ * The database is kept in WAL mode, so readers never wait for a writer and
+ * several dfym processes can run at once. Writers wait for each other for up
+ * to \ref DFYM_BUSY_TIMEOUT milliseconds, see \ref dfym_set_busy_timeout.
+ *
+ * A context doesn't share anything with the others, so that every thread can
+ * open one of its own on the same database.
+ * \param db_path The path of the database.
+ * \return The context. If the database couldn't be opened, \ref dfym_errmsg
+ * tells why, and the context can only be closed.
+ */
+dfym_ctx_t *dfym_open_or_create_database (char const *const db_path)
+{
+  dfym_ctx_t *ctx = g_new0 (dfym_ctx_t, 1);
+
+  ctx->dir_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  ctx->dir_paths = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, g_free);
+  ctx->busy_timeout = DFYM_BUSY_TIMEOUT;
+  ctx->scratch = g_string_new (NULL);
+  ctx->migrated = g_array_new (FALSE, FALSE, sizeof (dfym_migrated_t));
+  CALL_SQLITE (open (db_path, &ctx->db));
+  CALL_SQLITE (busy_handler (ctx->db, dfym_busy_handler, ctx));
+  /* Durable across power losses only up to the last checkpoint, which is
+     enough for tags and saves a sync on every commit */
+  dfym_exec (ctx, "PRAGMA journal_mode = WAL");
+  dfym_exec (ctx, "PRAGMA synchronous = NORMAL");
+  CALL_SQLITE (create_function (ctx->db, "dfym_path", 2, SQLITE_UTF8, ctx,
+                                dfym_path_function, NULL, NULL));
+  CALL_SQLITE (create_function (ctx->db, "dfym_random", 0, SQLITE_UTF8, ctx,
+                                dfym_random_function, NULL, NULL));
+  dfym_migrate (ctx);
+  /* Only effective outside of a transaction, and must be set on every connection */
+  dfym_exec (ctx, "PRAGMA foreign_keys = ON");
+  /* The context stays failed, for dfym_errmsg */
+  if (ctx->failed && !sqlite3_get_autocommit (ctx->db))
+    sqlite3_exec (ctx->db, "ROLLBACK", NULL, NULL, NULL);
+
+  return ctx;
+}
+
+/** Refresh the planner statistics if the queries run made it worth it.
+ *
+ * Done when closing the database, and to be called every few hours on
+ * connections kept open for long.
+ * \param ctx The dfym context.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_optimize (dfym_ctx_t *ctx)
+{
+  dfym_exec (ctx, "PRAGMA optimize");
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Finalize the cached statements, close the database and free the context.
+ *
+ * \param ctx The dfym context.
+ */
+void dfym_close_database (dfym_ctx_t *ctx)
+{
+  if (!ctx)
+    return;
+  if (!ctx->failed)
+    {
+      dfym_trace (ctx, 0, NULL, NULL);
+      dfym_optimize (ctx);
+    }
+  for (int i = 0; i < STMT_COUNT; i++)
+    sqlite3_finalize (ctx->statements[i]);
+  sqlite3_close (ctx->db);
+  g_hash_table_destroy (ctx->dir_ids);
+  g_hash_table_destroy (ctx->dir_paths);
+  if (ctx->tags)
+    dfym_trie_free (ctx->tags);
+  if (ctx->rand)
+    g_rand_free (ctx->rand);
+  g_string_free (ctx->scratch, TRUE);
+  g_array_free (ctx->migrated, TRUE);
+  g_free (ctx->errmsg);
+  g_free (ctx);
+}
+
+/** Tell what failed when a function returned DFYM_DATABASE_ERROR, or why
+ * the database couldn't be opened.
+ * \param ctx The dfym context.
+ * \return The message, valid until the next call, or NULL if the last call
+ * didn't fail.
+ */
+char const *dfym_errmsg (dfym_ctx_t *ctx)
+{
+  return ctx->errmsg;
+}
+
+/** Print the migrations applied to the schema when the database was opened.
+ *
+ * Every migration is a result with the "version" of the schema it led to,
+ * the description of the "migration" and the "time_us" it took.
+ * \param ctx The dfym context.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_migrations (dfym_ctx_t *ctx)
+{
+  for (guint k = 0; k < ctx->migrated->len; k++)
+    {
+      dfym_migrated_t *migrated = &g_array_index (ctx->migrated, dfym_migrated_t, k);
+      dfym_result_number (ctx, "version", migrated->version);
+      dfym_result_text (ctx, "migration", migrations[migrated->version - 1].description, -1);
+      dfym_result_number (ctx, "time_us", migrated->time_us);
+      dfym_result_end (ctx);
+    }
+  return DFYM_OK;
+}
+
+/** Set the function receiving the results of the context.
+ *
+ * Every function printing results hands them to the handler one at a time,
+ * as a set of named fields, while it runs. Without a handler, results are
+ * dropped.
+ * \param ctx The dfym context.
+ * \param handler The handler, or NULL.
+ * \param data Data passed to the handler along with every result.
+ */
+void dfym_set_result_handler (dfym_ctx_t *ctx,
+                              dfym_result_handler_t handler,
+                              void *data)
+{
+  ctx->handler = handler;
+  ctx->handler_data = data;
+}
+
+/** Hand a result to the handler of the context.
+ *
+ * For the parts of the library that build their results themselves, like
+ * \ref dfym_watch.
+ * \param ctx The dfym context.
+ * \param fields The fields of the result.
+ * \param n_fields Number of fields.
+ */
+void dfym_result (dfym_ctx_t *ctx, dfym_field_t const *fields, unsigned int n_fields)
+{
+  if (ctx->handler)
+    ctx->handler (fields, n_fields, ctx->handler_data);
+}
+
+/** Record that a call to the system failed, for \ref dfym_errmsg.
+ *
+ * \param ctx The dfym context.
+ * \param call The call that failed.
+ * \param errnum The errno it set.
+ * \return DFYM_SYSTEM_ERROR.
+ */
+int dfym_system_error (dfym_ctx_t *ctx, char const *const call, int errnum)
+{
+  g_free (ctx->errmsg);
+  ctx->errmsg = g_strdup_printf ("%s failed: %s", call, g_strerror (errnum));
+  return DFYM_SYSTEM_ERROR;
+}
+
+/** Set how long a writer waits for another one to release the database.
+ *
+ * Once the time is spent, the pending statement fails with SQLITE_BUSY.
+ * \param ctx The dfym context.
+ * \param milliseconds Time to wait, 0 to fail right away.
+ */
+void dfym_set_busy_timeout (dfym_ctx_t *ctx,
+                            unsigned int milliseconds)
+{
+  ctx->busy_timeout = milliseconds;
+}
+
+/** Seed the random number generator used for random results.
+ *
+ * The same seed, on the same database, gives the same results in the same
+ * order, which makes random searches reproducible.
+ * \param ctx The dfym context.
+ * \param seed The seed, or a negative number to seed from the system's
+ * entropy source again.
+ */
+void dfym_set_seed (dfym_ctx_t *ctx,
+                    sqlite3_int64 seed)
+{
+  if (ctx->rand)
+    g_rand_free (ctx->rand);
+  ctx->rand = seed < 0 ? NULL : g_rand_new_with_seed ((guint32)seed);
+}
+
+/** Drop the cached state of a connection if other connections changed the
+ * database since the last call.
+ *
+ * Meant for long-lived connections, before running every command: the node
+ * map could otherwise keep directories renamed or deleted by another process.
+ * \param ctx The dfym context.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_refresh_caches (dfym_ctx_t *ctx)
+{
+  sqlite3_stmt *stmt = NULL;
+  int version;
+
+  CALL_SQLITE (prepare_v2 (ctx->db, "PRAGMA data_version", -1, &stmt, NULL));
+  CALL_SQLITE_EXPECT (step (stmt), ROW);
+  version = sqlite3_column_int (stmt, 0);
+  CALL_SQLITE (finalize (stmt));
+  if (version != ctx->data_version)
+    dfym_dir_cache_flush (ctx);
+  ctx->data_version = version;
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Get the statement cache counters of a connection.
+ *
+ * Every call to a database function looks up its statements in the cache: a
+ * hit reuses an already prepared statement, a miss prepares it.
+ * \param ctx The dfym context.
+ * \param hits Where to store the number of cache hits (can be NULL).
+ * \param misses Where to store the number of cache misses (can be NULL).
+ */
+void dfym_statement_cache_stats (dfym_ctx_t *ctx,
+                                 unsigned long int *hits,
+                                 unsigned long int *misses)
+{
+  if (hits)
+    *hits = ctx->hits;
+  if (misses)
+    *misses = ctx->misses;
+}
+
+static void trace_stats_free (gpointer data)
+{
+  trace_stats_t *stats = data;
+
+  g_free (stats->sql);
+  g_free (stats);
+}
+
+/**
+ * Get the statistics of a statement, keyed by its SQL text, as the same text
+ * may be prepared more than once.
+ */
+static trace_stats_t *trace_stats (dfym_ctx_t *ctx, sqlite3_stmt *stmt)
+{
+  trace_stats_t *stats = g_hash_table_lookup (ctx->trace_statements, stmt);
+  char const *sql = sqlite3_sql (stmt);
+
+  /* Statements run by SQLite itself, such as to open blobs, have no text */
+  if (!sql)
+    sql = "(internal)";
+  /* A finalized statement's handle may be reused for another one */
+  if (stats && !strcmp (stats->sql, sql))
+    return stats;
+  if (!(stats = g_hash_table_lookup (ctx->trace_sql, sql)))
+    {
+      stats = g_new0 (trace_stats_t, 1);
+      stats->sql = g_strdup (sql);
+      g_hash_table_insert (ctx->trace_sql, stats->sql, stats);
+    }
+  g_hash_table_insert (ctx->trace_statements, stmt, stats);
+  return stats;
+}
+
+/**
+ * Trace callback: count the rows of every statement, and account for each
+ * run once it is over.
+ */
+static int dfym_trace_callback (unsigned int type, void *data, void *p, void *x)
+{
+  dfym_ctx_t *ctx = data;
+  sqlite3_stmt *stmt = p;
+  trace_stats_t *stats = trace_stats (ctx, stmt);
+
+  if (type == SQLITE_TRACE_ROW)
+    {
+      stats->run_rows++;
+      return 0;
+    }
+  stats->runs++;
+  stats->ns += *(sqlite3_int64 *)x;
+  stats->rows += stats->run_rows;
+  stats->fullscan_steps += sqlite3_stmt_status (stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+  stats->sorts += sqlite3_stmt_status (stmt, SQLITE_STMTSTATUS_SORT, 1);
+  if ((ctx->trace & TRACE_STATEMENTS) && ctx->trace_handler)
+    {
+      char *sql = sqlite3_expanded_sql (stmt);
+      ctx->trace_handler (sql ? sql : stats->sql, *(sqlite3_int64 *)x, stats->run_rows,
+                          ctx->trace_data);
+      sqlite3_free (sql);
+    }
+  stats->run_rows = 0;
+  return 0;
+}
+
+/** Start or stop tracing the statements run on a connection.
+ *
+ * Tracing is done at runtime, through the profiling hooks of SQLite. With
+ * TRACE_STATEMENTS, every statement run is handed to the handler with its
+ * SQL text, the time it took and the rows it returned. With TRACE_STATS,
+ * statistics are gathered for \ref dfym_trace_report. Tracing slows every
+ * statement down a little, so it is meant to be turned on for one command.
+ *
+ * \param ctx The dfym context.
+ * \param flags An OR'ed set of flags from \ref trace_flag_t, 0 to stop.
+ * \param handler Receiver of the statements of TRACE_STATEMENTS (can be NULL).
+ * \param data Data passed to the handler.
+ */
+void dfym_trace (dfym_ctx_t *ctx,
+                 unsigned int flags,
+                 dfym_trace_handler_t handler,
+                 void *data)
+{
+  int current, highwater;
+
+  if (ctx->trace_sql)
+    {
+      g_hash_table_destroy (ctx->trace_statements);
+      g_hash_table_destroy (ctx->trace_sql);
+      ctx->trace_statements = ctx->trace_sql = NULL;
+    }
+  ctx->trace = flags;
+  ctx->trace_handler = handler;
+  ctx->trace_data = data;
+  if (!flags)
+    {
+      sqlite3_trace_v2 (ctx->db, 0, NULL, NULL);
+      return;
+    }
+  ctx->trace_sql = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, trace_stats_free);
+  ctx->trace_statements = g_hash_table_new (g_direct_hash, g_direct_equal);
+  ctx->trace_start = g_get_monotonic_time ();
+  ctx->trace_hits = ctx->hits;
+  ctx->trace_misses = ctx->misses;
+  ctx->trace_stats = ctx->fs_stats;
+  ctx->trace_readdirs = ctx->fs_readdirs;
+  /* Counters of the page cache are reset, the report reads them */
+  sqlite3_db_status (ctx->db, SQLITE_DBSTATUS_CACHE_HIT, &current, &highwater, 1);
+  sqlite3_db_status (ctx->db, SQLITE_DBSTATUS_CACHE_MISS, &current, &highwater, 1);
+  for (int k = 0; k < STMT_COUNT; k++)
+    if (ctx->statements[k])
+      {
+        sqlite3_stmt_status (ctx->statements[k], SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+        sqlite3_stmt_status (ctx->statements[k], SQLITE_STMTSTATUS_SORT, 1);
+      }
+  sqlite3_trace_v2 (ctx->db, SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW, dfym_trace_callback, ctx);
+}
+
+static int compare_trace_stats (gconstpointer a, gconstpointer b)
+{
+  trace_stats_t const *x = *(trace_stats_t *const *)a, *y = *(trace_stats_t *const *)b;
+
+  return x->ns < y->ns ? 1 : x->ns > y->ns ? -1 : 0;
+}
+
+/** Get the statistics gathered since tracing started.
+ *
+ * The report holds the time since tracing started, the hits and misses of
+ * the page cache and of the statement cache, the files stat'ed and directory
+ * entries read, and the runs, time, rows, full scan steps and sorts of every
+ * statement, slowest first. Statements run by other statements, such as the
+ * ones behind dfym_path(), are accounted for on their own.
+ *
+ * \param ctx The dfym context, traced with TRACE_STATS.
+ * \return The report, to free with \ref dfym_trace_report_free, or NULL if
+ * the context isn't traced.
+ */
+dfym_trace_report_t *dfym_trace_report (dfym_ctx_t *ctx)
+{
+  dfym_trace_report_t *report;
+  GPtrArray *statements;
+  GHashTableIter iter;
+  gpointer value;
+  int highwater;
+
+  if (!ctx->trace_sql)
+    return NULL;
+  statements = g_ptr_array_new ();
+  g_hash_table_iter_init (&iter, ctx->trace_sql);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    g_ptr_array_add (statements, value);
+  g_ptr_array_sort (statements, compare_trace_stats);
+
+  report = g_new0 (dfym_trace_report_t, 1);
+  report->time_us = g_get_monotonic_time () - ctx->trace_start;
+  sqlite3_db_status (ctx->db, SQLITE_DBSTATUS_CACHE_HIT, &report->page_hits, &highwater, 0);
+  sqlite3_db_status (ctx->db, SQLITE_DBSTATUS_CACHE_MISS, &report->page_misses, &highwater, 0);
+  report->statement_hits = ctx->hits - ctx->trace_hits;
+  report->statement_misses = ctx->misses - ctx->trace_misses;
+  report->fs_stats = ctx->fs_stats - ctx->trace_stats;
+  report->fs_readdirs = ctx->fs_readdirs - ctx->trace_readdirs;
+  report->n_statements = statements->len;
+  report->statements = g_new (dfym_trace_statement_t, statements->len);
+  for (guint k = 0; k < statements->len; k++)
+    {
+      trace_stats_t *stats = g_ptr_array_index (statements, k);
+      dfym_trace_statement_t *statement = &report->statements[k];
+      statement->sql = g_strdup (stats->sql);
+      statement->runs = stats->runs;
+      statement->ns = stats->ns;
+      statement->rows = stats->rows;
+      statement->fullscan_steps = stats->fullscan_steps;
+      statement->sorts = stats->sorts;
+    }
+  g_ptr_array_free (statements, TRUE);
+  return report;
+}
+
+/** Free a report of \ref dfym_trace_report.
+ *
+ * \param report The report.
+ */
+void dfym_trace_report_free (dfym_trace_report_t *report)
+{
+  if (!report)
+    return;
+  for (unsigned int k = 0; k < report->n_statements; k++)
+    g_free ((char *)report->statements[k].sql);
+  g_free (report->statements);
+  g_free (report);
+}
+
+/** Add a tag to a file.
+ * This will add the file to the database if it didn't exist.
+ *
+ * \param ctx The dfym context.
+ * \param tag The name of the tag.
+ * \param file The full (normalized) path to the file to tag.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_add_tag (dfym_ctx_t *ctx,
+                  char const *const tag,
+                  char const *const file)
+{
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_int64 tag_id = 0, file_id = 0;
+  int started;
+
+  /* The tag and the directory nodes inserted go away with a failed tagging */
+  started = dfym_begin (ctx);
+
+  /* Insert tag and file if they don't exist */
+  tag_id = dfym_upsert_tag (ctx, tag);
+  file_id = dfym_file_id (ctx, file, 1);
+
+  /* Only missing if a statement failed, which rolls everything back */
+  if (!tag_id || !file_id)
+    return dfym_return (ctx, DFYM_DATABASE_ERROR);
+
+  /* Insert tagging relation if doesn't exist */
+  stmt = dfym_statement (ctx, STMT_TAGGING_INSERT);
+  CALL_SQLITE (bind_int64 (stmt, 1, tag_id));
+  CALL_SQLITE (bind_int64 (stmt, 2, file_id));
+  CALL_SQLITE_EXPECT (step (stmt), DONE);
+  dfym_commit (ctx, started);
+
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Milliseconds a bulk tagging session writes before letting other writers in */
+#define BULK_HOLD 2000
+/** Milliseconds it then waits, longer than the longest step of \ref dfym_busy_handler */
+#define BULK_YIELD 150
+
+/** State of a bulk tagging session */
+struct dfym_bulk
+{
+  dfym_ctx_t *ctx;              /**< The dfym context */
+  GHashTable *tag_ids;          /**< Tag name -> id of the tags seen so far */
+  GHashTable *file_ids;         /**< File path -> id of the files seen so far */
+  unsigned long int batch_size; /**< Taggings per transaction */
+  unsigned long int pending;    /**< Taggings in the open transaction */
+  unsigned long int count;      /**< Taggings done in the session */
+  gint64 held_since;            /**< When it last let other writers in */
+};
+
+/**
+ * Resolve the id of a tag or file in a bulk session, inserting it if needed.
+ */
+static sqlite3_int64 dfym_bulk_id (dfym_bulk_t *bulk,
+                                   GHashTable *ids,
+                                   char const *const name)
+{
+  sqlite3_int64 *id = g_hash_table_lookup (ids, name);
+
+  if (!id)
+    {
+      id = g_new (sqlite3_int64, 1);
+      *id = ids == bulk->tag_ids
+        ? dfym_upsert_tag (bulk->ctx, name)
+        : dfym_file_id (bulk->ctx, name, 1);
+      g_hash_table_insert (ids, g_strdup (name), id);
+    }
+  return *id;
+}
+
+/** Start a bulk tagging session.
+ *
+ * Taggings added to the session are grouped in transactions of the given
+ * size, instead of committing (and syncing) each one of them. Tag and file
+ * ids are remembered in memory, so every tag is looked up only once. A long
+ * session pauses between transactions every couple of seconds, so that other
+ * writers don't wait for it to end.
+ *
+ * \param ctx The dfym context.
+ * \param batch_size Number of taggings per transaction (0 for the default).
+ * \return The session, to be ended with \ref dfym_bulk_tag_end.
+ */
+dfym_bulk_t *dfym_bulk_tag_begin (dfym_ctx_t *ctx,
+                                  unsigned long int batch_size)
+{
+  dfym_bulk_t *bulk = g_new0 (dfym_bulk_t, 1);
+
+  bulk->ctx = ctx;
+  bulk->tag_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  bulk->file_ids = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  bulk->batch_size = batch_size ? batch_size : DFYM_BULK_BATCH_SIZE;
+  bulk->held_since = g_get_monotonic_time ();
+  return bulk;
+}
+
+/** Add a tag to a file within a bulk tagging session.
+ * Same semantics as \ref dfym_add_tag.
+ *
+ * \param bulk The bulk tagging session.
+ * \param tag The name of the tag.
+ * \param file The full (normalized) path to the file to tag.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_bulk_tag_add (dfym_bulk_t *bulk,
+                       char const *const tag,
+                       char const *const file)
+{
+  dfym_ctx_t *ctx = bulk->ctx;
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_int64 tag_id = 0, file_id = 0;
+
+  int status = DFYM_OK;
+
+  if (!bulk->pending)
+    dfym_exec (ctx, "BEGIN IMMEDIATE");
+
+  tag_id = dfym_bulk_id (bulk, bulk->tag_ids, tag);
+  file_id = dfym_bulk_id (bulk, bulk->file_ids, file);
+  if (tag_id && file_id)
+    {
+      stmt = dfym_statement (ctx, STMT_TAGGING_INSERT);
+      CALL_SQLITE (bind_int64 (stmt, 1, tag_id));
+      CALL_SQLITE (bind_int64 (stmt, 2, file_id));
+      CALL_SQLITE_EXPECT (step (stmt), DONE);
+      bulk->count++;
+      if (++bulk->pending == bulk->batch_size)
+        {
+          dfym_exec (ctx, "COMMIT");
+          bulk->pending = 0;
+          /* The next batch would start before any waiting writer retries */
+          if (g_get_monotonic_time () - bulk->held_since >= BULK_HOLD * 1000)
+            {
+              g_usleep (BULK_YIELD * 1000);
+              bulk->held_since = g_get_monotonic_time ();
+            }
+        }
+    }
+  else
+    status = DFYM_DATABASE_ERROR;
+
+  if ((status = dfym_return (ctx, status)) == DFYM_DATABASE_ERROR)
+    {
+      /* The open transaction was rolled back, with the ids it inserted */
+      bulk->count -= bulk->pending;
+      bulk->pending = 0;
+      g_hash_table_remove_all (bulk->tag_ids);
+      g_hash_table_remove_all (bulk->file_ids);
+    }
+  return status;
+}
+
+/** Commit the pending taggings and end a bulk tagging session.
+ *
+ * \param bulk The bulk tagging session, freed by this call.
+ * \param count Where to store the number of taggings done (can be NULL).
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_bulk_tag_end (dfym_bulk_t *bulk,
+                       unsigned long int *count)
+{
+  dfym_ctx_t *ctx = bulk->ctx;
+  int status;
+
+  if (bulk->pending)
+    dfym_exec (ctx, "COMMIT");
+  if ((status = dfym_return (ctx, DFYM_OK)) == DFYM_DATABASE_ERROR)
+    bulk->count -= bulk->pending;
+  if (count)
+    *count = bulk->count;
+  g_hash_table_destroy (bulk->tag_ids);
+  g_hash_table_destroy (bulk->file_ids);
+  g_free (bulk);
+  return status;
+}
+
+/** Remove a tag from a file.
+ * This will remove the file if it is left without any tag.
+ *
+ * \param ctx The dfym context.
+ * \param tag The name of the tag.
+ * \param file The full (normalized) path to a file to tag.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_untag (dfym_ctx_t *ctx,
+                char const *const tag,
+                char const *const file)
+{
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_int64 file_id;
+
+  /* Check wether the file exists in the database */
+  if (!(file_id = dfym_file_id (ctx, file, 0)))
+    return dfym_return (ctx, DFYM_NOT_EXISTS);
+
+  stmt = dfym_statement (ctx, STMT_UNTAG);
+  CALL_SQLITE (bind_int64 (stmt, 1, file_id));
+  CALL_SQLITE (bind_text (stmt, 2, tag, strlen (tag), 0));
+  CALL_SQLITE_EXPECT (step (stmt), DONE);
+
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Print all tags associated to this file.
+ * \param ctx The dfym context.
+ * \param file The full (normalized) path to a file to tag.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_show_file_tags (dfym_ctx_t *ctx,
+                         char const *const file)
+{
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_int64 file_id;
+  int step;
+
+  if (!(file_id = dfym_file_id (ctx, file, 0)))
+    return dfym_return (ctx, DFYM_NOT_EXISTS);
+
+  stmt = dfym_statement (ctx, STMT_FILE_TAGS);
+  CALL_SQLITE (bind_int64 (stmt, 1, file_id));
+  while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      dfym_result_text (ctx, "tag", (char const *)sqlite3_column_text (stmt, 0),
+                         sqlite3_column_bytes (stmt, 0));
+      dfym_result_end (ctx);
+    }
+  dfym_check_done (ctx, step);
+
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Print all tags in the database.
+ * \param ctx The dfym context.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_all_tags (dfym_ctx_t *ctx)
+{
+  sqlite3_stmt *stmt = dfym_statement (ctx, STMT_ALL_TAGS);
+  int step;
+
+  while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      dfym_result_text (ctx, "tag", (char const *)sqlite3_column_text (stmt, 0),
+                         sqlite3_column_bytes (stmt, 0));
+      dfym_result_end (ctx);
+    }
+  dfym_check_done (ctx, step);
+
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Print the tags starting with a prefix, in order.
+ *
+ * The names are read from a range of the index of tags, so the other tags are
+ * never looked at.
+ * \param ctx The dfym context.
+ * \param prefix The start of the names.
+ * \param number_results Maximum number of tags to print, 0 for all.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_tags_with_prefix (dfym_ctx_t *ctx,
+                           char const *const prefix,
+                           unsigned long int number_results)
+{
+  sqlite3_stmt *stmt = dfym_statement (ctx, STMT_TAGS_PREFIX);
+  size_t length = strlen (prefix);
+  char *bound = g_strndup (prefix, length);
+  int step;
+
+  /* The first name past the prefix: its last byte that can grow, grown */
+  while (length && (guint8)bound[length-1] == 0xff)
+    bound[--length] = '\0';
+  if (length)
+    bound[length-1]++;
+
+  CALL_SQLITE (bind_text (stmt, 1, prefix, -1, SQLITE_STATIC));
+  if (length)
+    {
+      CALL_SQLITE (bind_text (stmt, 2, bound, length, SQLITE_STATIC));
+    }
+  else
+    {
+      CALL_SQLITE (bind_zeroblob (stmt, 2, 0));
+    }
+  CALL_SQLITE (bind_int64 (stmt, 3, number_results ? (sqlite3_int64)number_results : -1));
+  while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      dfym_result_text (ctx, "tag", (char const *)sqlite3_column_text (stmt, 0),
+                         sqlite3_column_bytes (stmt, 0));
+      dfym_result_end (ctx);
+    }
+  dfym_check_done (ctx, step);
+  sqlite3_reset (stmt);
+  g_free (bound);
+
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Print the tags along with the number of files tagged with them, the most
+ * used first.
+ *
+ * The numbers are kept up to date as files are tagged and untagged, so they
+ * are read rather than counted.
+ * \param ctx The dfym context.
+ * \param number_results Maximum number of tags to print, 0 for all.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_tag_counts (dfym_ctx_t *ctx,
+                     unsigned long int number_results)
+{
+  sqlite3_stmt *stmt = dfym_statement (ctx, STMT_TAG_COUNTS);
+  int step;
+
+  CALL_SQLITE (bind_int64 (stmt, 1, number_results ? (sqlite3_int64)number_results : -1));
+  while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      dfym_result_text (ctx, "tag", (char const *)sqlite3_column_text (stmt, 0),
+                         sqlite3_column_bytes (stmt, 0));
+      dfym_result_number (ctx, "files", sqlite3_column_int64 (stmt, 1));
+      dfym_result_end (ctx);
+    }
+  dfym_check_done (ctx, step);
+  sqlite3_reset (stmt);
+
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Print the tags no file is tagged with anymore, in order.
+ * \param ctx The dfym context.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_empty_tags (dfym_ctx_t *ctx)
+{
+  sqlite3_stmt *stmt = dfym_statement (ctx, STMT_EMPTY_TAGS);
+  int step;
+
+  while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      dfym_result_text (ctx, "tag", (char const *)sqlite3_column_text (stmt, 0),
+                         sqlite3_column_bytes (stmt, 0));
+      dfym_result_end (ctx);
+    }
+  dfym_check_done (ctx, step);
+  sqlite3_reset (stmt);
+
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Print a summary of the database: the number of tags, of tags without
+ * files, of taggings, of tagged files, of tagged directories and of
+ * directory nodes, each on its own line after its name.
+ * \param ctx The dfym context.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_summary (dfym_ctx_t *ctx)
+{
+  static char const *const names[] =
+    { "tags", "empty tags", "taggings", "files", "directories", "directory nodes" };
+  sqlite3_stmt *stmt = dfym_statement (ctx, STMT_SUMMARY);
+
+  if (!dfym_step_row (ctx, stmt))
+    {
+      /* The counts always make a row */
+      dfym_fail (ctx, "step", SQLITE_DONE);
+      sqlite3_reset (stmt);
+      return dfym_return (ctx, DFYM_DATABASE_ERROR);
+    }
+  for (int k = 0; k < G_N_ELEMENTS (names); k++)
+    {
+      dfym_result_text (ctx, "name", names[k], -1);
+      dfym_result_number (ctx, "count", sqlite3_column_int64 (stmt, k));
+      dfym_result_end (ctx);
+    }
+  sqlite3_reset (stmt);
+
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Check the number of files of each tag against the taggings, and set it
+ * right where it drifted, along with the numbering of its taggings. Each tag
+ * fixed is printed with the number that was stored and the actual one.
+ *
+ * Counts only drift if the database is changed by something else than dfym,
+ * which doesn't know about them.
+ * \param ctx The dfym context.
+ * \param fixed Where to store the number of tags fixed, or NULL.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_check_tag_stats (dfym_ctx_t *ctx,
+                          unsigned long int *fixed)
+{
+  sqlite3_stmt *stmt;
+  GArray *drifted = g_array_new (FALSE, FALSE, sizeof (sqlite3_int64));
+  int started = dfym_begin (ctx);
+  int step;
+
+  /* Fixed once the scan is over, as the rows would change under it */
+  stmt = dfym_statement (ctx, STMT_TAG_STATS_DRIFTED);
+  while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      sqlite3_int64 row[2] = { sqlite3_column_int64 (stmt, 0), sqlite3_column_int64 (stmt, 3) };
+
+      dfym_result_text (ctx, "tag", (char const *)sqlite3_column_text (stmt, 1),
+                         sqlite3_column_bytes (stmt, 1));
+      if (sqlite3_column_type (stmt, 2) == SQLITE_NULL)
+        dfym_result_text (ctx, "stored", "none", -1);
+      else
+        dfym_result_number (ctx, "stored", sqlite3_column_int64 (stmt, 2));
+      dfym_result_number (ctx, "actual", row[1]);
+      dfym_result_end (ctx);
+      g_array_append_vals (drifted, row, 2);
+    }
+  dfym_check_done (ctx, step);
+  sqlite3_reset (stmt);
+
+  for (guint k = 0; k < drifted->len; k += 2)
+    {
+      stmt = dfym_statement (ctx, STMT_TAG_STATS_SET);
+      CALL_SQLITE (bind_int64 (stmt, 1, g_array_index (drifted, sqlite3_int64, k)));
+      CALL_SQLITE (bind_int64 (stmt, 2, g_array_index (drifted, sqlite3_int64, k + 1)));
+      CALL_SQLITE_EXPECT (step (stmt), DONE);
+      stmt = dfym_statement (ctx, STMT_TAG_RENUMBER);
+      CALL_SQLITE (bind_int64 (stmt, 1, g_array_index (drifted, sqlite3_int64, k)));
+      CALL_SQLITE_EXPECT (step (stmt), DONE);
+    }
+  stmt = dfym_statement (ctx, STMT_TAG_STATS_ORPHANS);
+  CALL_SQLITE_EXPECT (step (stmt), DONE);
+  dfym_commit (ctx, started);
+
+  if (fixed)
+    *fixed = drifted->len / 2;
+  g_array_free (drifted, TRUE);
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/**
+ * Get the trie of the tag names, loading it again if the tags may have
+ * changed: the connection made changes, or another one did.
+ */
+static dfym_trie_t *dfym_tag_trie (dfym_ctx_t *ctx)
+{
+  sqlite3_stmt *stmt = dfym_statement (ctx, STMT_DATA_VERSION);
+  int version, step, changes = sqlite3_total_changes (ctx->db);
+  GPtrArray *names;
+
+  CALL_SQLITE_EXPECT (step (stmt), ROW);
+  version = sqlite3_column_int (stmt, 0);
+  sqlite3_reset (stmt);
+  if (ctx->tags && ctx->tags_version == version && ctx->tags_changes == changes)
+    return ctx->tags;
+
+  names = g_ptr_array_new_with_free_func (g_free);
+
+  /* Every name, in the order of the index */
+  stmt = dfym_statement (ctx, STMT_TAGS_PREFIX);
+  CALL_SQLITE (bind_text (stmt, 1, "", -1, SQLITE_STATIC));
+  CALL_SQLITE (bind_zeroblob (stmt, 2, 0));
+  CALL_SQLITE (bind_int64 (stmt, 3, -1));
+  while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
+    g_ptr_array_add (names, g_strdup ((char const *)sqlite3_column_text (stmt, 0)));
+  dfym_check_done (ctx, step);
+  sqlite3_reset (stmt);
+
+  if (ctx->tags)
+    dfym_trie_free (ctx->tags);
+  ctx->tags = dfym_trie_new ((char **)names->pdata, names->len);
+  ctx->tags_version = version;
+  ctx->tags_changes = changes;
+  g_ptr_array_free (names, TRUE);
+  return ctx->tags;
+}
+
+/** Print the tags starting like a query, allowing for typos.
+ *
+ * A tag matches if it starts with at most max_distance edits of the query,
+ * see \ref dfym_trie_fuzzy. Names are looked up in a trie, kept along with
+ * the connection until the tags change, so that repeated lookups from a
+ * long-lived connection don't read the tags again.
+ * \param ctx The dfym context.
+ * \param query The start of the names, maybe mistyped.
+ * \param max_distance Most edits allowed, or -1 to choose from the length
+ * of the query: none up to 2 bytes, 1 up to 5 bytes, 2 beyond.
+ * \param number_results Maximum number of tags to print, 0 for all.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_tags_fuzzy (dfym_ctx_t *ctx,
+                     char const *const query,
+                     int max_distance,
+                     unsigned long int number_results)
+{
+  size_t length = strlen (query);
+  GArray *matches;
+
+  if (max_distance < 0)
+    max_distance = length <= 2 ? 0 : length <= 5 ? 1 : 2;
+  matches = dfym_trie_fuzzy (dfym_tag_trie (ctx), query, max_distance);
+  for (guint k = 0; k < matches->len; k++)
+    {
+      dfym_trie_match_t *match = &g_array_index (matches, dfym_trie_match_t, k);
+      if (!number_results || k < number_results)
+        {
+          dfym_result_text (ctx, "tag", match->name, -1);
+          dfym_result_end (ctx);
+        }
+      g_free (match->name);
+    }
+  g_array_free (matches, TRUE);
+
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/**
+ * Order the paths of a GPtrArray.
+ */
+static int compare_paths (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(char *const *)a, *(char *const *)b);
+}
+
+/** Get the directories directly holding tagged files.
+ *
+ * \param ctx The dfym context.
+ * \return The sorted paths of the directories, as a NULL-terminated vector to
+ * free with g_strfreev, or NULL on error. The root directory is "/".
+ */
+char **dfym_tagged_dirs (dfym_ctx_t *ctx)
+{
+  sqlite3_stmt *stmt = dfym_statement (ctx, STMT_TAGGED_DIRS);
+  GPtrArray *dirs = g_ptr_array_new ();
+  char const *path;
+  int step;
+
+  while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
+    if ((path = dfym_dir_path (ctx, sqlite3_column_int64 (stmt, 0))))
+      g_ptr_array_add (dirs, g_strdup (*path ? path : G_DIR_SEPARATOR_S));
+  dfym_check_done (ctx, step);
+  sqlite3_reset (stmt);
+  g_ptr_array_sort (dirs, compare_paths);
+  g_ptr_array_add (dirs, NULL);
+  if (dfym_return (ctx, DFYM_OK) != DFYM_OK)
+    {
+      g_strfreev ((char **)g_ptr_array_free (dirs, FALSE));
+      return NULL;
+    }
+  return (char **)g_ptr_array_free (dirs, FALSE);
+}
+
+/** Start a batch of changes, committed at once by \ref dfym_batch_end.
+ *
+ * Every change made in between goes to the same transaction, instead of one
+ * transaction per change.
+ * \param ctx The dfym context.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_batch_begin (dfym_ctx_t *ctx)
+{
+  dfym_exec (ctx, "BEGIN IMMEDIATE");
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Commit a batch of changes started by \ref dfym_batch_begin.
+ *
+ * A change of the batch that failed rolled back the whole batch, which is
+ * then over already.
+ * \param ctx The dfym context.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_batch_end (dfym_ctx_t *ctx)
+{
+  if (!sqlite3_get_autocommit (ctx->db))
+    dfym_exec (ctx, "COMMIT");
+  /* Directories may have moved within the batch */
+  dfym_dir_cache_flush (ctx);
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Print all files in the database.
+ *
+ * \param ctx The dfym context.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_all_files (dfym_ctx_t *ctx)
+{
+  sqlite3_stmt *stmt = dfym_statement (ctx, STMT_ALL_FILES);
+  int step;
+
+  while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      dfym_result_text (ctx, "path", (char const *)sqlite3_column_text (stmt, 0),
+                         sqlite3_column_bytes (stmt, 0));
+      dfym_result_end (ctx);
+    }
+  dfym_check_done (ctx, step);
+
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/**
+ * Print a page of the paths returned by a paging statement, with the id of
+ * their file as second column, in id order. The statement takes the size of
+ * the page as ?2, which is bound here. One row more than the page is read,
+ * to know whether another page follows. Paths are handed to the result
+ * handler straight from the row, without copies.
+ */
+static void dfym_page_run (dfym_ctx_t *ctx,
+                           sqlite3_stmt *stmt,
+                           unsigned long int page_size,
+                           sqlite3_int64 *next)
+{
+  unsigned long int printed = 0;
+  sqlite3_int64 last = 0;
+  int step;
+
+  *next = 0;
+  CALL_SQLITE (bind_int64 (stmt, 2, page_size ? (sqlite3_int64)page_size + 1 : -1));
+  while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      if (page_size && printed == page_size)
+        {
+          *next = last;
+          step = SQLITE_DONE;
+          break;
+        }
+      dfym_result_text (ctx, "path", (char const *)sqlite3_column_text (stmt, 0),
+                        sqlite3_column_bytes (stmt, 0));
+      dfym_result_end (ctx);
+      last = sqlite3_column_int64 (stmt, 1);
+      printed++;
+    }
+  dfym_check_done (ctx, step);
+  sqlite3_reset (stmt);
+}
+
+/** Print a page of all files in the database, in the order of their ids.
+ *
+ * Pages are found by their keys, the ids, not by counting rows: every page
+ * costs the same, however deep it is. Files tagged or deleted meanwhile
+ * don't shift the pages that follow.
+ *
+ * \param ctx The dfym context.
+ * \param after The cursor of the page: 0 for the first one, or the cursor
+ * returned with the previous one.
+ * \param page_size Maximum number of files to print, 0 for all the files left.
+ * \param next Where to store the cursor of the next page, 0 if this one is
+ * the last.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_all_files_page (dfym_ctx_t *ctx,
+                         sqlite3_int64 after,
+                         unsigned long int page_size,
+                         sqlite3_int64 *next)
+{
+  sqlite3_stmt *stmt = dfym_statement (ctx, STMT_ALL_FILES_PAGE);
+
+  CALL_SQLITE (bind_int64 (stmt, 1, after));
+  dfym_page_run (ctx, stmt, page_size, next);
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/**
+ * Tell whether an entry of the given type passes the -f/-d filters.
+ */
+static int type_wanted (char type, unsigned char options)
+{
+  return ! (options & (OPT_FILES | OPT_DIRECTORIES))
+         || ((options & OPT_FILES) && type == 'f')
+         || ((options & OPT_DIRECTORIES) && type == 'd');
+}
+
+/** Search results checked at a time against the filesystem, for OPT_VERIFY */
+#define VERIFY_BATCH 256
+
+/** Search results waiting to be checked against the filesystem */
+typedef struct
+{
+  dfym_probe_t *probe;          /**< The probe stat'ing the results */
+  dfym_probe_entry_t entries[VERIFY_BATCH]; /**< The results, owning their paths */
+  sqlite3_int64 ids[VERIFY_BATCH];          /**< Ids of the files of the results */
+  unsigned int n;               /**< Number of results waiting */
+} verify_batch_t;
+
+static void verify_batch_add (verify_batch_t *batch,
+                              sqlite3_int64 file_id,
+                              char const *const path)
+{
+  batch->entries[batch->n].dirfd = AT_FDCWD;
+  batch->entries[batch->n].path = g_strdup (path);
+  batch->ids[batch->n++] = file_id;
+}
+
+/**
+ * Check the waiting results against the filesystem, all at once, and print
+ * the ones that pass in order: the stored metadata of each file is updated if
+ * it changed, and a result passes if the file still exists and its current
+ * type passes the -f/-d filters.
+ * \return The number of results printed, at most max_results unless 0.
+ */
+static unsigned long int dfym_verify_flush (dfym_ctx_t *ctx,
+                                            verify_batch_t *batch,
+                                            unsigned char options,
+                                            unsigned long int max_results)
+{
+  unsigned long int printed = 0;
+
+  probe_batch (ctx, batch->probe, batch->entries, batch->n);
+  for (unsigned int k = 0; k < batch->n; k++)
+    {
+      dfym_probe_entry_t *entry = &batch->entries[k];
+      sqlite3_stmt *stmt = dfym_statement (ctx, STMT_FILE_STAT);
+
+      CALL_SQLITE (bind_int64 (stmt, 1, batch->ids[k]));
+      dfym_bind_probe (ctx, stmt, 2, entry);
+      CALL_SQLITE_EXPECT (step (stmt), DONE);
+      if (entry->type && type_wanted (entry->type, options)
+          && (!max_results || printed < max_results))
+        {
+          dfym_result_text (ctx, "path", entry->path, -1);
+          dfym_result_end (ctx);
+          printed++;
+        }
+      g_free ((char *)entry->path);
+    }
+  batch->n = 0;
+  return printed;
+}
+
+/**
+ * Check the last step of a statement taking a full-text query. SQLite
+ * fails with SQLITE_ERROR on a malformed query, which is the caller's
+ * mistake; any other failure is the database's.
+ * \return DFYM_QUERY_ERROR for a malformed query, DFYM_OK otherwise.
+ */
+static int dfym_check_match_done (dfym_ctx_t *ctx, int step)
+{
+  if (step == SQLITE_ERROR)
+    return DFYM_QUERY_ERROR;
+  dfym_check_done (ctx, step);
+  return DFYM_OK;
+}
+
+/**
+ * Print the paths returned by a search statement, with the id of their file
+ * as second column. The statement takes the maximum number of rows as ?2 and
+ * the -f/-d filters as ?3, which are bound here.
+ * \param match Whether the statement takes a full-text query.
+ * \return DFYM_QUERY_ERROR if the full-text query is malformed, DFYM_OK
+ * otherwise.
+ */
+static int dfym_search_run (dfym_ctx_t *ctx,
+                            sqlite3_stmt *stmt,
+                            unsigned long int number_results,
+                            unsigned char options,
+                            int match)
+{
+  int status = DFYM_OK;
+  verify_batch_t *batch = NULL;
+  unsigned long int printed = 0;
+  int step = SQLITE_DONE;
+
+  if (options & OPT_VERIFY)
+    {
+      batch = g_new (verify_batch_t, 1);
+      batch->probe = dfym_probe_new (0);
+      batch->n = 0;
+    }
+  /* Verified results are filtered here, and counted here too */
+  CALL_SQLITE (bind_int64 (stmt, 2, number_results && !batch ? (sqlite3_int64)number_results : -1));
+  CALL_SQLITE (bind_int (stmt, 3, batch ? 0 : options & (OPT_FILES | OPT_DIRECTORIES)));
+  while ((!number_results || printed < number_results)
+         && (step = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      const char *element = (const char *)sqlite3_column_text (stmt, 0);
+      if (!batch)
+        {
+          dfym_result_text (ctx, "path", element, sqlite3_column_bytes (stmt, 0));
+          dfym_result_end (ctx);
+          printed++;
+          continue;
+        }
+      /* No more results are checked than could still be printed */
+      verify_batch_add (batch, sqlite3_column_int64 (stmt, 1), element);
+      if (batch->n == VERIFY_BATCH
+          || (number_results && batch->n >= number_results - printed))
+        printed += dfym_verify_flush (ctx, batch, options, number_results ? number_results - printed : 0);
+    }
+  if (batch)
+    {
+      if (batch->n)
+        dfym_verify_flush (ctx, batch, options, number_results ? number_results - printed : 0);
+      dfym_probe_free (batch->probe);
+      g_free (batch);
+    }
+  if (step != SQLITE_ROW)
+    {
+      if (match)
+        status = dfym_check_match_done (ctx, step);
+      else
+        dfym_check_done (ctx, step);
+    }
+  sqlite3_reset (stmt);
+
+  return status;
+}
+
+/** Print a random sample of the files tagged with a tag, in random order.
+ *
+ * The taggings of a tag are numbered from 1 to its count, so files are drawn
+ * as random numbers, each looked up in the TaggingsBySeq index: the cost
+ * depends on the size of the sample, not on the number of files of the tag.
+ * Numbers are drawn without replacement, by a Fisher-Yates shuffle of which
+ * only the swapped positions are stored. Files filtered out by -f/-d or by a
+ * check against the filesystem are replaced by further draws.
+ *
+ * \param ctx The dfym context.
+ * \param tag The name of the tag.
+ * \param number_results Size of the sample.
+ * \param options An OR'ed set of flags from \ref query_flag_t.
+ * \return Error code \ref dfym_status_t.
+ */
+static int dfym_sample_tag (dfym_ctx_t *ctx,
+                            char const *const tag,
+                            unsigned long int number_results,
+                            unsigned char options)
+{
+  sqlite3_stmt *stmt = dfym_statement (ctx, STMT_TAG_SIZE);
+  sqlite3_int64 tag_id;
+  guint64 n;
+  GRand *rand = dfym_rand (ctx);
+  GHashTable *swapped;
+  verify_batch_t *batch = NULL;
+  unsigned long int printed = 0;
+
+  CALL_SQLITE (bind_text (stmt, 1, tag, strlen (tag), 0));
+  if (!dfym_step_row (ctx, stmt))
+    {
+      /* No such tag, unless the lookup failed */
+      sqlite3_reset (stmt);
+      return DFYM_OK;
+    }
+  tag_id = sqlite3_column_int64 (stmt, 0);
+  n = sqlite3_column_int64 (stmt, 1);
+  sqlite3_reset (stmt);
+
+  /* Position -> number of the tagging moved there, the others hold k + 1 */
+  swapped = g_hash_table_new (g_direct_hash, g_direct_equal);
+  if (options & OPT_VERIFY)
+    {
+      batch = g_new (verify_batch_t, 1);
+      batch->probe = dfym_probe_new (0);
+      batch->n = 0;
+    }
+  for (guint64 k = 0; k < n && printed < number_results && !ctx->failed; k++)
+    {
+      guint64 j = k + random_below (rand, n - k);
+      gpointer at_j = g_hash_table_lookup (swapped, GSIZE_TO_POINTER (j));
+      gpointer at_k = g_hash_table_lookup (swapped, GSIZE_TO_POINTER (k));
+      gsize seq = at_j ? GPOINTER_TO_SIZE (at_j) : j + 1;
+      const char *element;
+
+      g_hash_table_insert (swapped, GSIZE_TO_POINTER (j),
+                           at_k ? at_k : GSIZE_TO_POINTER (k + 1));
+      stmt = dfym_statement (ctx, STMT_TAGGING_AT);
+      CALL_SQLITE (bind_int64 (stmt, 1, tag_id));
+      CALL_SQLITE (bind_int64 (stmt, 2, seq));
+      if (!dfym_step_row (ctx, stmt))
+        {
+          /* Only if the numbering drifted, see dfym_check_tag_stats, or the
+             lookup failed */
+          sqlite3_reset (stmt);
+          continue;
+        }
+      element = (const char *)sqlite3_column_text (stmt, 0);
+      if (batch)
+        {
+          verify_batch_add (batch, sqlite3_column_int64 (stmt, 1), element);
+          sqlite3_reset (stmt);
+          if (batch->n == VERIFY_BATCH || batch->n >= number_results - printed)
+            printed += dfym_verify_flush (ctx, batch, options, number_results - printed);
+          continue;
+        }
+      if (type_wanted (sqlite3_column_type (stmt, 2) == SQLITE_NULL
+                       ? 0 : *sqlite3_column_text (stmt, 2), options))
+        {
+          dfym_result_text (ctx, "path", element, sqlite3_column_bytes (stmt, 0));
+          dfym_result_end (ctx);
+          printed++;
+        }
+      sqlite3_reset (stmt);
+    }
+  if (batch)
+    {
+      if (batch->n)
+        dfym_verify_flush (ctx, batch, options, number_results - printed);
+      dfym_probe_free (batch->probe);
+      g_free (batch);
+    }
+  g_hash_table_destroy (swapped);
+
+  return DFYM_OK;
+}
+
+/** Print all files that have been tagged with the given tag.
+ *
+ * The -f/-d filters are applied on the type stored when the file was tagged,
+ * so the filesystem is not accessed. With OPT_VERIFY, every result is checked
+ * against the filesystem instead, see \ref query_flag_t. The results are then
+ * stat'ed in batches, without changing their order.
+ *
+ * With a match, only the files with a path matching it are printed, see
+ * \ref dfym_find. The tag and the match are then looked up in one statement.
+ *
+ * A limited number of random results is sampled, see \ref dfym_sample_tag,
+ * rather than taken from all the files of the tag in random order.
+ *
+ * \param ctx The dfym context.
+ * \param tag The name of the tag.
+ * \param match A full-text query on the paths, or NULL.
+ * \param number_results Maximum number of files to print.
+ * \param options An OR'ed set of flags from \ref query_flag_t.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_search_with_tag (dfym_ctx_t *ctx,
+                          char const *const tag,
+                          char const *const match,
+                          unsigned long int number_results,
+                          unsigned char options)
+{
+  sqlite3_stmt *stmt;
+
+  if ((options & OPT_RANDOM) && number_results && !match)
+    return dfym_return (ctx, dfym_sample_tag (ctx, tag, number_results, options));
+  if (match)
+    {
+      stmt = dfym_statement (ctx, (options & OPT_RANDOM) ? STMT_SEARCH_MATCH_RANDOM : STMT_SEARCH_MATCH);
+      CALL_SQLITE (bind_text (stmt, 4, match, -1, SQLITE_STATIC));
+    }
+  else
+    stmt = dfym_statement (ctx, (options & OPT_RANDOM) ? STMT_SEARCH_RANDOM : STMT_SEARCH);
+  CALL_SQLITE (bind_text (stmt, 1, tag, strlen (tag), 0));
+  return dfym_return (ctx, dfym_search_run (ctx, stmt, number_results, options, match != NULL));
+}
+
+/** Print a page of the files tagged with the given tag, in the order of
+ * their ids.
+ *
+ * Pages are ranges of the index of taggings, see \ref dfym_all_files_page.
+ * The -f/-d filters of \ref query_flag_t apply, and pages are filled with
+ * the files passing them. Other options aren't supported by pages.
+ *
+ * \param ctx The dfym context.
+ * \param tag The name of the tag.
+ * \param after The cursor of the page: 0 for the first one, or the cursor
+ * returned with the previous one.
+ * \param page_size Maximum number of files to print, 0 for all the files left.
+ * \param options An OR'ed set of flags from \ref query_flag_t.
+ * \param next Where to store the cursor of the next page, 0 if this one is
+ * the last.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_search_page (dfym_ctx_t *ctx,
+                      char const *const tag,
+                      sqlite3_int64 after,
+                      unsigned long int page_size,
+                      unsigned char options,
+                      sqlite3_int64 *next)
+{
+  sqlite3_stmt *stmt = dfym_statement (ctx, STMT_SEARCH_PAGE);
+
+  CALL_SQLITE (bind_text (stmt, 1, tag, strlen (tag), 0));
+  CALL_SQLITE (bind_int (stmt, 3, options & (OPT_FILES | OPT_DIRECTORIES)));
+  CALL_SQLITE (bind_int64 (stmt, 4, after));
+  dfym_page_run (ctx, stmt, page_size, next);
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Print all files with a path matching a full-text query.
+ *
+ * The names of the files and of their directories are indexed apart: a path
+ * matches if the name of the file, or the name of any directory above it,
+ * matches the query. The query follows the syntax of SQLite's FTS5, where
+ * words are matched whole, case-insensitively, and "word*" matches a prefix.
+ *
+ * \param ctx The dfym context.
+ * \param match The full-text query.
+ * \param number_results Maximum number of files to print.
+ * \param options An OR'ed set of flags from \ref query_flag_t.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_find (dfym_ctx_t *ctx,
+               char const *const match,
+               unsigned long int number_results,
+               unsigned char options)
+{
+  sqlite3_stmt *stmt = dfym_statement (ctx, (options & OPT_RANDOM) ? STMT_FIND_RANDOM : STMT_FIND);
+
+  CALL_SQLITE (bind_text (stmt, 4, match, -1, SQLITE_STATIC));
+  return dfym_return (ctx, dfym_search_run (ctx, stmt, number_results, options, 1));
+}
+
+/** Operators of a search query */
+typedef enum
+{
+  QUERY_TAG,                    /**< Files with a tag */
+  QUERY_AND,                    /**< Files matching both operands */
+  QUERY_OR,                     /**< Files matching any operand */
+  QUERY_NOT                     /**< Files not matching the operand */
+} query_op_t;
+
+/** Node of the syntax tree of a search query */
+typedef struct query_node
+{
+  query_op_t op;                /**< Operator */
+  char *tag;                    /**< Name of the tag, for QUERY_TAG */
+  struct query_node *left;      /**< First operand, or only one for QUERY_NOT */
+  struct query_node *right;     /**< Second operand */
+} query_node_t;
+
+/** Tokens of a search query */
+typedef enum
+{
+  TOKEN_END,
+  TOKEN_WORD,                   /**< Bare word, part of a tag name */
+  TOKEN_QUOTED,                 /**< Quoted tag name */
+  TOKEN_AND,                    /**< AND or & */
+  TOKEN_OR,                     /**< OR or | */
+  TOKEN_NOT,                    /**< NOT or ! */
+  TOKEN_OPEN,                   /**< ( */
+  TOKEN_CLOSE,                  /**< ) */
+  TOKEN_ERROR                   /**< Unterminated quote */
+} query_token_t;
+
+/** State of the search query parser */
+typedef struct
+{
+  const char *input;            /**< Text left to read */
+  query_token_t token;          /**< Current token */
+  GString *text;                /**< Text of the current word or quoted name */
+} query_parser_t;
+
+static void query_node_free (query_node_t *node)
+{
+  if (!node)
+    return;
+  query_node_free (node->left);
+  query_node_free (node->right);
+  g_free (node->tag);
+  g_free (node);
+}
+
+static query_node_t *query_node_new (query_op_t op, query_node_t *left, query_node_t *right)
+{
+  query_node_t *node = g_new0 (query_node_t, 1);
+
+  node->op = op;
+  node->left = left;
+  node->right = right;
+  return node;
+}
+
+/**
+ * Read the next token of a query.
+ */
+static void query_next (query_parser_t *parser)
+{
+  const char *c = parser->input;
+
+  while (*c == ' ' || *c == '\t' || *c == '\n')
+    c++;
+  g_string_truncate (parser->text, 0);
+  switch (*c)
+    {
+    case '\0':
+      parser->token = TOKEN_END;
+      break;
+    case '(':
+      parser->token = TOKEN_OPEN;
+      c++;
+      break;
+    case ')':
+      parser->token = TOKEN_CLOSE;
+      c++;
+      break;
+    case '&':
+      parser->token = TOKEN_AND;
+      c++;
+      break;
+    case '|':
+      parser->token = TOKEN_OR;
+      c++;
+      break;
+    case '!':
+      parser->token = TOKEN_NOT;
+      c++;
+      break;
+    case '"':
+      for (c++; *c && *c != '"'; c++)
+        {
+          if (*c == '\\' && c[1])
+            c++;
+          g_string_append_c (parser->text, *c);
+        }
+      parser->token = *c ? TOKEN_QUOTED : TOKEN_ERROR;
+      if (*c)
+        c++;
+      break;
+    default:
+      for (; *c && !strchr (" \t\n()&|!\"", *c); c++)
+        g_string_append_c (parser->text, *c);
+      if (!strcmp (parser->text->str, "AND"))
+        parser->token = TOKEN_AND;
+      else if (!strcmp (parser->text->str, "OR"))
+        parser->token = TOKEN_OR;
+      else if (!strcmp (parser->text->str, "NOT"))
+        parser->token = TOKEN_NOT;
+      else
+        parser->token = TOKEN_WORD;
+    }
+  parser->input = c;
+}
+
+static query_node_t *query_parse_or (query_parser_t *parser);
+
+/**
+ * primary := '(' or ')' | quoted | word+
+ * Consecutive bare words make a single tag name, separated by spaces.
+ */
+static query_node_t *query_parse_primary (query_parser_t *parser)
+{
+  query_node_t *node = NULL;
+
+  switch (parser->token)
+    {
+    case TOKEN_OPEN:
+      query_next (parser);
+      node = query_parse_or (parser);
+      if (node && parser->token != TOKEN_CLOSE)
+        {
+          query_node_free (node);
+          return NULL;
+        }
+      query_next (parser);
+      return node;
+    case TOKEN_QUOTED:
+      node = query_node_new (QUERY_TAG, NULL, NULL);
+      node->tag = g_strdup (parser->text->str);
+      query_next (parser);
+      return node;
+    case TOKEN_WORD:
+      {
+        GString *tag = g_string_new (parser->text->str);
+        for (query_next (parser); parser->token == TOKEN_WORD; query_next (parser))
+          {
+            g_string_append_c (tag, ' ');
+            g_string_append (tag, parser->text->str);
+          }
+        node = query_node_new (QUERY_TAG, NULL, NULL);
+        node->tag = g_string_free (tag, FALSE);
+        return node;
+      }
+    default:
+      return NULL;
+    }
+}
+
+/**
+ * unary := NOT unary | primary
+ */
+static query_node_t *query_parse_unary (query_parser_t *parser)
+{
+  query_node_t *operand;
+
+  if (parser->token != TOKEN_NOT)
+    return query_parse_primary (parser);
+  query_next (parser);
+  if (!(operand = query_parse_unary (parser)))
+    return NULL;
+  return query_node_new (QUERY_NOT, operand, NULL);
+}
+
+/**
+ * and := unary (AND unary)*
+ */
+static query_node_t *query_parse_and (query_parser_t *parser)
+{
+  query_node_t *node = query_parse_unary (parser), *right;
+
+  while (node && parser->token == TOKEN_AND)
+    {
+      query_next (parser);
+      if (!(right = query_parse_unary (parser)))
+        {
+          query_node_free (node);
+          return NULL;
+        }
+      node = query_node_new (QUERY_AND, node, right);
+    }
+  return node;
+}
+
+/**
+ * or := and (OR and)*
+ */
+static query_node_t *query_parse_or (query_parser_t *parser)
+{
+  query_node_t *node = query_parse_and (parser), *right;
+
+  while (node && parser->token == TOKEN_OR)
+    {
+      query_next (parser);
+      if (!(right = query_parse_and (parser)))
+        {
+          query_node_free (node);
+          return NULL;
+        }
+      node = query_node_new (QUERY_OR, node, right);
+    }
+  return node;
+}
+
+/**
+ * Parse a search query. Returns NULL if it is malformed.
+ */
+static query_node_t *query_parse (char const *const query)
+{
+  query_parser_t parser = { query, TOKEN_END, g_string_new (NULL) };
+  query_node_t *node;
+
+  query_next (&parser);
+  node = query_parse_or (&parser);
+  if (node && parser.token != TOKEN_END)
+    {
+      query_node_free (node);
+      node = NULL;
+    }
+  g_string_free (parser.text, TRUE);
+  return node;
+}
+
+/**
+ * Load the ids of the rows returned by a statement into a posting list.
+ */
+static dfym_postings_t *dfym_load_postings (dfym_ctx_t *ctx, sqlite3_stmt *stmt)
+{
+  dfym_postings_t *postings = dfym_postings_new ();
+  int step;
+
+  while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
+    dfym_postings_add (postings, sqlite3_column_int64 (stmt, 0));
+  dfym_check_done (ctx, step);
+  return postings;
+}
+
+/**
+ * Load the posting list of the files with a path matching a full-text query.
+ * \return The list, or NULL if the query is malformed or the statement
+ * failed, which is then recorded in the context.
+ */
+static dfym_postings_t *dfym_match_postings (dfym_ctx_t *ctx, char const *const match)
+{
+  sqlite3_stmt *stmt = dfym_statement (ctx, STMT_MATCH_POSTINGS);
+  dfym_postings_t *postings = dfym_postings_new ();
+  int step;
+
+  CALL_SQLITE (bind_text (stmt, 4, match, -1, SQLITE_STATIC));
+  while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
+    dfym_postings_add (postings, sqlite3_column_int64 (stmt, 0));
+  if (step != SQLITE_DONE)
+    dfym_check_match_done (ctx, step);
+  sqlite3_reset (stmt);
+  if (step != SQLITE_DONE)
+    {
+      dfym_postings_free (postings);
+      return NULL;
+    }
+  return postings;
+}
+
+/**
+ * Evaluate a query into the posting list of the files matching it.
+ * The list of every file, needed for a standalone NOT, is loaded on demand.
+ */
+static dfym_postings_t *query_eval (dfym_ctx_t *ctx,
+                                    query_node_t const *node,
+                                    dfym_postings_t **universe)
+{
+  dfym_postings_t *left, *right, *result;
+  sqlite3_stmt *stmt;
+
+  switch (node->op)
+    {
+    case QUERY_TAG:
+      stmt = dfym_statement (ctx, STMT_TAG_POSTINGS);
+      CALL_SQLITE (bind_text (stmt, 1, node->tag, strlen (node->tag), 0));
+      return dfym_load_postings (ctx, stmt);
+    case QUERY_NOT:
+      if (!*universe)
+        *universe = dfym_load_postings (ctx, dfym_statement (ctx, STMT_ALL_FILE_IDS));
+      right = query_eval (ctx, node->left, universe);
+      result = dfym_postings_and_not (*universe, right);
+      dfym_postings_free (right);
+      return result;
+    case QUERY_AND:
+      /* "a AND NOT b" is a difference, no need for the list of every file */
+      if (node->right->op == QUERY_NOT || node->left->op == QUERY_NOT)
+        {
+          query_node_t const *positive = node->right->op == QUERY_NOT ? node->left : node->right;
+          query_node_t const *negative = node->right->op == QUERY_NOT ? node->right : node->left;
+          left = query_eval (ctx, positive, universe);
+          right = query_eval (ctx, negative->left, universe);
+          result = dfym_postings_and_not (left, right);
+        }
+      else
+        {
+          left = query_eval (ctx, node->left, universe);
+          right = query_eval (ctx, node->right, universe);
+          result = dfym_postings_and (left, right);
+        }
+      break;
+    case QUERY_OR:
+    default:
+      left = query_eval (ctx, node->left, universe);
+      right = query_eval (ctx, node->right, universe);
+      result = dfym_postings_or (left, right);
+    }
+  dfym_postings_free (left);
+  dfym_postings_free (right);
+  return result;
+}
+
+/**
+ * Append a query to a compound SELECT of the ids of the files matching it,
+ * the tag names being parameters from ?5 on, in the order of tags.
+ */
+static void query_sql (GString *sql, query_node_t const *node, GPtrArray *tags)
+{
+  query_node_t const *left = node->left, *right = node->right;
+  char const *op = node->op == QUERY_OR ? "UNION" : "INTERSECT";
+
+  switch (node->op)
+    {
+    case QUERY_TAG:
+      g_ptr_array_add (tags, node->tag);
+      g_string_append_printf (sql,
+                              "SELECT tgs.file_id "
+                              "FROM taggings tgs "
+                              "JOIN tags t ON (tgs.tag_id = t.id) "
+                              "WHERE t.name = ?%u", 4 + tags->len);
+      return;
+    case QUERY_NOT:
+      g_string_append (sql, "SELECT id FROM files EXCEPT SELECT * FROM (");
+      query_sql (sql, left, tags);
+      g_string_append (sql, ")");
+      return;
+    case QUERY_AND:
+      /* "a AND NOT b" is a difference, as with posting lists */
+      if (right->op == QUERY_NOT || left->op == QUERY_NOT)
+        {
+          if (left->op == QUERY_NOT)
+            {
+              left = node->right;
+              right = node->left;
+            }
+          right = right->left;
+          op = "EXCEPT";
+        }
+      break;
+    default:
+      break;
+    }
+  g_string_append (sql, "SELECT * FROM (");
+  query_sql (sql, left, tags);
+  g_string_append_printf (sql, ") %s SELECT * FROM (", op);
+  query_sql (sql, right, tags);
+  g_string_append (sql, ")");
+}
+
+/**
+ * Print the files matching a boolean expression over tags, evaluated by
+ * SQLite as a compound SELECT rather than with posting lists.
+ * \return DFYM_QUERY_ERROR if the full-text query is malformed, DFYM_OK
+ * otherwise.
+ */
+static int dfym_search_query_sql (dfym_ctx_t *ctx,
+                                  query_node_t const *tree,
+                                  char const *const match,
+                                  unsigned long int number_results,
+                                  unsigned char options)
+{
+  GString *sql = g_string_new (match ? MATCH_CTE : "");
+  GPtrArray *tags = g_ptr_array_new ();
+  sqlite3_stmt *stmt = NULL;
+  int status = DFYM_OK;
+
+  g_string_append (sql,
+                   "SELECT dfym_path(f.dir_id, f.name), f.id "
+                   "FROM files f "
+                   "WHERE f.id IN (");
+  query_sql (sql, tree, tags);
+  g_string_append (sql, ") ");
+  if (match)
+    g_string_append (sql, "AND f.id IN matched ");
+  g_string_append (sql, SEARCH_TYPE_FILTER);
+  if (options & OPT_RANDOM)
+    g_string_append (sql, "ORDER BY dfym_random() ");
+  g_string_append (sql, "LIMIT ?2");
+
+  if (!ctx->failed)
+    CALL_SQLITE (prepare_v2 (ctx->db, sql->str, -1, &stmt, NULL));
+  if (stmt)
+    {
+      if (match)
+        CALL_SQLITE (bind_text (stmt, 4, match, -1, SQLITE_STATIC));
+      for (guint k = 0; k < tags->len; k++)
+        CALL_SQLITE (bind_text (stmt, 5 + k, g_ptr_array_index (tags, k), -1, SQLITE_STATIC));
+      status = dfym_search_run (ctx, stmt, number_results, options, match != NULL);
+      sqlite3_finalize (stmt);
+    }
+  g_ptr_array_free (tags, TRUE);
+  g_string_free (sql, TRUE);
+  return status;
+}
+
+/** Print all files matching a boolean expression over tags.
+ *
+ * The expression combines tags with AND, OR and NOT (or &, | and !) and
+ * parentheses. Consecutive words make a single tag name, and names can be
+ * quoted to include operators. Each tag is loaded as a posting list of file
+ * ids, and the expression is evaluated by combining these lists in memory.
+ * The files with a path matching the full-text query make one more list.
+ * A query made of a single tag, or naming an existing tag, is run as a plain
+ * \ref dfym_search_with_tag.
+ *
+ * Posting lists hold 32-bit ids: once a file id goes past them, or with
+ * OPT_SQL, the expression is rather evaluated by SQLite as a compound SELECT
+ * of INTERSECT, UNION and EXCEPT.
+ *
+ * \param ctx The dfym context.
+ * \param query The boolean expression.
+ * \param match A full-text query on the paths, or NULL, see \ref dfym_find.
+ * \param number_results Maximum number of files to print.
+ * \param options An OR'ed set of flags from \ref query_flag_t.
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_search_query (dfym_ctx_t *ctx,
+                       char const *const query,
+                       char const *const match,
+                       unsigned long int number_results,
+                       unsigned char options)
 {
-  srand (time (NULL));
-  int n = array->len;
-  if (n > 1)
+  query_node_t *tree;
+  dfym_postings_t *matches, *universe = NULL, *paths = NULL;
+  sqlite3_stmt *stmt;
+  guint32 *ids;
+  guint64 n_ids;
+  sqlite3_int64 max_id;
+  unsigned long int limit = 0;
+  GRand *rand = NULL;
+  verify_batch_t *batch = NULL;
+  int status, reading, step;
+
+  /* An existing tag is searched as is, even if it looks like an expression */
+  stmt = dfym_statement (ctx, STMT_TAG_ID);
+  CALL_SQLITE (bind_text (stmt, 1, query, strlen (query), 0));
+  if (dfym_statement_has_row (ctx, stmt))
+    return dfym_return (ctx, dfym_search_with_tag (ctx, query, match, number_results, options));
+
+  if (!(tree = query_parse (query)))
+    return dfym_return (ctx, DFYM_QUERY_ERROR);
+  if (tree->op == QUERY_TAG)
+    {
+      status = dfym_search_with_tag (ctx, tree->tag, match, number_results, options);
+      query_node_free (tree);
+      return dfym_return (ctx, status);
+    }
+  /* The lists and the lookups of their files share one read transaction,
+     rather than taking the lock for each file. Files checked against the
+     filesystem are looked up without it, as they are probed meanwhile */
+  reading = !(options & OPT_VERIFY) && sqlite3_get_autocommit (ctx->db);
+  if (reading)
+    dfym_exec (ctx, "BEGIN");
+  stmt = dfym_statement (ctx, STMT_MAX_FILE_ID);
+  CALL_SQLITE_EXPECT (step (stmt), ROW);
+  max_id = sqlite3_column_int64 (stmt, 0);
+  sqlite3_reset (stmt);
+  if ((options & OPT_SQL) || max_id > G_MAXUINT32)
+    {
+      status = dfym_search_query_sql (ctx, tree, match, number_results, options);
+      query_node_free (tree);
+      if (reading)
+        dfym_exec (ctx, "COMMIT");
+      return dfym_return (ctx, status);
+    }
+  if (match && !(paths = dfym_match_postings (ctx, match)))
+    {
+      query_node_free (tree);
+      if (reading)
+        dfym_exec (ctx, "COMMIT");
+      /* Unless the statement failed, which makes it a database error */
+      return dfym_return (ctx, DFYM_QUERY_ERROR);
+    }
+  matches = query_eval (ctx, tree, &universe);
+  if (paths)
+    {
+      dfym_postings_t *both = dfym_postings_and (matches, paths);
+      dfym_postings_free (matches);
+      dfym_postings_free (paths);
+      matches = both;
+    }
+  ids = dfym_postings_to_array (matches, &n_ids);
+  dfym_postings_free (matches);
+  dfym_postings_free (universe);
+  query_node_free (tree);
+
+  if (options & OPT_RANDOM)
+    rand = dfym_rand (ctx);
+  if (options & OPT_VERIFY)
+    {
+      batch = g_new (verify_batch_t, 1);
+      batch->probe = dfym_probe_new (0);
+      batch->n = 0;
+    }
+  for (guint64 k = 0; k < n_ids && (!number_results || limit < number_results) && !ctx->failed; k++)
     {
-      size_t i;
-      for (i = 0; i < n - 1; i++)
+      const unsigned char *element;
+      /* Random order is a Fisher-Yates shuffle done as results are needed */
+      if (rand)
+        {
+          guint64 j = k + random_below (rand, n_ids - k);
+          guint32 t = ids[j];
+          ids[j] = ids[k];
+          ids[k] = t;
+        }
+      stmt = dfym_statement (ctx, STMT_FILE_NAME);
+      CALL_SQLITE (bind_int64 (stmt, 1, ids[k]));
+      if ((step = sqlite3_step (stmt)) != SQLITE_ROW)
+        {
+          /* Without a read transaction, the file may be gone meanwhile */
+          dfym_check_done (ctx, step);
+          sqlite3_reset (stmt);
+          continue;
+        }
+      element = sqlite3_column_text (stmt, 0);
+      if (batch)
+        {
+          verify_batch_add (batch, ids[k], (const char *)element);
+          sqlite3_reset (stmt);
+          if (batch->n == VERIFY_BATCH
+              || (number_results && batch->n >= number_results - limit))
+            limit += dfym_verify_flush (ctx, batch, options, number_results ? number_results - limit : 0);
+          continue;
+        }
+      if (type_wanted (sqlite3_column_type (stmt, 1) == SQLITE_NULL
+                       ? 0 : *sqlite3_column_text (stmt, 1), options))
         {
-          size_t j = i + rand () / (RAND_MAX / (n - i) + 1);
-          gpointer t = array->pdata[j];
-          array->pdata[j] = array->pdata[i];
-          array->pdata[i] = t;
+          dfym_result_text (ctx, "path", (char const *)element, sqlite3_column_bytes (stmt, 0));
+          dfym_result_end (ctx);
+          limit++;
         }
+      sqlite3_reset (stmt);
+    }
+  if (batch)
+    {
+      if (batch->n)
+        dfym_verify_flush (ctx, batch, options, number_results ? number_results - limit : 0);
+      dfym_probe_free (batch->probe);
+      g_free (batch);
+    }
+
+  if (reading)
+    dfym_exec (ctx, "COMMIT");
+  g_free (ids);
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/**
+ * Get the type of a directory entry: 'f' for files, 'd' for directories and
+ * 'o' for anything else. Symbolic links are followed, like g_file_test does,
+ * so the entry is only stat'ed if readdir doesn't know its type or it is a
+ * link. If descend is given, it is set when the entry is a real directory.
+ */
+static char discover_entry_type (DIR *dir, struct dirent *dirent, int *descend, gint *stats)
+{
+  struct stat st;
+  char type;
+
+  if (descend)
+    *descend = 0;
+  switch (dirent->d_type)
+    {
+    case DT_REG:
+      return 'f';
+    case DT_DIR:
+      if (descend)
+        *descend = 1;
+      return 'd';
+    case DT_LNK:
+    case DT_UNKNOWN:
+      g_atomic_int_inc (stats);
+      if (fstatat (dirfd (dir), dirent->d_name, &st, 0) != 0)
+        return 'o';
+      type = S_ISREG (st.st_mode) ? 'f' : S_ISDIR (st.st_mode) ? 'd' : 'o';
+      if (descend && dirent->d_type == DT_UNKNOWN && type == 'd')
+        *descend = fstatat (dirfd (dir), dirent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                   && S_ISDIR (st.st_mode);
+      return type;
+    default:
+      return 'o';
     }
 }
 
 /**
- * Callback for sqlite3_exec that will will print all results
+ * Build the prefix of the paths found in a directory: the directory itself
+ * without trailing separators, followed by one separator.
+ */
+static char *discover_prefix (char const *const directory)
+{
+  size_t length = strlen (directory);
+  char *prefix;
+
+  while (length && directory[length-1] == G_DIR_SEPARATOR)
+    length--;
+  prefix = g_malloc (length + 2);
+  memcpy (prefix, directory, length);
+  prefix[length] = G_DIR_SEPARATOR;
+  prefix[length+1] = '\0';
+  return prefix;
+}
+
+/**
+ * Load the tagged paths found below a directory into a set. The set holds
+ * paths relative to the directory prefix: only direct children if
+ * children_only is set, read from the directory node alone, or any
+ * descendant otherwise, walking the subtree of the node.
  */
-static int callback_print_sqlite (void *NotUsed, int argc, char **argv, char **azColName)
+static GHashTable *dfym_tagged_under (dfym_ctx_t *ctx,
+                                      char const *const prefix,
+                                      int children_only)
 {
-  for (int i=0; i<argc; i++)
+  GHashTable *tagged = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  size_t prefix_length = strlen (prefix);
+  sqlite3_int64 dir_id = dfym_dir_id (ctx, prefix, prefix_length - 1, 0);
+  sqlite3_stmt *stmt;
+  int step;
+
+  /* Nothing was ever tagged below a directory without node */
+  if (!dir_id)
+    return tagged;
+  stmt = dfym_statement (ctx, children_only ? STMT_FILES_IN_DIR : STMT_FILES_IN_SUBTREE);
+  CALL_SQLITE (bind_int64 (stmt, 1, dir_id));
+  while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
     {
-      /* printf("%s = %s\n", azColName[i], argv[i] ? argv[i] : "NULL"); */
-      printf ("%s\n", argv[i] ? argv[i] : "NULL");
+      const char *name = (const char *)sqlite3_column_text (stmt, 0);
+      g_hash_table_add (tagged, g_strdup (children_only ? name : name + prefix_length));
     }
-  return 0;
+  dfym_check_done (ctx, step);
+  return tagged;
 }
 
-/**
- * \addtogroup database Database query functions
- */
-/**@{*/
+/** Directory entries read at a time by \ref dfym_discover_untagged */
+#define DISCOVER_BATCH 1024
 
-/** Open the database if it exists, create it otherwise.
- *
- * The database will be placed in ~/.dfum.db by default. Currently, no means of
- * changing this default are provided.
- * \param db The SQLite3 database.
- * \return Error code \ref dfym_status_t.
+/** Untagged entries of a directory, read in batches */
+typedef struct
+{
+  DIR *dir;                     /**< The directory */
+  GHashTable *tagged;           /**< Names of its tagged entries */
+  dfym_probe_t *probe;          /**< Probe for the entries readdir can't type, NULL if types aren't needed */
+  char *names[DISCOVER_BATCH];  /**< Names of the entries of the batch */
+  char types[DISCOVER_BATCH];   /**< Their types, 0 if not needed */
+  dfym_probe_entry_t probes[DISCOVER_BATCH]; /**< Entries to stat */
+  unsigned int slots[DISCOVER_BATCH];        /**< Index of the entry of each probe */
+  unsigned int n;               /**< Number of entries of the batch */
+} discover_listing_t;
+
+/**
+ * Read the next batch of untagged entries of a directory. Types are taken
+ * from the directory listing whenever possible, and the links and entries of
+ * unknown type are stat'ed together by the probe.
+ * \return The number of entries read, 0 at the end of the directory.
  */
-sqlite3 *dfym_open_or_create_database (char *const db_path)
+static unsigned int discover_next_batch (dfym_ctx_t *ctx, discover_listing_t *listing)
 {
-  sqlite3 *db = NULL;
-  char *sql = NULL;
-  char *exec_error_msg = NULL;
-  CALL_SQLITE (open (db_path, &db));
-  sql =
-    "CREATE TABLE IF NOT EXISTS tags("
-    "id          INTEGER PRIMARY KEY, "
-    "name        TEXT UNIQUE NOT NULL"
-    ")";
-  CALL_SQLITE_EXPECT (exec (db, sql, NULL, 0, &exec_error_msg), OK);
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  sql =
-    "CREATE TABLE IF NOT EXISTS files("
-    "id          INTEGER PRIMARY KEY, "
-    "name        TEXT UNIQUE NOT NULL"
-    ")";
-  CALL_SQLITE_EXPECT (exec (db, sql, NULL, 0, &exec_error_msg), OK);
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  sql =
-    "CREATE TABLE IF NOT EXISTS taggings("
-    "id          INTEGER PRIMARY KEY, "
-    "tag_id      INTEGER NOT NULL, "
-    "file_id     INTEGER NOT NULL, "
-    "CONSTRAINT UniqueTagging UNIQUE(tag_id, file_id), "
-    "FOREIGN KEY(tag_id) REFERENCES tags(id), "
-    "FOREIGN KEY(file_id) REFERENCES files(id)"
-    ")";
-  CALL_SQLITE_EXPECT (exec (db, sql, NULL, 0, &exec_error_msg), OK);
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  if (exec_error_msg)
-    sqlite3_free (exec_error_msg);
+  struct dirent *dirent;
+  unsigned int n_probes = 0, n_read = 0;
+
+  for (unsigned int k = 0; k < listing->n; k++)
+    g_free (listing->names[k]);
+  listing->n = 0;
+  while (listing->n < DISCOVER_BATCH && (dirent = readdir (listing->dir)))
+    {
+      unsigned int k = listing->n;
 
-  return db;
+      n_read++;
+      if (!strcmp (dirent->d_name, ".") || !strcmp (dirent->d_name, "..")
+          || g_hash_table_contains (listing->tagged, dirent->d_name))
+        continue;
+      listing->names[k] = g_strdup (dirent->d_name);
+      listing->types[k] = 0;
+      listing->n++;
+      if (!listing->probe)
+        continue;
+      switch (dirent->d_type)
+        {
+        case DT_REG:
+          listing->types[k] = 'f';
+          break;
+        case DT_DIR:
+          listing->types[k] = 'd';
+          break;
+        case DT_LNK:
+        case DT_UNKNOWN:
+          listing->probes[n_probes].dirfd = dirfd (listing->dir);
+          listing->probes[n_probes].path = listing->names[k];
+          listing->slots[n_probes++] = k;
+          break;
+        default:
+          listing->types[k] = 'o';
+        }
+    }
+  ctx->fs_readdirs += n_read;
+  if (n_probes)
+    probe_batch (ctx, listing->probe, listing->probes, n_probes);
+  /* Broken links are neither files nor directories */
+  for (unsigned int k = 0; k < n_probes; k++)
+    listing->types[listing->slots[k]] = listing->probes[k].type ? listing->probes[k].type : 'o';
+  return listing->n;
 }
 
-/** Add a tag to a file.
- * This will add the file to the database if it didn't exist.
+/** Print files found in the given path that haven't been tagged.
  *
- * \param db The SQLite3 database.
- * \param tag The name of the tag.
- * \param file The full (normalized) path to the file to tag.
+ * The tagged entries of the directory are loaded with a single range scan,
+ * so telling whether an entry is tagged doesn't need a query of its own.
+ * Entry types are only needed by the -f/-d filters, and are taken from the
+ * directory listing whenever possible; the other entries are stat'ed in
+ * batches, see \ref dfym_probe_run. Results keep the order of the listing.
+ *
+ * \param ctx The dfym context.
+ * \param directory The directory to look into.
+ * \param number_results Maximum number of files to print.
+ * \param options An OR'ed set of flags from \ref query_flag_t.
  * \return Error code \ref dfym_status_t.
  */
-int dfym_add_tag (sqlite3 *db,
-                  char const *const tag,
-                  char const *const file)
+int dfym_discover_untagged (dfym_ctx_t *ctx,
+                            char const *const directory,
+                            unsigned long int number_results,
+                            unsigned char options)
 {
-  char *sql = NULL;
-  sqlite3_stmt *stmt = NULL;
-  int step;
-  sqlite3_int64 tag_id = 0, file_id = 0;
+  discover_listing_t *listing;
+  char *prefix;
+  unsigned long int limit = 0;
+  reservoir_t sample;
 
-  /* Insert tag if doesn't exist */
-  sql = "INSERT OR IGNORE INTO tags ( name ) VALUES ( ? )";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, tag, strlen (tag), 0));
-  CALL_SQLITE_EXPECT (step (stmt), DONE);
-  sql = "SELECT id FROM tags WHERE name=?";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, tag, strlen (tag), 0));
-  do
+  listing = g_new0 (discover_listing_t, 1);
+  if (!(listing->dir = opendir (directory)))
     {
-      step = sqlite3_step (stmt);
-      if (step == SQLITE_ROW)
-        tag_id = sqlite3_column_int (stmt,0);
+      g_free (listing);
+      return dfym_return (ctx, DFYM_NOT_EXISTS);
     }
-  while (step != SQLITE_DONE);
+  prefix = discover_prefix (directory);
+  listing->tagged = dfym_tagged_under (ctx, prefix, 1);
+  if (options & (OPT_FILES | OPT_DIRECTORIES))
+    listing->probe = dfym_probe_new (0);
 
-  /* Insert file if doesn't exist */
-  sql = "INSERT OR IGNORE INTO files ( name ) VALUES ( ? )";
-#ifdef SQL_VERBOSE
-  printf ("SQL: %s", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, file, strlen (file), 0));
-  CALL_SQLITE_EXPECT (step (stmt), DONE);
-  sql = "SELECT id FROM files WHERE name=?";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, file, strlen (file), 0));
-  do
+  /* Random results are sampled in one pass over the qualifying entries,
+     otherwise they can be printed as they are read */
+  if (options & OPT_RANDOM)
+    reservoir_init (&sample, number_results, dfym_rand (ctx));
+  while ((!number_results || (options & OPT_RANDOM) || limit < number_results)
+         && discover_next_batch (ctx, listing))
+    for (unsigned int k = 0; k < listing->n; k++)
+      {
+        if (!type_wanted (listing->types[k], options))
+          continue;
+        if (options & OPT_RANDOM)
+          reservoir_offer (&sample, listing->names[k]);
+        else if (!number_results || limit < number_results)
+          {
+            dfym_result_path (ctx, prefix, listing->names[k]);
+            dfym_result_end (ctx);
+            limit++;
+          }
+      }
+  if (options & OPT_RANDOM)
     {
-      step = sqlite3_step (stmt);
-      if (step == SQLITE_ROW)
-        file_id = sqlite3_column_int (stmt,0);
+      reservoir_shuffle (&sample);
+      for (int i=0; i<sample.items->len; i++)
+        {
+          dfym_result_path (ctx, prefix, g_ptr_array_index (sample.items, i));
+          dfym_result_end (ctx);
+        }
+      reservoir_clear (&sample);
     }
-  while (step != SQLITE_DONE);
-
-  if (!tag_id || !file_id)
-    return DFYM_DATABASE_ERROR;
 
-  /* Insert tagging relation if doesn't exist */
-  sql = "INSERT OR IGNORE INTO taggings ( tag_id, file_id ) VALUES ( ?1, ?2 )";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_int (stmt, 1, tag_id));
-  CALL_SQLITE (bind_int (stmt, 2, file_id));
-  CALL_SQLITE_EXPECT (step (stmt), DONE);
-
-  return DFYM_OK;
+  for (unsigned int k = 0; k < listing->n; k++)
+    g_free (listing->names[k]);
+  if (listing->probe)
+    dfym_probe_free (listing->probe);
+  closedir (listing->dir);
+  g_hash_table_destroy (listing->tagged);
+  g_free (listing);
+  g_free (prefix);
+  return dfym_return (ctx, DFYM_OK);
 }
 
-/** Remove a tag from a file.
- * This will remove the file if it is left without any tag.
- *
- * \param db The SQLite3 database.
- * \param tag The name of the tag.
- * \param file The full (normalized) path to a file to tag.
- * \return Error code \ref dfym_status_t.
- */
-int dfym_untag (sqlite3 *db,
-                char const *const tag,
-                char const *const file)
+/** A directory waiting to be read by the discover workers */
+typedef struct
 {
-  char *sql = NULL;
-  sqlite3_stmt *stmt = NULL;
-  char *exec_error_msg = NULL;
+  char *path;                   /**< Path of the directory */
+  int depth;                    /**< Depth of its entries, relative to the root */
+} discover_dir_t;
 
-  /* Check wether the file exists in the database */
-  sql = "SELECT id FROM files WHERE files.name = ?";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, file, strlen (file), 0));
-  if (sqlite3_step (stmt) == SQLITE_DONE)
-    return DFYM_NOT_EXISTS;
-
-  sql =
-    "DELETE "
-    "FROM taggings "
-    "WHERE file_id IN (SELECT files.id FROM files WHERE files.name = ?1) "
-    "AND tag_id IN (SELECT tags.id FROM tags WHERE tags.name = ?2)";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, file, strlen (file), 0));
-  CALL_SQLITE (bind_text (stmt, 2, tag, strlen (tag), 0));
-  CALL_SQLITE_EXPECT (step (stmt), DONE);
+/** An entry read by the discover workers */
+typedef struct
+{
+  char type;                    /**< 'f' for files, 'd' for directories, 'o' otherwise */
+  char name[];                  /**< Name of the entry */
+} discover_entry_t;
 
-  /* Delete any file that has no tag at all */
-  sql =
-    "DELETE FROM files "
-    "WHERE files.id "
-    "IN ("
-    "  SELECT files.id "
-    "  FROM files "
-    "  OUTER LEFT JOIN taggings "
-    "  ON (taggings.file_id = files.id) "
-    "  WHERE taggings.id IS NULL)";
-  CALL_SQLITE_EXPECT (exec (db, sql, NULL, 0, &exec_error_msg), OK);
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
+/** The entries of one directory, as handed from the workers to the SQL thread */
+typedef struct
+{
+  char *path;                   /**< Path of the directory */
+  GPtrArray *entries;           /**< Array of discover_entry_t */
+} discover_batch_t;
 
-  return DFYM_OK;
-}
+/** A discover worker and its queue of directories */
+typedef struct discover_worker discover_worker_t;
 
-/** Print all tags associated to this file.
- * \param db The SQLite3 database.
- * \param file The full (normalized) path to a file to tag.
- * \return Error code \ref dfym_status_t.
- */
-int dfym_show_file_tags (sqlite3 *db,
-                         char const *const file)
+/** State shared by the pool of discover workers */
+typedef struct
 {
-  char *sql = NULL;
-  sqlite3_stmt *stmt = NULL;
-  int step;
+  discover_worker_t *workers;   /**< One per thread */
+  unsigned int n_workers;       /**< Number of workers */
+  int max_depth;                /**< Deepest level to list, 0 for no limit */
+  GMutex lock;                  /**< Protects pending and available */
+  GCond changed;                /**< Signaled when pending or available change */
+  unsigned long int pending;    /**< Directories queued or being read */
+  unsigned long int available;  /**< Directories queued */
+  GAsyncQueue *results;         /**< discover_batch_t for the SQL thread */
+  gint fs_stats;                /**< Entries stat'ed by the workers */
+  gint fs_readdirs;             /**< Directory entries read by the workers */
+} discover_pool_t;
 
-  sql = "SELECT id FROM files WHERE files.name = ?";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, file, strlen (file), 0));
-  if (sqlite3_step (stmt) == SQLITE_DONE)
-    return DFYM_NOT_EXISTS;
-
-  sql =
-    "SELECT t.name "
-    "FROM files f "
-    "JOIN taggings tgs ON (tgs.file_id = f.id) "
-    "JOIN tags t ON (tgs.tag_id = t.id) "
-    "WHERE f.name = ?";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, file, strlen (file), 0));
-  do
-    {
-      step = sqlite3_step (stmt);
-      if (step == SQLITE_ROW)
-        printf ("%s\n", sqlite3_column_text (stmt,0));
-    }
-  while (step != SQLITE_DONE);
+struct discover_worker
+{
+  discover_pool_t *pool;        /**< The pool this worker belongs to */
+  GThread *thread;              /**< The thread running the worker */
+  GMutex lock;                  /**< Protects the queue */
+  GQueue queue;                 /**< discover_dir_t, own end is the tail */
+};
 
-  return DFYM_OK;
+/** Marks the end of the results in the queue */
+static discover_batch_t discover_done;
+
+static void discover_push (discover_worker_t *worker, char *path, int depth)
+{
+  discover_pool_t *pool = worker->pool;
+  discover_dir_t *dir = g_new (discover_dir_t, 1);
+
+  dir->path = path;
+  dir->depth = depth;
+  /* Counted before it is queued, so that a worker stealing it right away
+     can't count it out first */
+  g_mutex_lock (&pool->lock);
+  pool->pending++;
+  pool->available++;
+  g_mutex_lock (&worker->lock);
+  g_queue_push_tail (&worker->queue, dir);
+  g_mutex_unlock (&worker->lock);
+  g_cond_signal (&pool->changed);
+  g_mutex_unlock (&pool->lock);
 }
 
-/** Print all tags in the database.
- * \param db The SQLite3 database.
- * \return Error code \ref dfym_status_t.
+/**
+ * Take a directory to read: the newest one of the worker's own queue, or else
+ * the oldest one of another worker's queue.
  */
-int dfym_all_tags (sqlite3 *db)
+static discover_dir_t *discover_pop (discover_worker_t *worker)
 {
-  char *exec_error_msg = NULL;
-  char *sql = "SELECT name FROM tags";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE_EXPECT ( exec (db, sql, callback_print_sqlite, 0, &exec_error_msg), OK);
+  discover_pool_t *pool = worker->pool;
+  discover_dir_t *dir;
+  unsigned int self = worker - pool->workers;
 
-  return DFYM_OK;
+  g_mutex_lock (&worker->lock);
+  dir = g_queue_pop_tail (&worker->queue);
+  g_mutex_unlock (&worker->lock);
+  for (unsigned int i = 1; !dir && i < pool->n_workers; i++)
+    {
+      discover_worker_t *victim = &pool->workers[(self + i) % pool->n_workers];
+      g_mutex_lock (&victim->lock);
+      dir = g_queue_pop_head (&victim->queue);
+      g_mutex_unlock (&victim->lock);
+    }
+  if (dir)
+    {
+      g_mutex_lock (&pool->lock);
+      pool->available--;
+      g_mutex_unlock (&pool->lock);
+    }
+  return dir;
 }
 
-/** Print all files in the database.
- *
- * \param db The SQLite3 database.
- * \return Error code \ref dfym_status_t.
+/**
+ * Read a directory, queueing its subdirectories and handing its entries to
+ * the SQL thread.
  */
-int dfym_all_files (sqlite3 *db)
+static void discover_read (discover_worker_t *worker, discover_dir_t *work)
 {
-  char *exec_error_msg = NULL;
-  char *sql = "SELECT name FROM files";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE_EXPECT ( exec (db, sql, callback_print_sqlite, 0, &exec_error_msg), OK);
+  discover_pool_t *pool = worker->pool;
+  discover_batch_t *batch;
+  DIR *dir;
+  struct dirent *dirent;
+  int n_read = 0;
 
-  return DFYM_OK;
+  if (!(dir = opendir (work->path)))
+    return;
+  batch = g_new (discover_batch_t, 1);
+  batch->path = g_strdup (work->path);
+  batch->entries = g_ptr_array_new_with_free_func (g_free);
+  while ((dirent = readdir (dir)))
+    {
+      size_t length = strlen (dirent->d_name);
+      discover_entry_t *entry;
+      int descend;
+
+      n_read++;
+      if (!strcmp (dirent->d_name, ".") || !strcmp (dirent->d_name, ".."))
+        continue;
+      entry = g_malloc (sizeof (discover_entry_t) + length + 1);
+      memcpy (entry->name, dirent->d_name, length + 1);
+      entry->type = discover_entry_type (dir, dirent, &descend, &pool->fs_stats);
+      g_ptr_array_add (batch->entries, entry);
+      if (descend && (!pool->max_depth || work->depth < pool->max_depth))
+        discover_push (worker, g_build_filename (work->path, dirent->d_name, NULL), work->depth + 1);
+    }
+  closedir (dir);
+  g_atomic_int_add (&pool->fs_readdirs, n_read);
+  g_async_queue_push (pool->results, batch);
 }
 
-/** Print all files that have been tagged with the given tag.
- *
- * \param db The SQLite3 database.
- * \param tag The name of the tag.
- * \param number_results Maximum number of files to print.
- * \param options An OR'ed set of flags from \ref query_flag_t.
- * \return Error code \ref dfym_status_t.
- */
-int dfym_search_with_tag (sqlite3 *db,
-                          char const *const tag,
-                          unsigned long int number_results,
-                          unsigned char options)
+static gpointer discover_worker_run (gpointer data)
 {
-  sqlite3_stmt *stmt = NULL;
-  int step;
+  discover_worker_t *worker = data;
+  discover_pool_t *pool = worker->pool;
+  discover_dir_t *dir;
 
-  char *sql = NULL;
-  sql = g_strconcat (
-          "SELECT f.name "
-          "FROM files f "
-          "JOIN taggings tgs ON (tgs.file_id = f.id) "
-          "JOIN tags t ON (tgs.tag_id = t.id) "
-          "WHERE t.name = ?1",
-          (options & OPT_RANDOM) ? " ORDER BY RANDOM()" : "",
-          number_results ? " LIMIT ?2" : "",
-          NULL);
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, tag, strlen (tag), 0));
-  if (number_results)
-    CALL_SQLITE (bind_int (stmt, 2, number_results));
-  do
+  for (;;)
     {
-      step = sqlite3_step (stmt);
-      if (step == SQLITE_ROW)
+      if (!(dir = discover_pop (worker)))
+        {
+          /* Nothing to steal: wait for more work, or for the walk to end */
+          g_mutex_lock (&pool->lock);
+          while (pool->pending && !pool->available)
+            g_cond_wait (&pool->changed, &pool->lock);
+          if (!pool->pending)
+            {
+              g_mutex_unlock (&pool->lock);
+              break;
+            }
+          g_mutex_unlock (&pool->lock);
+          continue;
+        }
+      discover_read (worker, dir);
+      g_free (dir->path);
+      g_free (dir);
+      g_mutex_lock (&pool->lock);
+      if (!--pool->pending)
         {
-          const unsigned char *element = sqlite3_column_text (stmt,0);
-          if (  ! (options & (OPT_FILES | OPT_DIRECTORIES))
-                || ((options & OPT_FILES) && g_file_test ((const char *)element, G_FILE_TEST_IS_REGULAR))
-                || ((options & OPT_DIRECTORIES) && g_file_test ((const char *)element, G_FILE_TEST_IS_DIR)))
-            printf ("%s\n", element);
+          g_cond_broadcast (&pool->changed);
+          g_async_queue_push (pool->results, &discover_done);
         }
+      g_mutex_unlock (&pool->lock);
     }
-  while (step != SQLITE_DONE);
-
-  g_free (sql);
-  return DFYM_OK;
+  return NULL;
 }
 
-/** Print files found in the given path that haven't been tagged.
+/** Print files found under the given path, at any depth, that haven't been tagged.
+ *
+ * Directories are read by a pool of worker threads, which pass their
+ * contents to the calling thread. The calling thread owns the database: it
+ * loads every tagged path below the directory with a single range scan, and
+ * prints the results sorted by path, or shuffled if OPT_RANDOM is given.
+ * Symbolic links to directories are not followed.
  *
- * \param db The SQLite3 database.
+ * \param ctx The dfym context.
  * \param directory The directory to look into.
+ * \param number_results Maximum number of files to print.
  * \param options An OR'ed set of flags from \ref query_flag_t.
+ * \param max_depth Deepest level to look into, 1 being the directory itself (0 for no limit).
+ * \param threads Number of directory reader threads (0 for one per processor).
  * \return Error code \ref dfym_status_t.
  */
-int dfym_discover_untagged (sqlite3 *db,
-                            char const *const directory,
-                            unsigned long int number_results,
-                            unsigned char options)
+int dfym_discover_untagged_recursive (dfym_ctx_t *ctx,
+                                      char const *const directory,
+                                      unsigned long int number_results,
+                                      unsigned char options,
+                                      int max_depth,
+                                      unsigned int threads)
 {
-  GDir *dir;
-  GError *error;
-  const gchar *filename;
-  char *sql = NULL;
-  sqlite3_stmt *stmt = NULL;
-  int step;
-  int limit = 0;
-  char *path;
+  discover_pool_t pool;
+  discover_batch_t *batch;
+  reservoir_t untagged;
+  GString *path;
+  char *prefix;
+  size_t prefix_length;
+  GHashTable *tagged;
+  DIR *root;
 
-  sql = "SELECT name FROM files WHERE files.name = ?";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
+  if (!(root = opendir (directory)))
+    return dfym_return (ctx, DFYM_NOT_EXISTS);
+  closedir (root);
+  path = g_string_new (NULL);
+  prefix = discover_prefix (directory);
+  prefix_length = strlen (prefix);
+  tagged = dfym_tagged_under (ctx, prefix, 0);
 
-  dir = g_dir_open (directory, 0, &error);
-  /* If the user requests randomized results, we need to get all directory contents */
-  if (options & OPT_RANDOM)
+  /* Sorted results need every entry, random ones only a sample */
+  reservoir_init (&untagged, (options & OPT_RANDOM) ? number_results : 0, dfym_rand (ctx));
+  memset (&pool, 0, sizeof (pool));
+  pool.n_workers = threads ? threads : g_get_num_processors ();
+  pool.max_depth = max_depth;
+  pool.workers = g_new0 (discover_worker_t, pool.n_workers);
+  pool.results = g_async_queue_new ();
+  g_mutex_init (&pool.lock);
+  g_cond_init (&pool.changed);
+  for (unsigned int i = 0; i < pool.n_workers; i++)
     {
-      GPtrArray *dir_contents = g_ptr_array_new ();
-      while ((filename = g_dir_read_name (dir)))
-        {
-          g_ptr_array_add (dir_contents, (gpointer)g_build_filename (directory, filename, NULL));
-        }
-      g_array_shuffle (dir_contents);
+      pool.workers[i].pool = &pool;
+      g_mutex_init (&pool.workers[i].lock);
+      g_queue_init (&pool.workers[i].queue);
+    }
+  /* The root is queued without its trailing separator, like any other directory */
+  discover_push (&pool.workers[0], prefix_length > 1 ? g_strndup (prefix, prefix_length - 1) : g_strdup (prefix), 1);
+  for (unsigned int i = 0; i < pool.n_workers; i++)
+    pool.workers[i].thread = g_thread_new ("discover", discover_worker_run, &pool.workers[i]);
 
-      for (int i=0; i<dir_contents->len && limit<number_results; i++)
+  /* This thread does all the database work while the workers read */
+  while ((batch = g_async_queue_pop (pool.results)) != &discover_done)
+    {
+      for (unsigned int i = 0; i < batch->entries->len; i++)
         {
-          CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-          path = (char *)g_ptr_array_index (dir_contents, i);
-          CALL_SQLITE (bind_text (stmt, 1, path, strlen (path), 0));
-          step = sqlite3_step (stmt);
-          if (step == SQLITE_DONE
-              && (! (options & (OPT_FILES | OPT_DIRECTORIES))
-                  || ((options & OPT_FILES) && g_file_test ((const char *)path, G_FILE_TEST_IS_REGULAR))
-                  || ((options & OPT_DIRECTORIES) && g_file_test ((const char *)path, G_FILE_TEST_IS_DIR))))
-            {
-              printf ("%s\n", path);
-              limit++;
-            }
+          discover_entry_t *entry = g_ptr_array_index (batch->entries, i);
+          if ((options & (OPT_FILES | OPT_DIRECTORIES))
+              && !((options & OPT_FILES) && entry->type == 'f')
+              && !((options & OPT_DIRECTORIES) && entry->type == 'd'))
+            continue;
+          g_string_assign (path, batch->path);
+          if (path->len && path->str[path->len-1] != G_DIR_SEPARATOR)
+            g_string_append_c (path, G_DIR_SEPARATOR);
+          g_string_append (path, entry->name);
+          if (!g_hash_table_contains (tagged, path->str + prefix_length))
+            reservoir_offer (&untagged, path->str);
         }
-      g_ptr_array_free (dir_contents, TRUE);
+      g_ptr_array_free (batch->entries, TRUE);
+      g_free (batch->path);
+      g_free (batch);
     }
-  /* Otherwise, we can deal directly with SQL */
+
+  for (unsigned int i = 0; i < pool.n_workers; i++)
+    {
+      g_thread_join (pool.workers[i].thread);
+      g_mutex_clear (&pool.workers[i].lock);
+    }
+  g_free (pool.workers);
+  ctx->fs_stats += pool.fs_stats;
+  ctx->fs_readdirs += pool.fs_readdirs;
+  g_async_queue_unref (pool.results);
+  g_mutex_clear (&pool.lock);
+  g_cond_clear (&pool.changed);
+
+  if (options & OPT_RANDOM)
+    reservoir_shuffle (&untagged);
   else
+    g_ptr_array_sort (untagged.items, compare_paths);
+  for (unsigned int i = 0; i < untagged.items->len && (!number_results || i < number_results); i++)
     {
-      while ((filename = g_dir_read_name (dir))
-             && (!number_results || limit < number_results))
-        {
-          CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-          path = g_build_filename (directory, filename, NULL);
-          CALL_SQLITE (bind_text (stmt, 1, path, strlen (path), 0));
-          step = sqlite3_step (stmt);
-          if (step == SQLITE_DONE
-              && (! (options & (OPT_FILES | OPT_DIRECTORIES))
-                  || ((options & OPT_FILES) && g_file_test ((const char *)path, G_FILE_TEST_IS_REGULAR))
-                  || ((options & OPT_DIRECTORIES) && g_file_test ((const char *)path, G_FILE_TEST_IS_DIR))))
-            {
-              printf ("%s\n", path);
-              limit++;
-            }
-        }
+      dfym_result_text (ctx, "path", g_ptr_array_index (untagged.items, i), -1);
+      dfym_result_end (ctx);
     }
-  g_dir_close (dir);
-  return DFYM_OK;
+
+  reservoir_clear (&untagged);
+  g_string_free (path, TRUE);
+  g_hash_table_destroy (tagged);
+  g_free (prefix);
+  return dfym_return (ctx, DFYM_OK);
 }
 
 /** Rename a file in the database.
  *
- * \param db The SQLite3 database.
+ * \param ctx The dfym context.
  * \param file_from The path of the file to rename.
  * \param file_to The new path of the file.
  * \return Error code \ref dfym_status_t.
  */
-int dfym_rename_file (sqlite3 *db,
+int dfym_rename_file (dfym_ctx_t *ctx,
                       char const *const file_from,
                       char const *const file_to)
 {
-  char *sql = NULL;
   sqlite3_stmt *stmt = NULL;
+  sqlite3_int64 file_id;
+  size_t dir_length;
+  char const *name = path_split (file_to, strlen (file_to), &dir_length);
+
+  if (!(file_id = dfym_file_id (ctx, file_from, 0)))
+    return dfym_return (ctx, DFYM_NOT_EXISTS);
 
-  sql = "SELECT id FROM files WHERE files.name = ?";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, file_from, strlen (file_from), 0));
-  if (sqlite3_step (stmt) == SQLITE_DONE)
-    return DFYM_NOT_EXISTS;
-
-  sql =
-    "UPDATE files "
-    "SET name = ?1 "
-    "WHERE name = ?2";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, file_to, strlen (file_to), 0));
-  CALL_SQLITE (bind_text (stmt, 2, file_from, strlen (file_from), 0));
+  stmt = dfym_statement (ctx, STMT_FILE_RENAME);
+  CALL_SQLITE (bind_int64 (stmt, 1, dfym_dir_id (ctx, file_to, dir_length, 1)));
+  CALL_SQLITE (bind_text (stmt, 2, name, strlen (name), 0));
+  CALL_SQLITE (bind_int64 (stmt, 3, file_id));
   CALL_SQLITE_EXPECT (step (stmt), DONE);
 
-  return DFYM_OK;
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Move every file below a directory to another directory.
+ *
+ * Files are stored under directory nodes, so this moves the node of the
+ * directory alone, whatever the number of files below it. The target may
+ * already have a node, as long as no file was tagged below it.
+ *
+ * \param ctx The dfym context.
+ * \param dir_from The path of the directory to rename.
+ * \param dir_to The new path of the directory.
+ * \param count Where to store the number of files moved (can be NULL).
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_rename_dir (dfym_ctx_t *ctx,
+                     char const *const dir_from,
+                     char const *const dir_to,
+                     unsigned long int *count)
+{
+  sqlite3_stmt *stmt = NULL;
+  size_t from_length = path_trimmed_length (dir_from);
+  size_t to_length = path_trimmed_length (dir_to);
+  size_t parent_length;
+  char const *name = path_split (dir_to, to_length, &parent_length);
+  sqlite3_int64 from_id, to_id, files;
+  int started;
+
+  /* A directory can't be moved into itself, nor over one of its ancestors */
+  if (!strncmp (dir_from, dir_to, MIN (from_length, to_length))
+      && (from_length == to_length
+          || (from_length < to_length ? dir_to[from_length] : dir_from[to_length]) == G_DIR_SEPARATOR))
+    return dfym_return (ctx, DFYM_CONFLICT);
+
+  started = dfym_begin (ctx);
+  from_id = dfym_dir_id (ctx, dir_from, from_length, 0);
+  if (!from_length || !from_id)
+    {
+      dfym_rollback (ctx, started);
+      return dfym_return (ctx, DFYM_NOT_EXISTS);
+    }
+
+  /* A target node left empty by earlier deletions is replaced */
+  if ((to_id = dfym_dir_id (ctx, dir_to, to_length, 0)))
+    {
+      stmt = dfym_statement (ctx, STMT_SUBTREE_COUNT_FILES);
+      CALL_SQLITE (bind_int64 (stmt, 1, to_id));
+      CALL_SQLITE_EXPECT (step (stmt), ROW);
+      files = sqlite3_column_int64 (stmt, 0);
+      sqlite3_reset (stmt);
+      if (files)
+        {
+          dfym_rollback (ctx, started);
+          return dfym_return (ctx, DFYM_CONFLICT);
+        }
+      stmt = dfym_statement (ctx, STMT_SUBTREE_DELETE_DIRS);
+      CALL_SQLITE (bind_int64 (stmt, 1, to_id));
+      CALL_SQLITE_EXPECT (step (stmt), DONE);
+    }
+
+  stmt = dfym_statement (ctx, STMT_SUBTREE_COUNT_FILES);
+  CALL_SQLITE (bind_int64 (stmt, 1, from_id));
+  CALL_SQLITE_EXPECT (step (stmt), ROW);
+  files = sqlite3_column_int64 (stmt, 0);
+  sqlite3_reset (stmt);
+
+  dfym_dir_cache_flush (ctx);
+  stmt = dfym_statement (ctx, STMT_DIR_MOVE);
+  CALL_SQLITE (bind_int64 (stmt, 1, dfym_dir_id (ctx, dir_to, parent_length, 1)));
+  CALL_SQLITE (bind_text (stmt, 2, name, dir_to + to_length - name, 0));
+  CALL_SQLITE (bind_int64 (stmt, 3, from_id));
+  CALL_SQLITE_EXPECT (step (stmt), DONE);
+  dfym_commit (ctx, started);
+
+  /* The paths of every node below the moved one changed */
+  dfym_dir_cache_flush (ctx);
+  if (count)
+    *count = files;
+  return dfym_return (ctx, DFYM_OK);
 }
 
 /** Rename a tag in the database.
  * Returns DFYM_NOT_EXISTS if the tag is not found in the database.
  *
- * \param db The SQLite3 database.
+ * \param ctx The dfym context.
  * \param tag_from The original name of the tag.
  * \param tag_to The new name of the tag.
  * \return Error code \ref dfym_status_t.
  */
-int dfym_rename_tag (sqlite3 *db,
+int dfym_rename_tag (dfym_ctx_t *ctx,
                      char const *const tag_from,
                      char const *const tag_to)
 {
-  char *sql = NULL;
   sqlite3_stmt *stmt = NULL;
+  int started = dfym_begin (ctx);
 
-  sql = "SELECT id FROM tags WHERE tags.name = ?";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
+  stmt = dfym_statement (ctx, STMT_TAG_ID);
   CALL_SQLITE (bind_text (stmt, 1, tag_from, strlen (tag_from), 0));
-  if (sqlite3_step (stmt) == SQLITE_DONE)
-    return DFYM_NOT_EXISTS;
-
-  sql =
-    "UPDATE tags "
-    "SET name = ?1 "
-    "WHERE name = ?2";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
+  if (!dfym_statement_has_row (ctx, stmt))
+    {
+      dfym_rollback (ctx, started);
+      return dfym_return (ctx, DFYM_NOT_EXISTS);
+    }
+
+  stmt = dfym_statement (ctx, STMT_TAG_RENAME);
   CALL_SQLITE (bind_text (stmt, 1, tag_to, strlen (tag_to), 0));
   CALL_SQLITE (bind_text (stmt, 2, tag_from, strlen (tag_from), 0));
   CALL_SQLITE_EXPECT (step (stmt), DONE);
+  dfym_commit (ctx, started);
 
-  return DFYM_OK;
+  return dfym_return (ctx, DFYM_OK);
 }
 
 /** Remove a file from the database.
  * Returns DFYM_NOT_EXISTS if the file is not found in the database.
  *
- * \param db The SQLite3 database.
+ * \param ctx The dfym context.
  * \param file The full (normalized) path of the file to remove.
  * \return Error code \ref dfym_status_t.
  */
-int dfym_delete_file (sqlite3 *db,
+int dfym_delete_file (dfym_ctx_t *ctx,
                       char const *const file)
 {
-  char *sql = NULL;
   sqlite3_stmt *stmt = NULL;
+  sqlite3_int64 file_id;
+  int started = dfym_begin (ctx);
 
   /* Check if file exists in the database */
-  sql = "SELECT id FROM files WHERE name = ?";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, file, strlen (file), 0));
-  if (sqlite3_step (stmt) == SQLITE_DONE)
-    return DFYM_NOT_EXISTS;
+  if (!(file_id = dfym_file_id (ctx, file, 0)))
+    {
+      dfym_rollback (ctx, started);
+      return dfym_return (ctx, DFYM_NOT_EXISTS);
+    }
 
   /* Delete any tagging including this file */
-  sql =
-    "DELETE "
-    "FROM taggings "
-    "WHERE file_id IN (SELECT files.id FROM files WHERE files.name = ?1) ";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, file, strlen (file), 0));
+  stmt = dfym_statement (ctx, STMT_FILE_DELETE_TAGGINGS);
+  CALL_SQLITE (bind_int64 (stmt, 1, file_id));
   CALL_SQLITE_EXPECT (step (stmt), DONE);
 
   /* Delete file */
-  sql = "DELETE FROM files WHERE name = ?1";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
-  CALL_SQLITE (bind_text (stmt, 1, file, strlen (file), 0));
+  stmt = dfym_statement (ctx, STMT_FILE_DELETE);
+  CALL_SQLITE (bind_int64 (stmt, 1, file_id));
   CALL_SQLITE_EXPECT (step (stmt), DONE);
+  dfym_commit (ctx, started);
 
-  return DFYM_OK;
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/** Remove every file below a directory from the database, with its taggings.
+ * Returns DFYM_NOT_EXISTS if nothing was ever tagged below the directory.
+ *
+ * \param ctx The dfym context.
+ * \param dir The path of the directory to remove.
+ * \param count Where to store the number of files removed (can be NULL).
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_delete_dir (dfym_ctx_t *ctx,
+                     char const *const dir,
+                     unsigned long int *count)
+{
+  sqlite3_stmt *stmt = NULL;
+  sqlite3_int64 dir_id;
+  int started;
+
+  started = dfym_begin (ctx);
+  if (!(dir_id = dfym_dir_id (ctx, dir, path_trimmed_length (dir), 0)))
+    {
+      dfym_rollback (ctx, started);
+      return dfym_return (ctx, DFYM_NOT_EXISTS);
+    }
+
+  stmt = dfym_statement (ctx, STMT_SUBTREE_COUNT_FILES);
+  CALL_SQLITE (bind_int64 (stmt, 1, dir_id));
+  CALL_SQLITE_EXPECT (step (stmt), ROW);
+  if (count)
+    *count = sqlite3_column_int64 (stmt, 0);
+  sqlite3_reset (stmt);
+
+  /* Files go away with their last tagging */
+  stmt = dfym_statement (ctx, STMT_SUBTREE_DELETE_TAGGINGS);
+  CALL_SQLITE (bind_int64 (stmt, 1, dir_id));
+  CALL_SQLITE_EXPECT (step (stmt), DONE);
+
+  stmt = dfym_statement (ctx, STMT_SUBTREE_DELETE_DIRS);
+  CALL_SQLITE (bind_int64 (stmt, 1, dir_id));
+  CALL_SQLITE_EXPECT (step (stmt), DONE);
+  dfym_commit (ctx, started);
+
+  dfym_dir_cache_flush (ctx);
+  return dfym_return (ctx, DFYM_OK);
 }
 
 /** Remove a tag from the database.
  * This will remove the file if it is left without any tag.
  *
- * \param db The SQLite3 database.
+ * \param ctx The dfym context.
  * \param tag The name of the tag to remove.
  * \return Error code \ref dfym_status_t.
  */
-int dfym_delete_tag (sqlite3 *db,
+int dfym_delete_tag (dfym_ctx_t *ctx,
                      char const *const tag)
 {
-  char *sql = NULL;
   sqlite3_stmt *stmt = NULL;
-  char *exec_error_msg = NULL;
+  int started = dfym_begin (ctx);
 
   /* Check if tag exists in the database */
-  sql = "SELECT id FROM tags WHERE name = ?";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
+  stmt = dfym_statement (ctx, STMT_TAG_ID);
   CALL_SQLITE (bind_text (stmt, 1, tag, strlen (tag), 0));
-  if (sqlite3_step (stmt) == SQLITE_DONE)
-    return DFYM_NOT_EXISTS;
+  if (!dfym_statement_has_row (ctx, stmt))
+    {
+      dfym_rollback (ctx, started);
+      return dfym_return (ctx, DFYM_NOT_EXISTS);
+    }
 
   /* Delete any tagging including this tag */
-  sql =
-    "DELETE "
-    "FROM taggings "
-    "WHERE tag_id IN (SELECT tags.id FROM tags WHERE tags.name = ?1) ";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
+  stmt = dfym_statement (ctx, STMT_TAG_DELETE_TAGGINGS);
   CALL_SQLITE (bind_text (stmt, 1, tag, strlen (tag), 0));
   CALL_SQLITE_EXPECT (step (stmt), DONE);
 
-  /* Delete any file that has no tag at all */
-  sql =
-    "DELETE FROM files "
-    "WHERE files.id "
-    "IN ("
-    "  SELECT files.id "
-    "  FROM files "
-    "  OUTER LEFT JOIN taggings "
-    "  ON (taggings.file_id = files.id) "
-    "  WHERE taggings.id IS NULL)";
-  CALL_SQLITE_EXPECT (exec (db, sql, NULL, 0, &exec_error_msg), OK);
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-
   /* Delete tag */
-  sql = "DELETE FROM tags WHERE name = ?1";
-#ifdef SQL_VERBOSE
-  printf ("** SQL **\n%s\n", sql);
-#endif
-  CALL_SQLITE (prepare_v2 (db, sql, strlen (sql) + 1, &stmt, NULL));
+  stmt = dfym_statement (ctx, STMT_TAG_DELETE);
   CALL_SQLITE (bind_text (stmt, 1, tag, strlen (tag), 0));
   CALL_SQLITE_EXPECT (step (stmt), DONE);
+  dfym_commit (ctx, started);
 
-  return DFYM_OK;
+  return dfym_return (ctx, DFYM_OK);
 }
 
-/**@}*/
+/** Stored files loaded and checked at a time by \ref dfym_gc */
+#define GC_BATCH 4096
+
+/** Check that every stored file still exists, with the type it was tagged with.
+ *
+ * Files are taken by increasing id, from and to included, in batches that are
+ * stat'ed at once by a probe while the database is left alone. Missing
+ * files are printed as "missing", followed by a tab and the path, and files
+ * whose type changed as "changed". With OPT_PRUNE they are then deleted along
+ * with their taggings, all in a single transaction. Files that can't be
+ * checked, for lack of permissions for instance, are printed as "unchecked"
+ * with the "error" met, and left alone.
+ *
+ * Large databases can be checked in chunks: the check stops after max_files
+ * files or max_seconds seconds, and the id to resume from is given in the
+ * report.
+ *
+ * \param ctx The dfym context.
+ * \param from The id of the first file to check.
+ * \param to The id of the last file to check.
+ * \param max_files Maximum number of files to check (0 for no limit).
+ * \param max_seconds Seconds after which no more files are loaded (0 for no limit).
+ * \param options An OR'ed set of flags from \ref query_flag_t.
+ * \param depth Number of files stat'ed at once (0 for \ref DFYM_PROBE_DEPTH).
+ * \param report Where to store the figures of the check (can be NULL).
+ * \return Error code \ref dfym_status_t.
+ */
+int dfym_gc (dfym_ctx_t *ctx,
+             sqlite3_int64 from,
+             sqlite3_int64 to,
+             unsigned long int max_files,
+             unsigned int max_seconds,
+             unsigned char options,
+             unsigned int depth,
+             dfym_gc_report_t *report)
+{
+  dfym_probe_t *probe = dfym_probe_new (depth);
+  dfym_probe_entry_t *entries = g_new (dfym_probe_entry_t, GC_BATCH);
+  sqlite3_int64 *ids = g_new (sqlite3_int64, GC_BATCH);
+  char *stored = g_new (char, GC_BATCH);
+  unsigned int n;
+  int step;
+  GArray *stale = g_array_new (FALSE, FALSE, sizeof (sqlite3_int64));
+  unsigned long int checked = 0, missing = 0, changed = 0, unchecked = 0;
+  gint64 start = g_get_monotonic_time ();
+  int more = 1;
+
+  while (more && from <= to)
+    {
+      sqlite3_stmt *stmt = dfym_statement (ctx, STMT_GC_RANGE);
+      unsigned int wanted = GC_BATCH;
+
+      if (max_files && max_files - checked < wanted)
+        wanted = max_files - checked;
+      CALL_SQLITE (bind_int64 (stmt, 1, from));
+      CALL_SQLITE (bind_int64 (stmt, 2, to));
+      CALL_SQLITE (bind_int64 (stmt, 3, wanted));
+      n = 0;
+      while ((step = sqlite3_step (stmt)) == SQLITE_ROW)
+        {
+          ids[n] = sqlite3_column_int64 (stmt, 0);
+          entries[n].dirfd = AT_FDCWD;
+          entries[n].path = g_strdup ((char const *)sqlite3_column_text (stmt, 1));
+          stored[n++] = sqlite3_column_type (stmt, 2) == SQLITE_NULL ? 0 : *sqlite3_column_text (stmt, 2);
+        }
+      dfym_check_done (ctx, step);
+      /* No read transaction is kept open while the files are checked */
+      sqlite3_reset (stmt);
+      if (ctx->failed)
+        {
+          /* A short batch doesn't mean the range is exhausted: the batch is
+             left for the resumed check */
+          while (n)
+            g_free ((char *)entries[--n].path);
+          break;
+        }
+      if (n < wanted)
+        more = 0;
+      if (!n)
+        break;
+
+      probe_batch (ctx, probe, entries, n);
+      for (unsigned int k = 0; k < n; k++)
+        {
+          dfym_probe_entry_t *entry = &entries[k];
+          if (entry->error == ENOENT || entry->error == ENOTDIR)
+            {
+              dfym_result_text (ctx, "status", "missing", -1);
+              dfym_result_text (ctx, "path", entry->path, -1);
+              dfym_result_end (ctx);
+              missing++;
+              g_array_append_val (stale, ids[k]);
+            }
+          else if (entry->error)
+            {
+              dfym_result_text (ctx, "status", "unchecked", -1);
+              dfym_result_text (ctx, "path", entry->path, -1);
+              dfym_result_text (ctx, "error", g_strerror (entry->error), -1);
+              dfym_result_end (ctx);
+              unchecked++;
+            }
+          else if (stored[k] && stored[k] != entry->type)
+            {
+              dfym_result_text (ctx, "status", "changed", -1);
+              dfym_result_text (ctx, "path", entry->path, -1);
+              dfym_result_end (ctx);
+              changed++;
+              g_array_append_val (stale, ids[k]);
+            }
+          g_free ((char *)entry->path);
+        }
+      checked += n;
+      from = ids[n-1] + 1;
+      if ((max_files && checked >= max_files)
+          || (max_seconds && g_get_monotonic_time () - start >= (gint64)max_seconds * G_USEC_PER_SEC))
+        break;
+    }
+  if (report)
+    {
+      report->checked = checked;
+      report->missing = missing;
+      report->changed = changed;
+      report->unchecked = unchecked;
+      report->pruned = 0;
+      /* Nothing left if the last batch came short or the range was exhausted */
+      report->next = more && from <= to ? from : 0;
+    }
 
+  dfym_probe_free (probe);
+  g_free (entries);
+  g_free (ids);
+  g_free (stored);
+
+  if ((options & OPT_PRUNE) && stale->len)
+    {
+      int started = dfym_begin (ctx);
+      for (unsigned int k = 0; k < stale->len; k++)
+        {
+          /* The file goes away with its last tagging */
+          sqlite3_stmt *stmt = dfym_statement (ctx, STMT_FILE_DELETE_TAGGINGS);
+          CALL_SQLITE (bind_int64 (stmt, 1, g_array_index (stale, sqlite3_int64, k)));
+          CALL_SQLITE_EXPECT (step (stmt), DONE);
+        }
+      dfym_commit (ctx, started);
+      if (report && !ctx->failed)
+        report->pruned = stale->len;
+    }
+  g_array_free (stale, TRUE);
+  return dfym_return (ctx, DFYM_OK);
+}
+
+/**@}*/
@@ -1,34 +1,15 @@
 /** \file
   * dfym: Library functions using a SQLite3 backend */
 
-#define CALL_SQLITE(f)                                          \
-    {                                                           \
-        int i;                                                  \
-        i = sqlite3_ ## f;                                      \
-        if (i != SQLITE_OK) {                                   \
-            fprintf (stderr, "%s failed with status %d: %s\n",  \
-                     #f, i, sqlite3_errmsg (db));               \
-            exit (1);                                           \
-        }                                                       \
-    }                                                           \
- 
-#define CALL_SQLITE_EXPECT(f,x)                                 \
-    {                                                           \
-        int i;                                                  \
-        i = sqlite3_ ## f;                                      \
-        if (i != SQLITE_ ## x) {                                \
-            fprintf (stderr, "%s failed with status %d: %s\n",  \
-                     #f, i, sqlite3_errmsg (db));               \
-            exit (1);                                           \
-        }                                                       \
-    }                                                           \
- 
 /** Return status used for database queries */
 typedef enum
 {
   DFYM_OK,                 /**< Everything OK */
   DFYM_NOT_EXISTS,         /**< Database doesn't find any result */
-  DFYM_DATABASE_ERROR      /**< Database error */
+  DFYM_DATABASE_ERROR,     /**< Database error */
+  DFYM_QUERY_ERROR,        /**< Malformed search query */
+  DFYM_CONFLICT,           /**< Target already holds entries of its own */
+  DFYM_SYSTEM_ERROR        /**< Call to the system failed, see \ref dfym_errmsg */
 } dfym_status_t;
 
 /** Option codes for database quering */
@@ -36,30 +17,179 @@ typedef enum
 {
   OPT_FILES = 1 << 0,          /**< Select files */
   OPT_DIRECTORIES = 1 << 1,    /**< Select directories */
-  OPT_RANDOM = 1 << 2          /**< Return results in random order */
+  OPT_RANDOM = 1 << 2,         /**< Return results in random order */
+  OPT_VERIFY = 1 << 3,         /**< Check results against the filesystem */
+  OPT_PRUNE = 1 << 4,          /**< Delete the stale entries found */
+  OPT_SQL = 1 << 5             /**< Evaluate search queries in SQL, see \ref dfym_search_query */
 } query_flag_t;
 
-sqlite3 *dfym_open_or_create_database(char *const);
+/** Flags of \ref dfym_trace */
+typedef enum
+{
+  TRACE_STATEMENTS = 1 << 0,   /**< Write every statement run */
+  TRACE_STATS = 1 << 1         /**< Gather statistics for \ref dfym_trace_report */
+} trace_flag_t;
+
+/** Default milliseconds a writer waits for the database to be unlocked */
+#define DFYM_BUSY_TIMEOUT 5000
+
+/** Default number of taggings per transaction in bulk tagging sessions */
+#define DFYM_BULK_BATCH_SIZE 10000
+
+/** Most fields in a result */
+#define DFYM_MAX_FIELDS 4
+
+/** A dfym context: an open database, with the statements and caches of its
+    connection, see \ref dfym_open_or_create_database. A context is used by
+    one thread at a time, threads serving queries each open their own. */
+typedef struct dfym_ctx dfym_ctx_t;
+
+/** A field of a result */
+typedef struct
+{
+  char const *name;             /**< Name of the field: "path", "tag", ... */
+  char const *value;            /**< Text of the field, NULL for a number */
+  int length;                   /**< Length of the text, in bytes */
+  sqlite3_int64 number;         /**< The number, if there is no text */
+} dfym_field_t;
+
+/** Receiver of the results of a context, see \ref dfym_set_result_handler.
+    The fields are only valid until it returns. */
+typedef void (*dfym_result_handler_t)(dfym_field_t const *, unsigned int, void *);
+
+/** Figures of a check by \ref dfym_gc */
+typedef struct
+{
+  unsigned long int checked;    /**< Files checked */
+  unsigned long int missing;    /**< Files found missing */
+  unsigned long int changed;    /**< Files whose type changed */
+  unsigned long int unchecked;  /**< Files that couldn't be checked */
+  unsigned long int pruned;     /**< Files deleted, with OPT_PRUNE */
+  sqlite3_int64 next;           /**< Id to resume from, 0 if all files up to the last one were checked */
+} dfym_gc_report_t;
+
+/** Receiver of the statements run while tracing with TRACE_STATEMENTS, see
+    \ref dfym_trace: their SQL text with the values bound, the nanoseconds
+    they took and the rows they returned. */
+typedef void (*dfym_trace_handler_t)(char const *, sqlite3_int64, sqlite3_int64, void *);
+
+/** Figures of a statement, in a \ref dfym_trace_report_t */
+typedef struct
+{
+  char const *sql;              /**< SQL text of the statement */
+  unsigned long int runs;       /**< Times it was run */
+  sqlite3_int64 ns;             /**< Nanoseconds spent running it */
+  sqlite3_int64 rows;           /**< Rows it returned */
+  sqlite3_int64 fullscan_steps; /**< Steps of full table scans */
+  sqlite3_int64 sorts;          /**< Sorts done */
+} dfym_trace_statement_t;
+
+/** Statistics gathered while tracing, see \ref dfym_trace_report */
+typedef struct
+{
+  sqlite3_int64 time_us;        /**< Microseconds since tracing started */
+  int page_hits;                /**< Hits of the page cache */
+  int page_misses;              /**< Misses of the page cache */
+  unsigned long int statement_hits;   /**< Hits of the statement cache */
+  unsigned long int statement_misses; /**< Misses of the statement cache */
+  unsigned long int fs_stats;   /**< Files stat'ed */
+  unsigned long int fs_readdirs; /**< Directory entries read */
+  unsigned int n_statements;    /**< Number of statements run */
+  dfym_trace_statement_t *statements; /**< The statements, slowest first */
+} dfym_trace_report_t;
+
+/** Bulk tagging session, see \ref dfym_bulk_tag_begin */
+typedef struct dfym_bulk dfym_bulk_t;
+
+dfym_ctx_t *dfym_open_or_create_database(char const *const);
+
+void dfym_close_database(dfym_ctx_t *);
+
+char const *dfym_errmsg(dfym_ctx_t *);
+
+void dfym_set_result_handler(dfym_ctx_t *, dfym_result_handler_t, void *);
+
+void dfym_result(dfym_ctx_t *, dfym_field_t const *, unsigned int);
+
+int dfym_system_error(dfym_ctx_t *, char const *const, int);
+
+int dfym_migrations(dfym_ctx_t *);
+
+int dfym_optimize(dfym_ctx_t *);
+
+void dfym_set_busy_timeout(dfym_ctx_t *, unsigned int);
+
+void dfym_set_seed(dfym_ctx_t *, sqlite3_int64);
+
+int dfym_refresh_caches(dfym_ctx_t *);
+
+void dfym_statement_cache_stats(dfym_ctx_t *, unsigned long int *, unsigned long int *);
+
+void dfym_trace(dfym_ctx_t *, unsigned int, dfym_trace_handler_t, void *);
+
+dfym_trace_report_t *dfym_trace_report(dfym_ctx_t *);
+
+void dfym_trace_report_free(dfym_trace_report_t *);
+
+int dfym_add_tag(dfym_ctx_t *, char const *const, char const *const);
+
+dfym_bulk_t *dfym_bulk_tag_begin(dfym_ctx_t *, unsigned long int);
+
+int dfym_bulk_tag_add(dfym_bulk_t *, char const *const, char const *const);
+
+int dfym_bulk_tag_end(dfym_bulk_t *, unsigned long int *);
+
+int dfym_untag(dfym_ctx_t *, char const *const, char const *const);
+
+int dfym_show_file_tags(dfym_ctx_t *, char const *const);
+
+int dfym_all_tags(dfym_ctx_t *);
+
+int dfym_tags_with_prefix(dfym_ctx_t *, char const *const, unsigned long int);
+
+int dfym_tags_fuzzy(dfym_ctx_t *, char const *const, int, unsigned long int);
+
+int dfym_tag_counts(dfym_ctx_t *, unsigned long int);
+
+int dfym_empty_tags(dfym_ctx_t *);
+
+int dfym_summary(dfym_ctx_t *);
+
+int dfym_check_tag_stats(dfym_ctx_t *, unsigned long int *);
+
+char **dfym_tagged_dirs(dfym_ctx_t *);
+
+int dfym_batch_begin(dfym_ctx_t *);
+
+int dfym_batch_end(dfym_ctx_t *);
+
+int dfym_all_files(dfym_ctx_t *);
+
+int dfym_all_files_page(dfym_ctx_t *, sqlite3_int64, unsigned long int, sqlite3_int64 *);
+
+int dfym_search_with_tag(dfym_ctx_t *, char const *const, char const *const, unsigned long int, unsigned char);
+
+int dfym_search_page(dfym_ctx_t *, char const *const, sqlite3_int64, unsigned long int, unsigned char, sqlite3_int64 *);
 
-int dfym_add_tag(sqlite3 *, char const *const, char const *const);
+int dfym_search_query(dfym_ctx_t *, char const *const, char const *const, unsigned long int, unsigned char);
 
-int dfym_untag(sqlite3 *, char const *const, char const *const);
+int dfym_find(dfym_ctx_t *, char const *const, unsigned long int, unsigned char);
 
-int dfym_show_file_tags(sqlite3 *, char const *const);
+int dfym_discover_untagged(dfym_ctx_t *, char const *const, unsigned long int, unsigned char);
 
-int dfym_all_tags(sqlite3 *);
+int dfym_discover_untagged_recursive(dfym_ctx_t *, char const *const, unsigned long int, unsigned char, int, unsigned int);
 
-int dfym_all_files(sqlite3 *);
+int dfym_rename_file(dfym_ctx_t *, char const *const, char const *const);
 
-int dfym_search_with_tag(sqlite3 *, char const *const, unsigned long int, unsigned char);
+int dfym_rename_dir(dfym_ctx_t *, char const *const, char const *const, unsigned long int *);
 
-int dfym_discover_untagged(sqlite3 *, char const *const, unsigned long int, unsigned char);
+int dfym_rename_tag(dfym_ctx_t *, char const *const, char const *const);
 
-int dfym_rename_file(sqlite3 *db, char const *const, char const *const);
+int dfym_delete_file(dfym_ctx_t *, char const *const);
 
-int dfym_rename_tag(sqlite3 *db, char const *const, char const *const);
+int dfym_delete_dir(dfym_ctx_t *, char const *const, unsigned long int *);
 
-int dfym_delete_file(sqlite3 *db, char const *const);
+int dfym_delete_tag(dfym_ctx_t *, char const *const);
 
-int dfym_delete_tag(sqlite3 *db, char const *const);
+int dfym_gc(dfym_ctx_t *, sqlite3_int64, sqlite3_int64, unsigned long int, unsigned int, unsigned char, unsigned int, dfym_gc_report_t *);
 
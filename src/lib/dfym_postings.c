@@ -0,0 +1,518 @@
+/** \file
+  * dfym: Compressed posting lists of file ids */
+
+#include <string.h>
+// Glib
+#include <glib.h>
+
+#include "dfym_postings.h"
+
+/** Chunks holding more ids than this are stored as bitmaps */
+#define ARRAY_MAX 4096
+/** 64-bit words in the bitmap of a chunk */
+#define BITMAP_WORDS (65536 / 64)
+
+/** Ids sharing their high 16 bits */
+typedef struct
+{
+  guint16 key;                  /**< High 16 bits of the ids */
+  guint32 cardinality;          /**< Number of ids in the chunk */
+  guint32 allocated;            /**< Capacity of array */
+  guint16 *array;               /**< Sorted low 16 bits, or NULL if bitmap is used */
+  guint64 *bitmap;              /**< Bit set of the low 16 bits, or NULL if array is used */
+} container_t;
+
+struct dfym_postings
+{
+  container_t *containers;      /**< Chunks, sorted by key */
+  guint n;                      /**< Number of chunks */
+  guint allocated;              /**< Capacity of containers */
+};
+
+static guint64 *bitmap_copy (guint64 const *bitmap)
+{
+  guint64 *copy = g_new (guint64, BITMAP_WORDS);
+
+  memcpy (copy, bitmap, BITMAP_WORDS * sizeof (guint64));
+  return copy;
+}
+
+static void container_clear (container_t *c)
+{
+  g_free (c->array);
+  g_free (c->bitmap);
+}
+
+/**
+ * Switch a chunk from the array to the bitmap representation.
+ */
+static void container_to_bitmap (container_t *c)
+{
+  c->bitmap = g_new0 (guint64, BITMAP_WORDS);
+  for (guint32 i = 0; i < c->cardinality; i++)
+    c->bitmap[c->array[i] >> 6] |= (guint64)1 << (c->array[i] & 63);
+  g_free (c->array);
+  c->array = NULL;
+  c->allocated = 0;
+}
+
+/**
+ * Switch a chunk to the array representation if it got sparse enough.
+ */
+static void container_shrink (container_t *c)
+{
+  guint32 n = 0;
+
+  if (!c->bitmap || c->cardinality > ARRAY_MAX)
+    return;
+  c->array = g_new (guint16, MAX (c->cardinality, 1));
+  c->allocated = MAX (c->cardinality, 1);
+  for (guint i = 0; i < BITMAP_WORDS; i++)
+    for (guint64 word = c->bitmap[i]; word; word &= word - 1)
+      c->array[n++] = (i << 6) | __builtin_ctzll (word);
+  g_free (c->bitmap);
+  c->bitmap = NULL;
+}
+
+/**
+ * Build a chunk from a bitmap it takes ownership of.
+ */
+static container_t container_from_bitmap (guint16 key, guint64 *bitmap)
+{
+  container_t c = { key, 0, 0, NULL, bitmap };
+
+  for (guint i = 0; i < BITMAP_WORDS; i++)
+    c.cardinality += __builtin_popcountll (bitmap[i]);
+  container_shrink (&c);
+  return c;
+}
+
+/**
+ * Build a chunk from a sorted array it takes ownership of.
+ */
+static container_t container_from_array (guint16 key, guint16 *array, guint32 n)
+{
+  container_t c = { key, n, n, array, NULL };
+
+  if (n > ARRAY_MAX)
+    container_to_bitmap (&c);
+  return c;
+}
+
+static container_t container_copy (container_t const *c)
+{
+  container_t copy = *c;
+
+  if (c->array)
+    {
+      copy.allocated = MAX (c->cardinality, 1);
+      copy.array = g_new (guint16, copy.allocated);
+      memcpy (copy.array, c->array, c->cardinality * sizeof (guint16));
+    }
+  else
+    copy.bitmap = bitmap_copy (c->bitmap);
+  return copy;
+}
+
+/**
+ * Find the position of a value in a sorted array, or where it would go.
+ */
+static guint32 array_search (guint16 const *array, guint32 n, guint16 value)
+{
+  guint32 low = 0, high = n;
+
+  while (low < high)
+    {
+      guint32 middle = (low + high) / 2;
+      if (array[middle] < value)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+  return low;
+}
+
+static gboolean container_contains (container_t const *c, guint16 low)
+{
+  guint32 i;
+
+  if (c->bitmap)
+    return (c->bitmap[low >> 6] >> (low & 63)) & 1;
+  i = array_search (c->array, c->cardinality, low);
+  return i < c->cardinality && c->array[i] == low;
+}
+
+static void container_add (container_t *c, guint16 low)
+{
+  guint32 i;
+
+  if (c->bitmap)
+    {
+      guint64 bit = (guint64)1 << (low & 63);
+      if (!(c->bitmap[low >> 6] & bit))
+        {
+          c->bitmap[low >> 6] |= bit;
+          c->cardinality++;
+        }
+      return;
+    }
+  /* Ids usually come in ascending order, so try appending first */
+  if (c->cardinality && c->array[c->cardinality-1] >= low)
+    {
+      i = array_search (c->array, c->cardinality, low);
+      if (c->array[i] == low)
+        return;
+    }
+  else
+    i = c->cardinality;
+  if (c->cardinality == ARRAY_MAX)
+    {
+      container_to_bitmap (c);
+      container_add (c, low);
+      return;
+    }
+  if (c->cardinality == c->allocated)
+    {
+      c->allocated = MIN (MAX (c->allocated * 2, 4), ARRAY_MAX);
+      c->array = g_renew (guint16, c->array, c->allocated);
+    }
+  memmove (c->array + i + 1, c->array + i, (c->cardinality - i) * sizeof (guint16));
+  c->array[i] = low;
+  c->cardinality++;
+}
+
+/**
+ * Intersect a small sorted array with a much larger one, by binary searching
+ * each value of the small one instead of merging both.
+ */
+static guint32 array_and_gallop (guint16 const *small, guint32 n_small,
+                                 guint16 const *large, guint32 n_large,
+                                 guint16 *out)
+{
+  guint32 n = 0, from = 0;
+
+  for (guint32 i = 0; i < n_small && from < n_large; i++)
+    {
+      from += array_search (large + from, n_large - from, small[i]);
+      if (from < n_large && large[from] == small[i])
+        out[n++] = small[i];
+    }
+  return n;
+}
+
+static container_t container_and (container_t const *a, container_t const *b)
+{
+  guint16 *out;
+  guint32 n = 0;
+
+  if (a->bitmap && b->bitmap)
+    {
+      guint64 *words = g_new (guint64, BITMAP_WORDS);
+      for (guint i = 0; i < BITMAP_WORDS; i++)
+        words[i] = a->bitmap[i] & b->bitmap[i];
+      return container_from_bitmap (a->key, words);
+    }
+  if (a->bitmap)
+    {
+      container_t const *t = a;
+      a = b;
+      b = t;
+    }
+  /* From here on a is an array */
+  out = g_new (guint16, MAX (a->cardinality, 1));
+  if (b->bitmap)
+    {
+      for (guint32 i = 0; i < a->cardinality; i++)
+        if ((b->bitmap[a->array[i] >> 6] >> (a->array[i] & 63)) & 1)
+          out[n++] = a->array[i];
+    }
+  else if (a->cardinality * 32 < b->cardinality)
+    n = array_and_gallop (a->array, a->cardinality, b->array, b->cardinality, out);
+  else if (b->cardinality * 32 < a->cardinality)
+    n = array_and_gallop (b->array, b->cardinality, a->array, a->cardinality, out);
+  else
+    {
+      guint32 i = 0, j = 0;
+      while (i < a->cardinality && j < b->cardinality)
+        {
+          if (a->array[i] < b->array[j])
+            i++;
+          else if (a->array[i] > b->array[j])
+            j++;
+          else
+            {
+              out[n++] = a->array[i];
+              i++;
+              j++;
+            }
+        }
+    }
+  return container_from_array (a->key, out, n);
+}
+
+static container_t container_or (container_t const *a, container_t const *b)
+{
+  if (a->bitmap || b->bitmap)
+    {
+      guint64 *words;
+      if (!a->bitmap)
+        {
+          container_t const *t = a;
+          a = b;
+          b = t;
+        }
+      words = bitmap_copy (a->bitmap);
+      if (b->bitmap)
+        for (guint i = 0; i < BITMAP_WORDS; i++)
+          words[i] |= b->bitmap[i];
+      else
+        for (guint32 i = 0; i < b->cardinality; i++)
+          words[b->array[i] >> 6] |= (guint64)1 << (b->array[i] & 63);
+      return container_from_bitmap (a->key, words);
+    }
+  else
+    {
+      guint16 *out = g_new (guint16, a->cardinality + b->cardinality);
+      guint32 i = 0, j = 0, n = 0;
+      while (i < a->cardinality || j < b->cardinality)
+        {
+          if (j == b->cardinality || (i < a->cardinality && a->array[i] < b->array[j]))
+            out[n++] = a->array[i++];
+          else if (i == a->cardinality || b->array[j] < a->array[i])
+            out[n++] = b->array[j++];
+          else
+            {
+              out[n++] = a->array[i];
+              i++;
+              j++;
+            }
+        }
+      return container_from_array (a->key, out, n);
+    }
+}
+
+static container_t container_and_not (container_t const *a, container_t const *b)
+{
+  if (a->bitmap)
+    {
+      guint64 *words = bitmap_copy (a->bitmap);
+      if (b->bitmap)
+        for (guint i = 0; i < BITMAP_WORDS; i++)
+          words[i] &= ~b->bitmap[i];
+      else
+        for (guint32 i = 0; i < b->cardinality; i++)
+          words[b->array[i] >> 6] &= ~((guint64)1 << (b->array[i] & 63));
+      return container_from_bitmap (a->key, words);
+    }
+  else
+    {
+      guint16 *out = g_new (guint16, MAX (a->cardinality, 1));
+      guint32 n = 0;
+      for (guint32 i = 0; i < a->cardinality; i++)
+        if (!container_contains (b, a->array[i]))
+          out[n++] = a->array[i];
+      return container_from_array (a->key, out, n);
+    }
+}
+
+/**
+ * Append a chunk to a set being built in key order. Empty chunks are dropped.
+ */
+static void postings_append (dfym_postings_t *p, container_t c)
+{
+  if (!c.cardinality)
+    {
+      container_clear (&c);
+      return;
+    }
+  if (p->n == p->allocated)
+    {
+      p->allocated = MAX (p->allocated * 2, 4);
+      p->containers = g_renew (container_t, p->containers, p->allocated);
+    }
+  p->containers[p->n++] = c;
+}
+
+/**
+ * Find the chunk of the given key, or where it would go.
+ */
+static guint postings_search (dfym_postings_t const *p, guint16 key)
+{
+  guint low = 0, high = p->n;
+
+  /* Ids usually come in ascending order, so try the last chunk first */
+  if (p->n && p->containers[p->n-1].key <= key)
+    return p->containers[p->n-1].key == key ? p->n - 1 : p->n;
+  while (low < high)
+    {
+      guint middle = (low + high) / 2;
+      if (p->containers[middle].key < key)
+        low = middle + 1;
+      else
+        high = middle;
+    }
+  return low;
+}
+
+/** Create an empty set of ids.
+ * \return The set, to be freed with \ref dfym_postings_free.
+ */
+dfym_postings_t *dfym_postings_new (void)
+{
+  return g_new0 (dfym_postings_t, 1);
+}
+
+/** Free a set of ids.
+ * \param p The set.
+ */
+void dfym_postings_free (dfym_postings_t *p)
+{
+  if (!p)
+    return;
+  for (guint i = 0; i < p->n; i++)
+    container_clear (&p->containers[i]);
+  g_free (p->containers);
+  g_free (p);
+}
+
+/** Add an id to a set. Adding ids in ascending order is fastest.
+ * \param p The set.
+ * \param id The id to add.
+ */
+void dfym_postings_add (dfym_postings_t *p, guint32 id)
+{
+  guint16 key = id >> 16;
+  guint i = postings_search (p, key);
+
+  if (i == p->n || p->containers[i].key != key)
+    {
+      container_t c = { key, 0, 0, NULL, NULL };
+      if (p->n == p->allocated)
+        {
+          p->allocated = MAX (p->allocated * 2, 4);
+          p->containers = g_renew (container_t, p->containers, p->allocated);
+        }
+      memmove (p->containers + i + 1, p->containers + i, (p->n - i) * sizeof (container_t));
+      p->containers[i] = c;
+      p->n++;
+    }
+  container_add (&p->containers[i], id & 0xffff);
+}
+
+/** Tell whether a set contains an id.
+ * \param p The set.
+ * \param id The id to look for.
+ * \return TRUE if the id is in the set.
+ */
+gboolean dfym_postings_contains (dfym_postings_t const *p, guint32 id)
+{
+  guint i = postings_search (p, id >> 16);
+
+  return i < p->n && p->containers[i].key == id >> 16
+         && container_contains (&p->containers[i], id & 0xffff);
+}
+
+/** Count the ids in a set.
+ * \param p The set.
+ * \return The number of ids.
+ */
+guint64 dfym_postings_cardinality (dfym_postings_t const *p)
+{
+  guint64 n = 0;
+
+  for (guint i = 0; i < p->n; i++)
+    n += p->containers[i].cardinality;
+  return n;
+}
+
+/** Intersect two sets.
+ * \param a A set.
+ * \param b Another set.
+ * \return A new set with the ids found in both.
+ */
+dfym_postings_t *dfym_postings_and (dfym_postings_t const *a, dfym_postings_t const *b)
+{
+  dfym_postings_t *p = dfym_postings_new ();
+  guint i = 0, j = 0;
+
+  while (i < a->n && j < b->n)
+    {
+      if (a->containers[i].key < b->containers[j].key)
+        i++;
+      else if (a->containers[i].key > b->containers[j].key)
+        j++;
+      else
+        postings_append (p, container_and (&a->containers[i++], &b->containers[j++]));
+    }
+  return p;
+}
+
+/** Unite two sets.
+ * \param a A set.
+ * \param b Another set.
+ * \return A new set with the ids found in any of them.
+ */
+dfym_postings_t *dfym_postings_or (dfym_postings_t const *a, dfym_postings_t const *b)
+{
+  dfym_postings_t *p = dfym_postings_new ();
+  guint i = 0, j = 0;
+
+  while (i < a->n || j < b->n)
+    {
+      if (j == b->n || (i < a->n && a->containers[i].key < b->containers[j].key))
+        postings_append (p, container_copy (&a->containers[i++]));
+      else if (i == a->n || b->containers[j].key < a->containers[i].key)
+        postings_append (p, container_copy (&b->containers[j++]));
+      else
+        postings_append (p, container_or (&a->containers[i++], &b->containers[j++]));
+    }
+  return p;
+}
+
+/** Subtract a set from another.
+ * \param a The set to subtract from.
+ * \param b The set to subtract.
+ * \return A new set with the ids of a that aren't in b.
+ */
+dfym_postings_t *dfym_postings_and_not (dfym_postings_t const *a, dfym_postings_t const *b)
+{
+  dfym_postings_t *p = dfym_postings_new ();
+  guint i = 0, j = 0;
+
+  while (i < a->n)
+    {
+      if (j == b->n || a->containers[i].key < b->containers[j].key)
+        postings_append (p, container_copy (&a->containers[i++]));
+      else if (a->containers[i].key > b->containers[j].key)
+        j++;
+      else
+        postings_append (p, container_and_not (&a->containers[i++], &b->containers[j++]));
+    }
+  return p;
+}
+
+/** List the ids of a set in ascending order.
+ * \param p The set.
+ * \param n Where to store the number of ids.
+ * \return A newly allocated array of ids, to be freed with g_free.
+ */
+guint32 *dfym_postings_to_array (dfym_postings_t const *p, guint64 *n)
+{
+  guint32 *ids = g_new (guint32, MAX (dfym_postings_cardinality (p), 1));
+  guint64 k = 0;
+
+  for (guint i = 0; i < p->n; i++)
+    {
+      container_t const *c = &p->containers[i];
+      guint32 high = (guint32)c->key << 16;
+      if (c->array)
+        for (guint32 j = 0; j < c->cardinality; j++)
+          ids[k++] = high | c->array[j];
+      else
+        for (guint w = 0; w < BITMAP_WORDS; w++)
+          for (guint64 word = c->bitmap[w]; word; word &= word - 1)
+            ids[k++] = high | (w << 6) | __builtin_ctzll (word);
+    }
+  *n = k;
+  return ids;
+}
@@ -0,0 +1,27 @@
+/** \file
+  * dfym: Compressed posting lists of file ids */
+
+/** Set of 32-bit ids, split in chunks of 65536 ids sharing their high 16 bits.
+ *
+ * Each chunk stores its low 16 bits either as a sorted array, while it holds
+ * few ids, or as a bitmap of 65536 bits once it gets denser. Set operations
+ * between bitmaps are plain loops over 64-bit words. */
+typedef struct dfym_postings dfym_postings_t;
+
+dfym_postings_t *dfym_postings_new(void);
+
+void dfym_postings_free(dfym_postings_t *);
+
+void dfym_postings_add(dfym_postings_t *, guint32);
+
+gboolean dfym_postings_contains(dfym_postings_t const *, guint32);
+
+guint64 dfym_postings_cardinality(dfym_postings_t const *);
+
+dfym_postings_t *dfym_postings_and(dfym_postings_t const *, dfym_postings_t const *);
+
+dfym_postings_t *dfym_postings_or(dfym_postings_t const *, dfym_postings_t const *);
+
+dfym_postings_t *dfym_postings_and_not(dfym_postings_t const *, dfym_postings_t const *);
+
+guint32 *dfym_postings_to_array(dfym_postings_t const *, guint64 *);
@@ -0,0 +1,372 @@
+/** \file
+  * dfym: Batched filesystem probes, through io_uring or a pool of threads */
+
+#define _GNU_SOURCE
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+/* Glib */
+#include <glib.h>
+
+#include "dfym_probe.h"
+
+/** Fields of the statx results used by the probes */
+#define PROBE_MASK (STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO)
+/** Most entries stat'ed by each task of the thread pool */
+#define PROBE_CHUNK 64
+
+#ifdef HAVE_LINUX_IO_URING_H
+/** An io_uring instance, mapped by hand as liburing isn't required */
+typedef struct
+{
+  int fd;                       /**< The ring, -1 if io_uring isn't available */
+  unsigned int entries;         /**< Submission queue entries */
+  void *sq_map;                 /**< Mapping of the submission ring */
+  size_t sq_map_size;           /**< Size of sq_map */
+  void *cq_map;                 /**< Mapping of the completion ring, maybe sq_map */
+  size_t cq_map_size;           /**< Size of cq_map */
+  struct io_uring_sqe *sqes;    /**< The submission queue entries */
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;    /**< The completion queue entries */
+  struct statx *results;        /**< One statx buffer per submission slot */
+  unsigned int *slots;          /**< Slot -> index of its entry in the batch */
+  unsigned int *free_slots;     /**< Stack of unused slots */
+} probe_ring_t;
+#endif
+
+struct dfym_probe
+{
+  unsigned int depth;           /**< Paths stat'ed at once */
+#ifdef HAVE_LINUX_IO_URING_H
+  probe_ring_t ring;            /**< The ring, if io_uring is available */
+#endif
+  GThreadPool *pool;            /**< Fallback pool, created on first use */
+  dfym_probe_entry_t *entries;  /**< The batch being probed by the pool */
+  unsigned int n_entries;       /**< Number of entries of the batch */
+  unsigned int chunk;           /**< Entries per task of the pool */
+  GMutex lock;                  /**< Protects pending */
+  GCond done;                   /**< Signaled when pending drops to 0 */
+  unsigned int pending;         /**< Tasks of the pool not finished yet */
+};
+
+/**
+ * Store the result of a statx in a probe entry.
+ */
+static void probe_store (dfym_probe_entry_t *entry, struct statx const *stx)
+{
+  entry->type = S_ISREG (stx->stx_mode) ? 'f' : S_ISDIR (stx->stx_mode) ? 'd' : 'o';
+  entry->error = 0;
+  entry->size = stx->stx_size;
+  entry->mtime = stx->stx_mtime.tv_sec;
+  /* Same value as st_dev, so that stored metadata compares equal */
+  entry->dev = makedev (stx->stx_dev_major, stx->stx_dev_minor);
+  entry->ino = stx->stx_ino;
+}
+
+/**
+ * Stat a single entry, following symbolic links like stat does.
+ */
+static void probe_one (dfym_probe_entry_t *entry)
+{
+  struct statx stx;
+
+  if (statx (entry->dirfd, entry->path, 0, PROBE_MASK, &stx))
+    {
+      entry->type = 0;
+      entry->error = errno;
+    }
+  else
+    probe_store (entry, &stx);
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+static void probe_ring_close (probe_ring_t *ring)
+{
+  if (ring->fd < 0)
+    return;
+  if (ring->sqes)
+    munmap (ring->sqes, ring->entries * sizeof (struct io_uring_sqe));
+  if (ring->cq_map && ring->cq_map != ring->sq_map)
+    munmap (ring->cq_map, ring->cq_map_size);
+  if (ring->sq_map)
+    munmap (ring->sq_map, ring->sq_map_size);
+  close (ring->fd);
+  g_free (ring->results);
+  g_free (ring->slots);
+  g_free (ring->free_slots);
+  memset (ring, 0, sizeof (*ring));
+  ring->fd = -1;
+}
+
+/**
+ * Set up a ring of the given depth. The ring is left closed if the kernel
+ * doesn't allow io_uring, or is too old for the single mapping of rings that
+ * came with statx support.
+ */
+static void probe_ring_open (probe_ring_t *ring, unsigned int depth)
+{
+  struct io_uring_params params;
+  void *map;
+
+  memset (ring, 0, sizeof (*ring));
+  memset (&params, 0, sizeof (params));
+  if ((ring->fd = syscall (__NR_io_uring_setup, depth, &params)) < 0)
+    {
+      ring->fd = -1;
+      return;
+    }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+      probe_ring_close (ring);
+      return;
+    }
+  ring->entries = params.sq_entries;
+  ring->sq_map_size = MAX (params.sq_off.array + params.sq_entries * sizeof (unsigned int),
+                           params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe));
+  map = mmap (NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring->fd, IORING_OFF_SQ_RING);
+  if (map == MAP_FAILED)
+    {
+      probe_ring_close (ring);
+      return;
+    }
+  ring->sq_map = ring->cq_map = map;
+  ring->cq_map_size = ring->sq_map_size;
+  map = mmap (NULL, ring->entries * sizeof (struct io_uring_sqe), PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (map == MAP_FAILED)
+    {
+      probe_ring_close (ring);
+      return;
+    }
+  ring->sqes = map;
+  ring->sq_head = (unsigned int *)((char *)ring->sq_map + params.sq_off.head);
+  ring->sq_tail = (unsigned int *)((char *)ring->sq_map + params.sq_off.tail);
+  ring->sq_mask = (unsigned int *)((char *)ring->sq_map + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)((char *)ring->sq_map + params.sq_off.array);
+  ring->cq_head = (unsigned int *)((char *)ring->cq_map + params.cq_off.head);
+  ring->cq_tail = (unsigned int *)((char *)ring->cq_map + params.cq_off.tail);
+  ring->cq_mask = (unsigned int *)((char *)ring->cq_map + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_map + params.cq_off.cqes);
+  ring->results = g_new (struct statx, ring->entries);
+  ring->slots = g_new (unsigned int, ring->entries);
+  ring->free_slots = g_new (unsigned int, ring->entries);
+}
+
+/**
+ * Stat a batch through the ring, keeping it as full as possible.
+ * \return 0 on success, -1 if the ring failed and the batch must be redone.
+ */
+static int probe_ring_run (probe_ring_t *ring, dfym_probe_entry_t *entries, unsigned int n)
+{
+  unsigned int next = 0, in_flight = 0, n_free = ring->entries;
+  int failed = 0;
+
+  for (unsigned int k = 0; k < ring->entries; k++)
+    ring->free_slots[k] = k;
+  /* Once failed, the requests in flight are still waited for, as the kernel
+     writes their results into our buffers */
+  while ((next < n && !failed) || in_flight)
+    {
+      unsigned int tail = *ring->sq_tail;
+      unsigned int head = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+      unsigned int to_submit;
+
+      while (next < n && !failed && n_free && tail - head < ring->entries)
+        {
+          unsigned int index = tail & *ring->sq_mask;
+          unsigned int slot = ring->free_slots[--n_free];
+          struct io_uring_sqe *sqe = &ring->sqes[index];
+
+          memset (sqe, 0, sizeof (*sqe));
+          sqe->opcode = IORING_OP_STATX;
+          sqe->fd = entries[next].dirfd;
+          sqe->addr = (guint64)(guintptr)entries[next].path;
+          sqe->len = PROBE_MASK;
+          sqe->off = (guint64)(guintptr)&ring->results[slot];
+          sqe->user_data = slot;
+          ring->slots[slot] = next++;
+          ring->sq_array[index] = index;
+          tail++;
+          in_flight++;
+        }
+      __atomic_store_n (ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+      /* Submit whatever the kernel didn't take yet, and wait for one result */
+      to_submit = tail - __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+      if (syscall (__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+          && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+          unsigned int taken = __atomic_load_n (ring->sq_head, __ATOMIC_ACQUIRE);
+
+          /* The requests the kernel didn't take are withdrawn, the ones it
+             took still complete: their results are reaped without waiting
+             in the kernel, which may keep failing */
+          in_flight -= tail - taken;
+          __atomic_store_n (ring->sq_tail, taken, __ATOMIC_RELEASE);
+          if (failed && in_flight)
+            g_usleep (1000);
+          failed = 1;
+        }
+
+      head = *ring->cq_head;
+      tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+      for (; head != tail; head++)
+        {
+          struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+          unsigned int slot = cqe->user_data;
+          dfym_probe_entry_t *entry = &entries[ring->slots[slot]];
+
+          /* A kernel without statx in io_uring rejects the operation itself */
+          if (cqe->res == -EINVAL)
+            failed = 1;
+          else if (cqe->res < 0)
+            {
+              entry->type = 0;
+              entry->error = -cqe->res;
+            }
+          else
+            probe_store (entry, &ring->results[slot]);
+          ring->free_slots[n_free++] = slot;
+          in_flight--;
+        }
+      __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+  return failed ? -1 : 0;
+}
+#endif
+
+/**
+ * Task of the pool: stat a chunk of the batch, given by the index of its
+ * first entry plus one.
+ */
+static void probe_task (gpointer task, gpointer data)
+{
+  dfym_probe_t *probe = data;
+  unsigned int first = GPOINTER_TO_UINT (task) - 1;
+  unsigned int last = MIN (first + probe->chunk, probe->n_entries);
+
+  for (unsigned int k = first; k < last; k++)
+    probe_one (&probe->entries[k]);
+  g_mutex_lock (&probe->lock);
+  if (!--probe->pending)
+    g_cond_signal (&probe->done);
+  g_mutex_unlock (&probe->lock);
+}
+
+/**
+ * Stat a batch with the pool of threads, in chunks small enough to keep every
+ * thread busy.
+ */
+static void probe_pool_run (dfym_probe_t *probe, dfym_probe_entry_t *entries, unsigned int n)
+{
+  if (!probe->pool)
+    probe->pool = g_thread_pool_new (probe_task, probe, probe->depth, TRUE, NULL);
+  probe->entries = entries;
+  probe->n_entries = n;
+  probe->chunk = CLAMP (n / (probe->depth * 4), 1, PROBE_CHUNK);
+  probe->pending = (n + probe->chunk - 1) / probe->chunk;
+  for (unsigned int k = 0; k < n; k += probe->chunk)
+    g_thread_pool_push (probe->pool, GUINT_TO_POINTER (k + 1), NULL);
+  g_mutex_lock (&probe->lock);
+  while (probe->pending)
+    g_cond_wait (&probe->done, &probe->lock);
+  g_mutex_unlock (&probe->lock);
+}
+
+/** Create a filesystem probe.
+ *
+ * io_uring is used if the kernel allows it, unless the DFYM_NO_IO_URING
+ * environment variable is set; a pool of threads is used otherwise.
+ *
+ * \param depth Number of paths stat'ed at once (0 for \ref DFYM_PROBE_DEPTH).
+ * \return The probe, to free with \ref dfym_probe_free.
+ */
+dfym_probe_t *dfym_probe_new (unsigned int depth)
+{
+  dfym_probe_t *probe = g_new0 (dfym_probe_t, 1);
+
+  probe->depth = depth ? depth : DFYM_PROBE_DEPTH;
+  g_mutex_init (&probe->lock);
+  g_cond_init (&probe->done);
+#ifdef HAVE_LINUX_IO_URING_H
+  if (getenv ("DFYM_NO_IO_URING"))
+    probe->ring.fd = -1;
+  else
+    probe_ring_open (&probe->ring, probe->depth);
+#endif
+  return probe;
+}
+
+/** Free a filesystem probe.
+ *
+ * \param probe The probe.
+ */
+void dfym_probe_free (dfym_probe_t *probe)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+  probe_ring_close (&probe->ring);
+#endif
+  if (probe->pool)
+    g_thread_pool_free (probe->pool, FALSE, TRUE);
+  g_mutex_clear (&probe->lock);
+  g_cond_clear (&probe->done);
+  g_free (probe);
+}
+
+/** Tell how a probe stats its batches.
+ *
+ * \param probe The probe.
+ * \return "io_uring" or "threads".
+ */
+char const *dfym_probe_engine (dfym_probe_t const *probe)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+  if (probe->ring.fd >= 0)
+    return "io_uring";
+#endif
+  return "threads";
+}
+
+/** Stat every entry of a batch, following symbolic links like stat does.
+ *
+ * Returns once the whole batch is done, with the results stored in the
+ * entries themselves. Batches of a single entry are stat'ed right away.
+ *
+ * \param probe The probe.
+ * \param entries The entries to stat.
+ * \param n Number of entries.
+ */
+void dfym_probe_run (dfym_probe_t *probe, dfym_probe_entry_t *entries, unsigned int n)
+{
+  if (n <= 1 || probe->depth <= 1)
+    {
+      for (unsigned int k = 0; k < n; k++)
+        probe_one (&entries[k]);
+      return;
+    }
+#ifdef HAVE_LINUX_IO_URING_H
+  if (probe->ring.fd >= 0)
+    {
+      if (!probe_ring_run (&probe->ring, entries, n))
+        return;
+      /* The ring is of no use on this kernel, the pool takes over for good */
+      probe_ring_close (&probe->ring);
+    }
+#endif
+  probe_pool_run (probe, entries, n);
+}
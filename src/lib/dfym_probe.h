@@ -0,0 +1,35 @@
+/** \file
+  * dfym: Batched filesystem probes
+  *
+  * Checking files one stat at a time pays a full round trip for each of them,
+  * which adds up on network filesystems. A probe takes a whole batch of paths
+  * and has them stat'ed concurrently, through io_uring where the kernel
+  * offers it and through a pool of threads otherwise. Results are stored in
+  * the entries of the batch, so callers still go through them in order. */
+
+/** Default number of paths being stat'ed at once */
+#define DFYM_PROBE_DEPTH 32
+
+/** A path to stat, and what was found */
+typedef struct
+{
+  int dirfd;                    /**< Directory of a relative path, or AT_FDCWD */
+  char const *path;             /**< The path, kept valid until the batch is done */
+  char type;                    /**< 'f', 'd' or 'o' as found, 0 if the stat failed */
+  int error;                    /**< errno of the stat, 0 if it succeeded */
+  gint64 size;                  /**< Size of the file */
+  gint64 mtime;                 /**< Modification time of the file, in seconds */
+  gint64 dev;                   /**< Device holding the file */
+  gint64 ino;                   /**< Inode of the file */
+} dfym_probe_entry_t;
+
+/** A filesystem probe, see \ref dfym_probe_new */
+typedef struct dfym_probe dfym_probe_t;
+
+dfym_probe_t *dfym_probe_new(unsigned int);
+
+void dfym_probe_free(dfym_probe_t *);
+
+char const *dfym_probe_engine(dfym_probe_t const *);
+
+void dfym_probe_run(dfym_probe_t *, dfym_probe_entry_t *, unsigned int);
@@ -0,0 +1,199 @@
+/** \file
+  * dfym: Trie of names, for lookups tolerating typos */
+
+#include <string.h>
+// Glib
+#include <glib.h>
+
+#include "dfym_trie.h"
+
+/** A prefix shared by some names */
+typedef struct
+{
+  guint32 first;                /**< Index of the first child */
+  guint16 n;                    /**< Number of children */
+  guint8 byte;                  /**< Last byte of the prefix */
+  guint8 terminal;              /**< Whether the prefix is a name itself */
+} trie_node_t;
+
+struct dfym_trie
+{
+  GArray *nodes;                /**< The nodes, the empty prefix first */
+};
+
+/** State of a fuzzy lookup */
+typedef struct
+{
+  trie_node_t const *nodes;     /**< Nodes of the trie */
+  guint8 const *query;          /**< The name looked up */
+  guint length;                 /**< Length of the query */
+  guint max_distance;           /**< Most edits allowed */
+  GString *prefix;              /**< Prefix of the node being visited */
+  GArray *matches;              /**< Names found, as dfym_trie_match_t */
+} fuzzy_t;
+
+/**
+ * Fill the node at index of the names from low to high, which share their
+ * first depth bytes, and the nodes below it.
+ */
+static void trie_build (GArray *nodes, guint index,
+                        char *const *names, guint low, guint high, guint depth)
+{
+  guint first = nodes->len, n = 0;
+
+  /* Sorted names put the prefix itself first */
+  if (low < high && !names[low][depth])
+    {
+      g_array_index (nodes, trie_node_t, index).terminal = 1;
+      low++;
+    }
+  /* The children are kept next to each other, before their own children */
+  for (guint k = low; k < high; k++)
+    if (k == low || names[k][depth] != names[k-1][depth])
+      {
+        trie_node_t child = { 0, 0, names[k][depth], 0 };
+        g_array_append_val (nodes, child);
+        n++;
+      }
+  g_array_index (nodes, trie_node_t, index).first = first;
+  g_array_index (nodes, trie_node_t, index).n = n;
+
+  for (guint c = 0, start = low; c < n; c++)
+    {
+      guint end = start;
+      while (end < high && names[end][depth] == names[start][depth])
+        end++;
+      trie_build (nodes, first + c, names, start, end, depth + 1);
+      start = end;
+    }
+}
+
+/**
+ * Add every name below a node to the matches, at the given distance.
+ */
+static void fuzzy_collect (fuzzy_t *fuzzy, trie_node_t const *node, guint distance)
+{
+  if (node->terminal)
+    {
+      dfym_trie_match_t match = { g_strndup (fuzzy->prefix->str, fuzzy->prefix->len), distance };
+      g_array_append_val (fuzzy->matches, match);
+    }
+  for (guint k = 0; k < node->n; k++)
+    {
+      trie_node_t const *child = &fuzzy->nodes[node->first + k];
+      g_string_append_c (fuzzy->prefix, child->byte);
+      fuzzy_collect (fuzzy, child, distance);
+      g_string_truncate (fuzzy->prefix, fuzzy->prefix->len - 1);
+    }
+}
+
+/**
+ * Visit a node, given the row of the Levenshtein matrix of its prefix against
+ * the query, and the least distance between the query and the prefixes of
+ * the path so far.
+ */
+static void fuzzy_visit (fuzzy_t *fuzzy, trie_node_t const *node,
+                         guint const *row, guint best)
+{
+  guint length = fuzzy->length;
+  guint *next = g_new (guint, length + 1);
+
+  if (node->terminal && best <= fuzzy->max_distance)
+    {
+      dfym_trie_match_t match = { g_strndup (fuzzy->prefix->str, fuzzy->prefix->len), best };
+      g_array_append_val (fuzzy->matches, match);
+    }
+  for (guint k = 0; k < node->n; k++)
+    {
+      trie_node_t const *child = &fuzzy->nodes[node->first + k];
+      guint least, child_best;
+
+      least = next[0] = row[0] + 1;
+      for (guint j = 1; j <= length; j++)
+        {
+          guint cost = row[j-1] + (fuzzy->query[j-1] != child->byte);
+          next[j] = MIN (MIN (row[j] + 1, next[j-1] + 1), cost);
+          least = MIN (least, next[j]);
+        }
+      child_best = MIN (best, next[length]);
+      g_string_append_c (fuzzy->prefix, child->byte);
+      if (least <= fuzzy->max_distance)
+        fuzzy_visit (fuzzy, child, next, child_best);
+      /* The distance can only grow below, but the names there still
+         start with a prefix close enough to the query */
+      else if (child_best <= fuzzy->max_distance)
+        fuzzy_collect (fuzzy, child, child_best);
+      g_string_truncate (fuzzy->prefix, fuzzy->prefix->len - 1);
+    }
+  g_free (next);
+}
+
+static int compare_matches (gconstpointer a, gconstpointer b)
+{
+  dfym_trie_match_t const *x = a, *y = b;
+
+  if (x->distance != y->distance)
+    return x->distance < y->distance ? -1 : 1;
+  return strcmp (x->name, y->name);
+}
+
+/** Build a trie of names.
+ *
+ * \param names The names, sorted in the order of strcmp and without
+ * duplicates. They aren't kept.
+ * \param n The number of names.
+ * \return The trie, to free with \ref dfym_trie_free.
+ */
+dfym_trie_t *dfym_trie_new (char *const *names, guint n)
+{
+  dfym_trie_t *trie = g_new (dfym_trie_t, 1);
+  trie_node_t root = { 0, 0, 0, 0 };
+
+  trie->nodes = g_array_sized_new (FALSE, FALSE, sizeof (trie_node_t), n * 4 + 1);
+  g_array_append_val (trie->nodes, root);
+  trie_build (trie->nodes, 0, names, 0, n, 0);
+  return trie;
+}
+
+/** Free a trie.
+ */
+void dfym_trie_free (dfym_trie_t *trie)
+{
+  g_array_free (trie->nodes, TRUE);
+  g_free (trie);
+}
+
+/** Find the names starting close to a query.
+ *
+ * A name matches if one of its prefixes is at most max_distance insertions,
+ * deletions or substitutions of bytes away from the query, so that names
+ * being typed are found with their typos.
+ * \param trie The trie.
+ * \param query The name looked up.
+ * \param max_distance Most edits allowed, up to \ref DFYM_TRIE_MAX_DISTANCE.
+ * \return The matches as dfym_trie_match_t, closest first and then in the
+ * order of strcmp. Free their names and the array.
+ */
+GArray *dfym_trie_fuzzy (dfym_trie_t const *trie, char const *query, unsigned int max_distance)
+{
+  fuzzy_t fuzzy;
+  guint *row;
+
+  fuzzy.nodes = (trie_node_t const *)trie->nodes->data;
+  fuzzy.query = (guint8 const *)query;
+  fuzzy.length = strlen (query);
+  fuzzy.max_distance = MIN (max_distance, DFYM_TRIE_MAX_DISTANCE);
+  fuzzy.prefix = g_string_new (NULL);
+  fuzzy.matches = g_array_new (FALSE, FALSE, sizeof (dfym_trie_match_t));
+
+  /* Row of the empty prefix: the query deleted byte by byte */
+  row = g_new (guint, fuzzy.length + 1);
+  for (guint j = 0; j <= fuzzy.length; j++)
+    row[j] = j;
+  fuzzy_visit (&fuzzy, fuzzy.nodes, row, fuzzy.length);
+  g_free (row);
+
+  g_string_free (fuzzy.prefix, TRUE);
+  g_array_sort (fuzzy.matches, compare_matches);
+  return fuzzy.matches;
+}
@@ -0,0 +1,27 @@
+/** \file
+  * dfym: Trie of names, for lookups tolerating typos */
+
+/** Most edits allowed between a query and the names it matches */
+#define DFYM_TRIE_MAX_DISTANCE 3
+
+/** Set of names, sharing their common prefixes.
+ *
+ * The trie is built at once from sorted names, into a single array of nodes
+ * where the children of every node follow each other in the order of their
+ * bytes. Looking names up within an edit distance computes one row of the
+ * Levenshtein matrix per node, shared by all the names below it, and skips
+ * the branches that can't come close enough. */
+typedef struct dfym_trie dfym_trie_t;
+
+/** A name found by \ref dfym_trie_fuzzy */
+typedef struct
+{
+  char *name;                   /**< The name, owned by the caller */
+  unsigned int distance;        /**< Edits between the query and a prefix of the name */
+} dfym_trie_match_t;
+
+dfym_trie_t *dfym_trie_new(char *const *, guint);
+
+void dfym_trie_free(dfym_trie_t *);
+
+GArray *dfym_trie_fuzzy(dfym_trie_t const *, char const *, unsigned int);
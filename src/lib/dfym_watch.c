@@ -0,0 +1,483 @@
+/** \file
+  * dfym: Keeping the database in sync with the filesystem through inotify */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+// SQLite
+#include <sqlite3.h>
+// Glib
+#include <glib.h>
+
+#include "dfym_base.h"
+#include "dfym_watch.h"
+
+/** Events on the directories below a root, watched for changes */
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                    | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+/** Events on the parent of a root, watched for the root to move or go */
+#define PARENT_MASK (IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+                     | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+/** Milliseconds without events that end a burst */
+#define BURST_QUIET 200
+/** Milliseconds after which a burst is written even if events keep coming */
+#define BURST_MAX 2000
+/** Changes after which a burst is written even if events keep coming */
+#define BURST_CHANGES 10000
+
+/** A watched directory */
+typedef struct
+{
+  char *path;                   /**< Current path of the directory */
+  int recursive;                /**< Whether new subdirectories get watched too */
+} watch_t;
+
+/** A change to apply to the database */
+typedef struct
+{
+  char *from;                   /**< Path that was moved or deleted */
+  char *to;                     /**< Path it was moved to, NULL for a deletion */
+  int is_dir;                   /**< Whether it is a directory */
+  gint64 time;                  /**< When it was moved away, while waiting for its destination */
+} change_t;
+
+/** State of the watcher */
+typedef struct
+{
+  dfym_ctx_t *ctx;              /**< The dfym context */
+  int fd;                       /**< The inotify instance */
+  GHashTable *watches;          /**< Watch descriptor -> \ref watch_t */
+  unsigned int max_watches;     /**< Limit of watched directories */
+  int full;                     /**< Whether the limit was hit */
+  GHashTable *moves;            /**< Cookie -> \ref change_t moved away, waiting for its destination */
+  GArray *changes;              /**< Changes of the burst, in order */
+  unsigned long int events;     /**< Events of the burst */
+  gint64 burst_start;           /**< When the first event of the burst came */
+  gint64 last_event;            /**< When the last event of the burst came */
+  dfym_watch_report_t report;   /**< Figures since the start */
+} watcher_t;
+
+static void watch_free (gpointer data)
+{
+  watch_t *watch = data;
+
+  g_free (watch->path);
+  g_free (watch);
+}
+
+static void change_clear (gpointer data)
+{
+  change_t *change = data;
+
+  g_free (change->from);
+  g_free (change->to);
+}
+
+static void change_free (gpointer data)
+{
+  change_clear (data);
+  g_free (data);
+}
+
+/**
+ * Hand a warning to the result handler, and free it.
+ */
+static void watcher_warn (watcher_t *watcher, char *message)
+{
+  dfym_field_t field = { "warning", message, strlen (message), 0 };
+
+  dfym_result (watcher->ctx, &field, 1);
+  g_free (message);
+}
+
+/**
+ * Watch a directory, and all the directories below it if recursive is set.
+ * Symbolic links are not followed.
+ */
+static void watch_add (watcher_t *watcher, char const *const root, int recursive)
+{
+  GQueue pending = G_QUEUE_INIT;
+
+  g_queue_push_tail (&pending, g_strdup (root));
+  while (!g_queue_is_empty (&pending))
+    {
+      char *path = g_queue_pop_head (&pending);
+      watch_t *watch;
+      DIR *dir;
+      struct dirent *dirent;
+      int wd;
+
+      if (g_hash_table_size (watcher->watches) >= watcher->max_watches)
+        {
+          if (!watcher->full)
+            watcher_warn (watcher, g_strdup_printf ("watching the limit of %u directories, %s and others won't be",
+                                                    watcher->max_watches, path));
+          watcher->full = 1;
+          g_free (path);
+          continue;
+        }
+      if ((wd = inotify_add_watch (watcher->fd, path, recursive ? WATCH_MASK : PARENT_MASK)) < 0)
+        {
+          if (errno == ENOSPC && !watcher->full)
+            watcher_warn (watcher, g_strdup_printf ("out of inotify watches at %s, see /proc/sys/fs/inotify/max_user_watches", path));
+          watcher->full |= errno == ENOSPC;
+          g_free (path);
+          continue;
+        }
+      /* A directory may be both the parent of a root and below another */
+      if ((watch = g_hash_table_lookup (watcher->watches, GINT_TO_POINTER (wd))))
+        {
+          if (recursive && !watch->recursive)
+            inotify_add_watch (watcher->fd, path, WATCH_MASK);
+          watch->recursive |= recursive;
+        }
+      else
+        {
+          watch = g_new (watch_t, 1);
+          watch->path = g_strdup (path);
+          watch->recursive = recursive;
+          g_hash_table_insert (watcher->watches, GINT_TO_POINTER (wd), watch);
+        }
+
+      if (recursive && (dir = opendir (path)))
+        {
+          while ((dirent = readdir (dir)))
+            /* Watching anything else than a directory fails, thanks to IN_ONLYDIR */
+            if ((dirent->d_type == DT_DIR || dirent->d_type == DT_UNKNOWN)
+                && strcmp (dirent->d_name, ".") && strcmp (dirent->d_name, ".."))
+              g_queue_push_tail (&pending, g_build_filename (path, dirent->d_name, NULL));
+          closedir (dir);
+        }
+      g_free (path);
+    }
+}
+
+/**
+ * Stop watching a directory and the directories below it.
+ */
+static void watch_remove (watcher_t *watcher, char const *const path)
+{
+  size_t length = strlen (path);
+  GHashTableIter iter;
+  gpointer wd, data;
+
+  g_hash_table_iter_init (&iter, watcher->watches);
+  while (g_hash_table_iter_next (&iter, &wd, &data))
+    {
+      watch_t *watch = data;
+      if (!strncmp (watch->path, path, length)
+          && (!watch->path[length] || watch->path[length] == G_DIR_SEPARATOR))
+        {
+          inotify_rm_watch (watcher->fd, GPOINTER_TO_INT (wd));
+          g_hash_table_iter_remove (&iter);
+        }
+    }
+}
+
+/**
+ * Update the paths of the directories watched below a directory that moved.
+ */
+static void watch_move (watcher_t *watcher, char const *const from, char const *const to)
+{
+  size_t length = strlen (from);
+  GHashTableIter iter;
+  gpointer data;
+
+  g_hash_table_iter_init (&iter, watcher->watches);
+  while (g_hash_table_iter_next (&iter, NULL, &data))
+    {
+      watch_t *watch = data;
+      if (!strncmp (watch->path, from, length)
+          && (!watch->path[length] || watch->path[length] == G_DIR_SEPARATOR))
+        {
+          char *path = g_strconcat (to, watch->path + length, NULL);
+          g_free (watch->path);
+          watch->path = path;
+        }
+    }
+}
+
+static int compare_roots (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(char *const *)a, *(char *const *)b);
+}
+
+static void watcher_change (watcher_t *watcher, char *from, char *to, int is_dir)
+{
+  change_t change = { from, to, is_dir, 0 };
+
+  g_array_append_val (watcher->changes, change);
+}
+
+/**
+ * Handle one event: keep the watched directories up to date right away, and
+ * queue the change to the database for the end of the burst.
+ */
+static void watcher_event (watcher_t *watcher, struct inotify_event const *event)
+{
+  watch_t *watch = g_hash_table_lookup (watcher->watches, GINT_TO_POINTER (event->wd));
+  int is_dir = !!(event->mask & IN_ISDIR);
+  char *path;
+  change_t *moved;
+
+  if (event->mask & IN_Q_OVERFLOW)
+    {
+      watcher_warn (watcher, g_strdup ("inotify queue overflow, some changes were missed"));
+      return;
+    }
+  if (event->mask & IN_IGNORED)
+    {
+      g_hash_table_remove (watcher->watches, GINT_TO_POINTER (event->wd));
+      return;
+    }
+  if (!watch || !event->len)
+    return;
+  path = g_build_filename (watch->path, event->name, NULL);
+
+  if (event->mask & IN_MOVED_FROM)
+    {
+      moved = g_new0 (change_t, 1);
+      moved->from = path;
+      moved->is_dir = is_dir;
+      moved->time = watcher->last_event;
+      g_hash_table_replace (watcher->moves, GUINT_TO_POINTER (event->cookie), moved);
+    }
+  else if (event->mask & IN_MOVED_TO)
+    {
+      if ((moved = g_hash_table_lookup (watcher->moves, GUINT_TO_POINTER (event->cookie))))
+        {
+          if (is_dir)
+            watch_move (watcher, moved->from, path);
+          watcher_change (watcher, g_strdup (moved->from), path, is_dir);
+          g_hash_table_remove (watcher->moves, GUINT_TO_POINTER (event->cookie));
+        }
+      else
+        {
+          /* Moved in from outside: nothing of it is known, but watch it */
+          if (is_dir && watch->recursive)
+            watch_add (watcher, path, 1);
+          g_free (path);
+        }
+    }
+  else if (event->mask & IN_DELETE)
+    watcher_change (watcher, path, NULL, is_dir);
+  else
+    {
+      if ((event->mask & IN_CREATE) && is_dir && watch->recursive)
+        watch_add (watcher, path, 1);
+      g_free (path);
+    }
+}
+
+/**
+ * Write the changes of a burst to the database in a single transaction.
+ * Entries moved away and not seen arriving after a quiet period left the
+ * watched directories, and are deleted. A burst written before it ends, as
+ * it is too long or too large, keeps the entries moved away since the last
+ * quiet period: their destination may still come in the next one.
+ */
+static void watcher_flush (watcher_t *watcher, int quiet)
+{
+  GHashTableIter iter;
+  gpointer data;
+  gint64 start, elapsed;
+  gint64 recent = g_get_monotonic_time () - BURST_QUIET * 1000;
+  unsigned long int rows = 0, count;
+  dfym_field_t fields[] = { { "events" }, { "burst_us" }, { "files" }, { "time_us" } };
+
+  g_hash_table_iter_init (&iter, watcher->moves);
+  while (g_hash_table_iter_next (&iter, NULL, &data))
+    {
+      change_t *moved = data;
+      if (!quiet && moved->time > recent)
+        continue;
+      if (moved->is_dir)
+        watch_remove (watcher, moved->from);
+      watcher_change (watcher, g_strdup (moved->from), NULL, moved->is_dir);
+      g_hash_table_iter_remove (&iter);
+    }
+  if (!watcher->changes->len)
+    {
+      watcher->events = 0;
+      return;
+    }
+
+  start = g_get_monotonic_time ();
+  dfym_batch_begin (watcher->ctx);
+  for (guint k = 0; k < watcher->changes->len; k++)
+    {
+      change_t *change = &g_array_index (watcher->changes, change_t, k);
+      count = 0;
+      if (change->to && change->is_dir)
+        {
+          if (dfym_rename_dir (watcher->ctx, change->from, change->to, &count) == DFYM_CONFLICT)
+            watcher_warn (watcher, g_strdup_printf ("can't move %s to %s, files were already tagged there",
+                                                    change->from, change->to));
+        }
+      else if (change->to)
+        {
+          /* A tagged file replaced by the move loses its tags */
+          dfym_delete_file (watcher->ctx, change->to);
+          count = dfym_rename_file (watcher->ctx, change->from, change->to) == DFYM_OK;
+        }
+      else if (change->is_dir)
+        dfym_delete_dir (watcher->ctx, change->from, &count);
+      else
+        count = dfym_delete_file (watcher->ctx, change->from) == DFYM_OK;
+      rows += count;
+    }
+  if (dfym_batch_end (watcher->ctx) != DFYM_OK)
+    {
+      watcher_warn (watcher, g_strdup_printf ("%s, %lu events lost",
+                                              dfym_errmsg (watcher->ctx), watcher->events));
+      watcher->report.lost += watcher->events;
+      rows = 0;
+    }
+  elapsed = g_get_monotonic_time () - start;
+
+  fields[0].number = watcher->events;
+  fields[1].number = watcher->last_event - watcher->burst_start;
+  fields[2].number = rows;
+  fields[3].number = elapsed;
+  dfym_result (watcher->ctx, fields, G_N_ELEMENTS (fields));
+  watcher->report.events += watcher->events;
+  watcher->report.files += rows;
+  watcher->report.write_time_us += elapsed;
+  watcher->report.max_write_us = MAX (watcher->report.max_write_us, elapsed);
+  watcher->report.writes++;
+  watcher->events = 0;
+  g_array_set_size (watcher->changes, 0);
+}
+
+/** Watch directories and apply the moves and deletions done in them.
+ *
+ * Without roots, the directories holding tagged files are watched, each one
+ * along with all the directories below it. The parent of every root is
+ * watched too, to see the root itself move or go. Events are gathered in
+ * bursts, which end after a short time without events, and every burst is
+ * written in a single transaction. A move within the watched directories is
+ * a rename, while anything deleted or moved out of them is deleted from the
+ * database.
+ *
+ * Once the directories are watched, a result tells how many were
+ * "watched". Every burst written is a result with the "events" received, the
+ * "burst_us" they came in, and the "files" updated in "time_us". Problems
+ * that don't end the watch, like a directory that can't be watched or a
+ * burst that failed to be written, are results with a "warning".
+ *
+ * \param ctx The dfym context.
+ * \param roots NULL-terminated paths of the directories to watch, or NULL.
+ * \param max_watches Limit of directories watched at once, 0 for the default.
+ * \param stop Flag that ends the watch when set, typically by a signal.
+ * \param report Where to put the figures of the watch, or NULL.
+ * \return Error code \ref dfym_status_t, DFYM_SYSTEM_ERROR if inotify can't
+ * be used.
+ */
+int dfym_watch (dfym_ctx_t *ctx,
+                char **roots,
+                unsigned int max_watches,
+                volatile sig_atomic_t const *stop,
+                dfym_watch_report_t *report)
+{
+  watcher_t watcher = {
+    .ctx = ctx,
+    .max_watches = max_watches ? max_watches : DFYM_WATCH_MAX
+  };
+  GPtrArray *sorted;
+  char **tagged = NULL, *last_root = NULL;
+  dfym_field_t watched = { "watched" };
+  char buffer[65536] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+  if (!roots && !(roots = tagged = dfym_tagged_dirs (ctx)))
+    return DFYM_DATABASE_ERROR;
+  if ((watcher.fd = inotify_init1 (IN_CLOEXEC)) < 0)
+    {
+      int errnum = errno;
+      g_strfreev (tagged);
+      return dfym_system_error (ctx, "inotify_init1", errnum);
+    }
+  watcher.watches = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, watch_free);
+  watcher.moves = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, change_free);
+  watcher.changes = g_array_new (FALSE, FALSE, sizeof (change_t));
+  g_array_set_clear_func (watcher.changes, change_clear);
+
+  sorted = g_ptr_array_new ();
+  for (char **root = roots; *root; root++)
+    g_ptr_array_add (sorted, *root);
+  g_ptr_array_sort (sorted, compare_roots);
+  g_ptr_array_add (sorted, NULL);
+
+  /* Once sorted, directories below the previous root are already covered */
+  for (char **root = (char **)sorted->pdata; *root; root++)
+    {
+      size_t length = last_root ? strlen (last_root) : 0;
+      char *parent;
+      if (last_root && !strncmp (*root, last_root, length)
+          && ((*root)[length] == G_DIR_SEPARATOR || !strcmp (last_root, G_DIR_SEPARATOR_S)))
+        continue;
+      last_root = *root;
+      watch_add (&watcher, *root, 1);
+      parent = g_path_get_dirname (*root);
+      if (strcmp (parent, *root))
+        watch_add (&watcher, parent, 0);
+      g_free (parent);
+    }
+  g_ptr_array_free (sorted, TRUE);
+  g_strfreev (tagged);
+  watcher.report.watched = g_hash_table_size (watcher.watches);
+  watched.number = watcher.report.watched;
+  dfym_result (ctx, &watched, 1);
+
+  while (!*stop)
+    {
+      struct pollfd pfd = { .fd = watcher.fd, .events = POLLIN };
+      int timeout = -1;
+      ssize_t length;
+
+      gint64 now = g_get_monotonic_time ();
+      gint64 deadline = watcher.last_event + BURST_QUIET * 1000;
+
+      /* Moves kept by a burst written early wait for a quiet period */
+      if (watcher.events || g_hash_table_size (watcher.moves))
+        {
+          if (watcher.events)
+            deadline = MIN (deadline, watcher.burst_start + BURST_MAX * 1000);
+          timeout = deadline > now ? (deadline - now + 999) / 1000 : 0;
+        }
+      if (poll (&pfd, 1, timeout) < 0)
+        continue;
+      if (!(pfd.revents & POLLIN))
+        {
+          watcher_flush (&watcher, g_get_monotonic_time () - watcher.last_event >= BURST_QUIET * 1000);
+          continue;
+        }
+      if ((length = read (watcher.fd, buffer, sizeof (buffer))) <= 0)
+        continue;
+      watcher.last_event = g_get_monotonic_time ();
+      for (char *p = buffer; p < buffer + length; )
+        {
+          struct inotify_event const *event = (struct inotify_event const *)p;
+          if (!watcher.events++)
+            watcher.burst_start = g_get_monotonic_time ();
+          watcher_event (&watcher, event);
+          p += sizeof (struct inotify_event) + event->len;
+        }
+      if (watcher.changes->len >= BURST_CHANGES)
+        watcher_flush (&watcher, 0);
+    }
+  watcher_flush (&watcher, 1);
+
+  if (report)
+    *report = watcher.report;
+  close (watcher.fd);
+  g_hash_table_destroy (watcher.watches);
+  g_hash_table_destroy (watcher.moves);
+  g_array_free (watcher.changes, TRUE);
+  return DFYM_OK;
+}
@@ -0,0 +1,19 @@
+/** \file
+  * dfym: Keeping the database in sync with the filesystem through inotify */
+
+/** Default limit of directories watched at once */
+#define DFYM_WATCH_MAX 65536
+
+/** Figures of a watch by \ref dfym_watch */
+typedef struct
+{
+  unsigned int watched;          /**< Directories watched at the start */
+  unsigned long int events;      /**< Events received */
+  unsigned long int files;       /**< Files renamed or deleted */
+  unsigned long int lost;        /**< Events whose changes failed to be written */
+  unsigned long int writes;      /**< Bursts written */
+  sqlite3_int64 write_time_us;   /**< Microseconds spent writing to the database */
+  sqlite3_int64 max_write_us;    /**< Longest write of a burst */
+} dfym_watch_report_t;
+
+int dfym_watch(dfym_ctx_t *, char **, unsigned int, volatile sig_atomic_t const *, dfym_watch_report_t *);